@@ -2,6 +2,10 @@
 #define OSM_TOOLS_AREA_EXTRACTOR_H
 #include <string>
 #include <cstdlib>
+#include <limits>
+#include <deque>
+#include <condition_variable>
+#include <functional>
 #include <sserialize/spatial/GeoMultiPolygon.h>
 #include <sserialize/spatial/GeoRegionStore.h>
 #include <osmpbf/pbistream.h>
@@ -10,6 +14,13 @@
 #include <osmpbf/iway.h>
 #include <osmpbf/inode.h>
 #include <osmtools/AreaExtractorFilters.h>
+#include <osmtools/PbfBlobFile.h>
+#include <osmtools/NodeStore.h>
+#include <osmtools/WayStore.h>
+#include <osmtools/types.h>
+#include <osmtools/ExtractionCache.h>
+#include <osmtools/ClipRegion.h>
+#include <osmtools/TagStore.h>
 #include <osmpbf/parsehelpers.h>
 
 
@@ -29,21 +40,68 @@ struct MultiPolyResolver {
 		RawWay outerWays;
 	};
 	
+	///Non-owning view of the refs of a way
+	///Refs are node ids, if values is set the mapper is passed values[i] instead of the i-th ref, e.g. a packed location.
+	///Rings are always joined by node id, hence values of different nodes may be equal.
+	struct RawWaySpan {
+		const int64_t * first;
+		const int64_t * last;
+		const int64_t * values;
+		RawWaySpan(const int64_t * first, const int64_t * last, const int64_t * values = 0) : first(first), last(last), values(values) {}
+		RawWaySpan(const RawWay & rw) : first(rw.data()), last(rw.data()+rw.size()), values(0) {}
+		inline const int64_t * begin() const { return first; }
+		inline const int64_t * end() const { return last; }
+		inline uint32_t size() const { return (uint32_t)(last-first); }
+		inline int64_t front() const { return *first; }
+		inline int64_t back() const { return *(last-1); }
+		///the value passed to the mapper for the i-th ref
+		inline int64_t value(uint32_t i) const { return (values ? values[i] : first[i]); }
+	};
+	
+	///A ring assembled from ways, each way is traversed either from front to back or reversed
+	struct RingSegment {
+		uint32_t way;
+		bool reversed;
+		RingSegment(uint32_t way, bool reversed) : way(way), reversed(reversed) {}
+	};
+	typedef std::vector<RingSegment> Ring;
+	
+	///first node, last node and number of nodes of a way
+	struct WayEnds {
+		int64_t front;
+		int64_t back;
+		uint32_t size;
+		WayEnds(int64_t front, int64_t back, uint32_t size) : front(front), back(back), size(size) {}
+	};
+	
+	///Join ways at common endpoints into closed rings without touching their refs.
+	///The endpoints of all ways are indexed in a hash map, hence every join is done in amortized O(1).
+	///Only closed rings with at least 4 nodes are returned, ways with less than 2 nodes are ignored.
+	///@return false if not all ways could be joined into closed rings
+	static bool ringsFromWayEnds(const std::vector<WayEnds> & ways, std::vector<Ring> & rings);
 	static bool closedPolysFromWays(const std::vector<RawWay> & ways, std::vector<RawWay> & closedWays);
 	static bool multiPolyFromWays(const std::vector<RawWay> & innerIn, const std::vector<RawWay> & outerIn, std::vector<RawWay> & innerOut, std::vector<RawWay> & outerOut);
 	
-	///@param mapper maps from node-id to sserialize::spatial::GeoPoint @return either a GeoMultiPolygon or a GeoPolygon
+	///@param mapper maps from node-id to sserialize::spatial::GeoPoint by mapper.at(nodeId) @return either a GeoMultiPolygon or a GeoPolygon
 	template<typename T_ID_GEO_MAPPER>
 	static sserialize::spatial::GeoRegion * multiPolyFromClosedWays(const std::vector<RawWay> & inner, const std::vector<RawWay> & outer, const T_ID_GEO_MAPPER & mapper) {
 		sserialize::spatial::GeoMultiPolygon * mupoptr = new sserialize::spatial::GeoMultiPolygon();
 		sserialize::spatial::GeoMultiPolygon & mupo = *mupoptr;
 		for(std::vector<RawWay>::const_iterator polyit(inner.begin()), end(inner.end()); polyit != end; ++polyit) {
 			mupo.innerPolygons().resize(mupo.innerPolygons().size()+1);
-			sserialize::remap(*polyit, mupo.innerPolygons().back().points(), mapper);
+			sserialize::spatial::GeoPolygon::PointsContainer & points = mupo.innerPolygons().back().points();
+			points.reserve(polyit->size());
+			for(int64_t nodeId : *polyit) {
+				points.push_back(mapper.at(nodeId));
+			}
 		}
 		for(std::vector<RawWay>::const_iterator polyit(outer.begin()), end(outer.end()); polyit != end; ++polyit) {
 			mupo.outerPolygons().resize(mupo.outerPolygons().size()+1);
-			sserialize::remap(*polyit, mupo.outerPolygons().back().points(), mapper);
+			sserialize::spatial::GeoPolygon::PointsContainer & points = mupo.outerPolygons().back().points();
+			points.reserve(polyit->size());
+			for(int64_t nodeId : *polyit) {
+				points.push_back(mapper.at(nodeId));
+			}
 		}
 		if (mupoptr->innerPolygons().size() == 0 && mupoptr->outerPolygons().size() == 1) {
 			using std::swap;
@@ -63,31 +121,259 @@ struct MultiPolyResolver {
 		return multiPolyFromClosedWays(p.innerWays, p.outerWays, mapper);
 	}
 	
+	///Join the member ways of a multipolygon into rings and write the node locations directly into the polygons.
+	///Rings with nodes without location are dropped.
+	///@param mapper provides bool get(int64_t value, std::pair<double, double> & latLon), see RawWaySpan::value()
+	///@param allOk is set to false if not all ways could be joined into closed rings
+	///@return 0 if there is no outer ring, a GeoPolygon if there is exactly one outer and no inner ring, a GeoMultiPolygon otherwise
+	template<typename T_ID_GEO_MAPPER>
+	static sserialize::spatial::GeoRegion * multiPolyFromWaySpans(const std::vector<RawWaySpan> & inner, const std::vector<RawWaySpan> & outer, const T_ID_GEO_MAPPER & mapper, bool & allOk) {
+		if (!outer.size()) {
+			return 0;
+		}
+		std::unique_ptr<sserialize::spatial::GeoMultiPolygon> mupo(new sserialize::spatial::GeoMultiPolygon());
+		allOk = appendRings(outer, mapper, mupo->outerPolygons()) && allOk;
+		if (!mupo->outerPolygons().size()) {
+			return 0;
+		}
+		allOk = appendRings(inner, mapper, mupo->innerPolygons()) && allOk;
+		if (mupo->innerPolygons().size() == 0 && mupo->outerPolygons().size() == 1) {
+			using std::swap;
+			sserialize::spatial::GeoPolygon * gpo = new sserialize::spatial::GeoPolygon();
+			swap(*gpo, mupo->outerPolygons().front());
+			gpo->recalculateBoundary();
+			return gpo;
+		}
+		mupo->recalculateBoundary();
+		return mupo.release();
+	}
+	
+	///Join ways into rings and write the node locations of every ring to writer.
+	///@param mapper provides bool get(int64_t value, std::pair<double, double> & latLon), see RawWaySpan::value()
+	///@param writer provides beginRing(std::size_t sizeHint), addPoint(double lat, double lon) and endRing(bool complete),
+	///       complete is false if a node of the ring has no location
+	///@return false if not all ways could be joined into closed rings
+	template<typename T_ID_GEO_MAPPER, typename T_RING_WRITER>
+	static bool writeRings(const std::vector<RawWaySpan> & ways, const T_ID_GEO_MAPPER & mapper, T_RING_WRITER & writer) {
+		std::vector<WayEnds> wayEnds;
+		wayEnds.reserve(ways.size());
+		for(const RawWaySpan & w : ways) {
+			if (w.size()) {
+				wayEnds.emplace_back(w.front(), w.back(), w.size());
+			}
+			else {
+				wayEnds.emplace_back(0, 0, 0);
+			}
+		}
+		std::vector<Ring> rings;
+		bool allOk = ringsFromWayEnds(wayEnds, rings);
+		std::pair<double, double> p;
+		for(const Ring & ring : rings) {
+			std::size_t ringSize = 1;
+			for(const RingSegment & seg : ring) {
+				ringSize += ways[seg.way].size()-1;
+			}
+			writer.beginRing(ringSize);
+			bool complete = true;
+			for(std::size_t i(0), s(ring.size()); complete && i < s; ++i) {
+				const RawWaySpan & w = ways[ring[i].way];
+				//the first node of a segment is the last node of the previous one
+				uint32_t skip = (i ? 1 : 0);
+				for(uint32_t j(skip), js(w.size()); j < js; ++j) {
+					if (!mapper.get(w.value(ring[i].reversed ? js-1-j : j), p)) {
+						complete = false;
+						break;
+					}
+					writer.addPoint(p.first, p.second);
+				}
+			}
+			writer.endRing(complete);
+		}
+		return allOk;
+	}
+	
+private:
+	//Appends every complete ring as polygon to a PolygonList, rings with missing nodes are dropped, e.g. in extracts cut at a border
+	template<typename T_POLYGON_LIST>
+	struct PolygonListWriter {
+		T_POLYGON_LIST & dest;
+		PolygonListWriter(T_POLYGON_LIST & dest) : dest(dest) {}
+		inline void beginRing(std::size_t sizeHint) {
+			dest.resize(dest.size()+1);
+			dest.back().points().reserve(sizeHint);
+		}
+		inline void addPoint(double lat, double lon) {
+			dest.back().points().emplace_back(lat, lon);
+		}
+		inline void endRing(bool complete) {
+			if (!complete) {
+				dest.resize(dest.size()-1);
+			}
+		}
+	};
+	
+	template<typename T_ID_GEO_MAPPER, typename T_POLYGON_LIST>
+	static bool appendRings(const std::vector<RawWaySpan> & ways, const T_ID_GEO_MAPPER & mapper, T_POLYGON_LIST & dest) {
+		PolygonListWriter<T_POLYGON_LIST> writer(dest);
+		return writeRings(ways, mapper, writer);
+	}
+};
+
+///Receives the geometry of extracted areas directly instead of as GeoRegion objects
+///Every thread uses its own sink
+class RegionSink {
+public:
+	RegionSink() {}
+	virtual ~RegionSink() {}
+	///append the points of the current ring to this storage
+	virtual GeoPointStorageBackend & points() = 0;
+	///the points appended since the last call to endRing() or dropRing() form a ring of the current region
+	virtual void endRing(bool inner) = 0;
+	///remove the points appended since the last call to endRing() or dropRing()
+	virtual void dropRing() = 0;
+	///finish the region of primitive, regions without outer ring are dropped
+	///@return true if the region was added
+	virtual bool endRegion(osmpbf::IPrimitive & primitive) = 0;
+	///add a region that was already assembled
+	virtual void push_back(const sserialize::spatial::GeoRegion & region, osmpbf::IPrimitive & primitive) = 0;
+};
+
+///Collects ids in per-thread append-only buffers which are merged after all threads are done
+///If spilling is enabled, full buffers are appended as sorted runs to a temporary file.
+class IdCollector {
+public:
+	typedef std::vector<int64_t> Buffer;
+public:
+	IdCollector();
+	~IdCollector();
+	///spill a buffer once it holds flushIds ids, 0 keeps all ids in memory (default)
+	void setSpill(std::size_t flushIds);
+	///create a new buffer, call this once per thread
+	///@thread-safety yes
+	Buffer * buffer();
+	///append the ids of buffer to the temporary file if spilling is enabled and buffer is full
+	///@thread-safety yes
+	void flushIfFull(Buffer & buffer);
+	///upper bound of the number of distinct ids, ids of different buffers or runs are counted once per buffer or run
+	uint64_t sizeBound() const;
+	///merge all buffers and spilled ids into a sorted vector without duplicates, this clears all buffers
+	///@thread-safety no
+	std::vector<int64_t> merge(uint32_t threadCount);
+	///merge all buffers and spilled ids into dest, sorted and without duplicates, this clears all buffers
+	///at most about sortMemory Bytes of ids are held in memory
+	///@thread-safety no
+	void merge(sserialize::MMVector<int64_t> & dest, uint64_t sortMemory, uint32_t threadCount);
+private:
+	std::deque<Buffer> m_buffers;
+	std::size_t m_flushIds;
+	//sorted runs of spilled buffers
+	sserialize::MMVector<int64_t> m_spilled;
+	std::mutex m_lock;
 };
 
 }}//end namespace detail::AreaExtractor
 
 class AreaExtractor: public detail::AreaExtractor::Base {
 public:
+	typedef enum {
+		NSM_AUTO,
+		///collect the refs of relevant ways first and only store the locations of these nodes
+		NSM_SPARSE,
+		///store the locations of all nodes in an array indexed by node id and assemble ways right after the nodes
+		NSM_DENSE,
+		///sort the node-refs of relevant ways by node id in temporary files and merge-join them with the nodes of the input
+		NSM_EXTERNAL
+	} NodeStoreMode;
 	struct ValueType {
-		std::unordered_map<std::string, std::string> kv;
+		///row of the projected tags in the TagStore of the extraction
+		TagStore::RowId tags{TagStore::NoRow};
 		std::shared_ptr<sserialize::spatial::GeoRegion> * region;
 	};
+	typedef detail::AreaExtractor::RegionSink RegionSink;
+	///creates the sink of a thread
+	typedef std::function<RegionSink*()> RegionSinkFactory;
 private:
 	typedef std::pair<double, double> Point;
+	class RelationAssemblyPool;
 	struct Context {
-		std::unordered_map<int64_t, detail::AreaExtractor::MultiPolyResolver::RawWay > rawWays;
-		std::mutex rawWaysLock;
+		//refs of the member ways of relevant relations
+		RawWayStore rawWays;
+		detail::AreaExtractor::IdCollector rawWayIds;
+		
+		SparseNodeStore nodes;
+		//prefilter for the node pass
+		NodeIdBitmap neededNodes;
+		detail::AreaExtractor::IdCollector nodeRefs;
+		//nodes inside the clip region, set by a node pass before the ref pass if clip is set and the sparse node store is used
+		NodeIdBitmap clipNodes;
+		detail::AreaExtractor::IdCollector clipNodeIds;
+		bool pruneByClip{false};
 		
-		std::unordered_map<int64_t, Point> nodes;
-		std::mutex nodesLock;
+		//refs of relevant ways, only used if node locations are fetched in partitions
+		RawWayStore areaWays;
+		//the refs of rawWays and areaWays have values with their node locations packed by FixedPointCoord::pack(),
+		//the refs themselves stay node ids to join rings
+		bool packedRefs{false};
+		
+		//refs of relevant ways are collected in areaWays and joined with the nodes by NodeJoiner
+		bool externalRefs{false};
+		//refs of areaWays have AreaRefFlag set in their position
+		static constexpr uint64_t AreaRefFlag = uint64_t(1) << 63;
+		//position of a ref in the ref array of rawWays or areaWays
+		struct JoinRef {
+			int64_t nodeId;
+			uint64_t pos;
+			inline bool operator<(const JoinRef & other) const { return nodeId < other.nodeId || (nodeId == other.nodeId && pos < other.pos); }
+		};
+		struct JoinResult {
+			uint64_t pos;
+			int64_t location;
+			inline bool operator<(const JoinResult & other) const { return pos < other.pos; }
+		};
+		//written by the flushes of rawWays and areaWays during the ref pass, sorted by node id before the join
+		sserialize::MMVector<JoinRef> joinRefs;
+		std::mutex joinRefsLock;
+		sserialize::MMVector<JoinResult> joinResults;
+		std::mutex joinResultsLock;
+		
+		DenseNodeStore denseNodes;
+		bool useDenseNodes{false};
+		
+		//relations with at least largeRelationMinRefs refs are assembled by assemblyPool if it is set
+		RelationAssemblyPool * assemblyPool{0};
+		uint64_t largeRelationMinRefs{0};
+		
+		//if set, regions are written to sinks instead of being passed to the processor
+		RegionSinkFactory sinkFactory;
+		//if set, the tags of every assembled area are projected into this store
+		TagStore * tagStore{0};
+		//if set, regions are emitted in the order of their blobs
+		BlobSequencer * sequencer{0};
+		
+		//exactly one of them is set
+		osmpbf::PbiStream * inFile{0};
+		PbfBlobFile * blobFile{0};
+		bool storeBlobIndex{false};
+		//set if a pass could not read the whole input, the extraction is aborted then
+		bool parseFailed{false};
+		//directory of the sidecar-file of the blob index, see PbfBlobIndex::sidecarFileName
+		std::string blobIndexDirectory;
 		
-		osmpbf::PbiStream & inFile;
 		ExtractionTypes extractionTypes;
 		bool needsName{false};
 		bool verbose{false};
 		bool snapGeometry{false};
-		generics::RCPtr<osmpbf::AbstractTagFilter> externalFilter;
+		//if set, only nodes inside clip are stored
+		const ClipRegion * clip{0};
+		//filters of the configurations of the extraction, areas are passed on with the bits of the configurations they match
+		struct FilterConfiguration {
+			//the filter of the extraction types of the configuration, shared by all functors
+			std::unique_ptr<detail::AreaExtractor::CompiledFilter> compiled;
+			generics::RCPtr<osmpbf::AbstractTagFilter> external;
+		};
+		std::vector<FilterConfiguration> filters;
+		//the compiled filters of all configurations, resolved once per block
+		detail::AreaExtractor::CompiledFilterSet compiledFilters;
 		sserialize::ProgressInfo pinfo;
 		
 		std::atomic<uint32_t> relevantWaysSize;
@@ -95,55 +381,237 @@ private:
 		
 		std::atomic<uint32_t> assembledRelevantWays;
 		std::atomic<uint32_t> assembledRelevantRelations;
+		//areas dropped since their nodes are outside of clip
+		std::atomic<uint32_t> clippedAreas;
+		//relevant ways skipped since their refs are missing in areaWays
+		std::atomic<uint32_t> missingRefsWays;
 		
-		Context(osmpbf::PbiStream & inFile) : inFile(inFile), relevantWaysSize(0), relevantRelationsSize(0), assembledRelevantWays(0), assembledRelevantRelations(0) {}
+		Context(osmpbf::PbiStream & inFile) : inFile(&inFile), relevantWaysSize(0), relevantRelationsSize(0), assembledRelevantWays(0), assembledRelevantRelations(0), clippedAreas(0), missingRefsWays(0) {}
+		Context(PbfBlobFile & blobFile) : blobFile(&blobFile), relevantWaysSize(0), relevantRelationsSize(0), assembledRelevantWays(0), assembledRelevantRelations(0), clippedAreas(0), missingRefsWays(0) {}
+		inline uint64_t dataSize() const { return (inFile ? inFile->dataSize() : blobFile->dataSize()); }
+		inline uint64_t dataPosition() const { return (inFile ? inFile->dataPosition() : blobFile->dataPosition()); }
+		///@return true if the location of node nodeId is available
+		inline bool nodePoint(int64_t nodeId, Point & p) const {
+			if (!(useDenseNodes ? denseNodes.get(nodeId, p) : nodes.get(nodeId, p))) {
+				return false;
+			}
+			if (snapGeometry) {
+				p.first = sserialize::spatial::GeoPoint::snapLat(p.first);
+				p.second = sserialize::spatial::GeoPoint::snapLon(p.second);
+			}
+			return true;
+		}
+		///@param ref a node id or the packed location of a ref if packedRefs is set
+		///@return true if the location of ref is available
+		inline bool refPoint(int64_t ref, Point & p) const {
+			if (!packedRefs) {
+				return nodePoint(ref, p);
+			}
+			uint32_t lat = FixedPointCoord::unpackLat(ref);
+			if (lat == FixedPointCoord::Null) {
+				return false;
+			}
+			p.first = FixedPointCoord::toDoubleLat(lat);
+			p.second = FixedPointCoord::toDoubleLon(FixedPointCoord::unpackLon(ref));
+			if (snapGeometry) {
+				p.first = sserialize::spatial::GeoPoint::snapLat(p.first);
+				p.second = sserialize::spatial::GeoPoint::snapLon(p.second);
+			}
+			return true;
+		}
+		///@return false if refs of way are outside of the clip region, ways are only pruned if pruneByClip is set
+		///such ways are dropped during assembly anyway, hence their refs are not collected
+		inline bool insideClip(osmpbf::IWay & way) const {
+			if (!pruneByClip) {
+				return true;
+			}
+			for(auto it(way.refBegin()), end(way.refEnd()); it != end; ++it) {
+				if (!clipNodes.test(*it)) {
+					return false;
+				}
+			}
+			return true;
+		}
+		///@return true if the location of any node of ways is available
+		bool anyNodePoint(const std::vector<detail::AreaExtractor::MultiPolyResolver::RawWaySpan> & ways) const;
+	};
+	//Maps node ids to node locations for MultiPolyResolver
+	struct NodeMapper {
+		const Context * ctx;
+		NodeMapper(const Context * ctx) : ctx(ctx) {}
+		///@throws std::out_of_range if the location of nodeId is not available
+		sserialize::spatial::GeoPoint at(int64_t nodeId) const;
+		inline bool get(int64_t nodeId, Point & p) const { return ctx->refPoint(nodeId, p); }
+	};
+	//Writes the rings of MultiPolyResolver::writeRings to a RegionSink
+	struct SinkRingWriter {
+		RegionSink * sink;
+		GeoPointStorageBackend & points;
+		bool inner;
+		SinkRingWriter(RegionSink * sink, bool inner) : sink(sink), points(sink->points()), inner(inner) {}
+		inline void beginRing(std::size_t /*sizeHint*/) {}
+		inline void addPoint(double lat, double lon) { points.emplace_back(lat, lon); }
+		inline void endRing(bool complete) {
+			if (complete) {
+				sink->endRing(inner);
+			}
+			else {
+				sink->dropRing();
+			}
+		}
 	};
 	struct ExtractorCallBack {
-		virtual void operator()(const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive) = 0;
+		///@param tags row of the projected tags or TagStore::NoRow
+		///@param configurations bits of the configurations whose filter matches primitive
+		virtual void operator()(const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive, TagStore::RowId tags, uint32_t configurations) = 0;
 	};
 	struct ExtractionFunctorBase {
 		Context * ctx;
 		osmpbf::PrimitiveBlockInputAdaptor * pbi;
-		generics::RCPtr<osmpbf::AbstractTagFilter> mainFilter;
+		//state of the compiled filters of all configurations
+		detail::AreaExtractor::CompiledFilterSet::BlockState filterState;
+		//copies of the external filters of the configurations, unset if a configuration has none
+		std::vector< generics::RCPtr<osmpbf::AbstractTagFilter> > externalFilters;
+		//configurations whose filter may match primitives of the current block
+		uint32_t activeConfigurations;
+		std::unique_ptr<TagStore::BlockProjector> tagProjector;
+		///call this once per block
 		void assignInputAdaptor(osmpbf::PrimitiveBlockInputAdaptor & pbi);
+		///resolve the filters for the current block, call this after assignInputAdaptor()
+		///@return false if no primitive of the block can match
+		bool rebuildFilter();
+		///@return bits of the configurations whose filter matches primitive
+		inline uint32_t matches(const osmpbf::IPrimitive & primitive) {
+			uint32_t result = 0;
+			for(uint32_t i(0), s(ctx->compiledFilters.size()); i < s; ++i) {
+				if (((activeConfigurations >> i) & 0x1) && ctx->compiledFilters.at(i).matches(filterState.at(i), primitive) &&
+					(!externalFilters[i].get() || externalFilters[i]->matches(primitive)))
+				{
+					result |= uint32_t(1) << i;
+				}
+			}
+			return result;
+		}
+		inline TagStore::RowId tagRow(const osmpbf::IPrimitive & primitive) {
+			return (tagProjector ? tagProjector->push_back(primitive) : TagStore::NoRow);
+		}
 		ExtractionFunctorBase(Context * ctx);
 		ExtractionFunctorBase(const ExtractionFunctorBase & other);
 		~ExtractionFunctorBase() {}
 	};
 	//Private processor
 	struct RelationWaysExtractor: ExtractionFunctorBase {
-		std::unordered_set<int64_t> myWayIds;
-		RelationWaysExtractor(Context * ctx) : ExtractionFunctorBase(ctx) {}
-		RelationWaysExtractor(const RelationWaysExtractor & o) : ExtractionFunctorBase(o) {}
+		detail::AreaExtractor::IdCollector::Buffer * myWayIds;
+		RelationWaysExtractor(Context * ctx) : ExtractionFunctorBase(ctx), myWayIds(ctx->rawWayIds.buffer()) {}
+		RelationWaysExtractor(const RelationWaysExtractor & o) : ExtractionFunctorBase(o), myWayIds(ctx->rawWayIds.buffer()) {}
 		void operator()(osmpbf::PrimitiveBlockInputAdaptor & pbi);
 	};
 	//Private processor
+	//Collects the node-refs of relevant ways and the refs of ways that are members of relevant relations
+	//Only the latter if the dense node store is used
+	//Ways outside of the clip region are skipped, see Context::insideClip()
+	//With external refs the refs of relevant ways are stored in areaWays instead
 	struct WayRefsExtractor: ExtractionFunctorBase {
-		std::unordered_set<int64_t> myRefs;
-		WayRefsExtractor(Context * ctx) : ExtractionFunctorBase(ctx) {}
-		WayRefsExtractor(const WayRefsExtractor & o) : ExtractionFunctorBase(o) {}
+		detail::AreaExtractor::IdCollector::Buffer * myRefs;
+		RawWayStore::Buffer * myWays;
+		RawWayStore::Buffer * myAreaWays;
+		WayRefsExtractor(Context * ctx) : ExtractionFunctorBase(ctx), myRefs(ctx->nodeRefs.buffer()), myWays(ctx->rawWays.buffer()), myAreaWays(ctx->externalRefs ? ctx->areaWays.buffer() : 0) {}
+		WayRefsExtractor(const WayRefsExtractor & o) : ExtractionFunctorBase(o), myRefs(ctx->nodeRefs.buffer()), myWays(ctx->rawWays.buffer()), myAreaWays(ctx->externalRefs ? ctx->areaWays.buffer() : 0) {}
 		void operator()(osmpbf::PrimitiveBlockInputAdaptor & pbi);
 	};
 	//Private processor
-	struct RelationWayNodeRefsExtractor {
-		Context * ctx;
-		std::unordered_set<int64_t> myWayRefs;
-		RelationWayNodeRefsExtractor(Context * ctx) : ctx(ctx) {}
-		RelationWayNodeRefsExtractor(const RelationWayNodeRefsExtractor & o) : ctx(o.ctx) {}
+	//Collects the refs of relevant ways, needed if node locations are fetched in partitions
+	struct AreaWaysExtractor: ExtractionFunctorBase {
+		RawWayStore::Buffer * myWays;
+		AreaWaysExtractor(Context * ctx) : ExtractionFunctorBase(ctx), myWays(ctx->areaWays.buffer()) {}
+		AreaWaysExtractor(const AreaWaysExtractor & o) : ExtractionFunctorBase(o), myWays(ctx->areaWays.buffer()) {}
 		void operator()(osmpbf::PrimitiveBlockInputAdaptor & pbi);
 	};
-	//Private processor
-	struct WayExtractor: ExtractionFunctorBase {
+	//Passes assembled regions to the sink or the callback
+	//If the emission is ordered, the regions of a block are deferred until all earlier blocks are emitted
+	struct EmittingFunctorBase: ExtractionFunctorBase {
 		ExtractorCallBack * cb;
-		WayExtractor(Context * ctx, ExtractorCallBack * cb) : ExtractionFunctorBase(ctx), cb(cb) {}
-		WayExtractor(const WayExtractor & o) : ExtractionFunctorBase(o), cb(o.cb) {}
+		//created on first use, hence prototypes and copies without regions do not create sinks
+		std::unique_ptr<RegionSink> mySink;
+		struct PendingRegion {
+			//position of the primitive in its stream
+			uint32_t position;
+			uint32_t configurations;
+			std::shared_ptr<sserialize::spatial::GeoRegion> region;
+		};
+		//deferred regions of the current block
+		std::vector<PendingRegion> pendingRegions;
+		EmittingFunctorBase(Context * ctx, ExtractorCallBack * cb) : ExtractionFunctorBase(ctx), cb(cb) {}
+		EmittingFunctorBase(const EmittingFunctorBase & o) : ExtractionFunctorBase(o), cb(o.cb) {}
+		///true if regions are written to sinks instead of being passed to the callback
+		inline bool hasSink() const { return (bool) ctx->sinkFactory; }
+		///the sink of this functor, only valid if hasSink()
+		inline RegionSink * sink() {
+			if (!mySink) {
+				mySink.reset(ctx->sinkFactory());
+			}
+			return mySink.get();
+		}
+		///true if geometry is written to the sink while it is assembled, this is not possible if the emission is ordered
+		inline bool directSink() const { return hasSink() && !ctx->sequencer; }
+		///@param position position of primitive in its stream
+		///@param configurations bits of the configurations whose filter matches primitive
+		void emit(const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive, uint32_t position, uint32_t configurations);
+		///emit the deferred regions of the current block after all earlier blocks
+		///@param stream new stream of the primitives of the current block
+		template<typename TStream>
+		void emitPending(TStream stream);
+	};
+	//Private processor
+	struct WayExtractor: EmittingFunctorBase {
+		WayExtractor(Context * ctx, ExtractorCallBack * cb) : EmittingFunctorBase(ctx, cb) {}
+		WayExtractor(const WayExtractor & o) : EmittingFunctorBase(o) {}
 		void operator()(osmpbf::PrimitiveBlockInputAdaptor & pbi);
+		///@param refBegin node ids or packed locations
+		///@param position position of way in its stream
+		///@param configurations bits of the configurations whose filter matches way
+		///@return 1 if the way was assembled, 0 if not and -1 if it was clipped
+		template<typename TRefIterator>
+		int assemble(osmpbf::IWay & way, uint32_t position, uint32_t configurations, TRefIterator refBegin, TRefIterator refEnd, std::size_t refsSize);
 	};
 	//Private processor
-	struct RelationExtractor: ExtractionFunctorBase {
-		ExtractorCallBack * cb;
-		RelationExtractor(Context * ctx, ExtractorCallBack * cb) : ExtractionFunctorBase(ctx), cb(cb) {}
-		RelationExtractor(const RelationExtractor & o) : ExtractionFunctorBase(o), cb(o.cb) {}
+	struct RelationExtractor: EmittingFunctorBase {
+		typedef enum { RC_UNRESOLVED=0, RC_OUTER=1, RC_INNER=2, RC_OTHER=3 } RoleClass;
+		//reused for every relation
+		std::vector<detail::AreaExtractor::MultiPolyResolver::RawWaySpan> outerWays;
+		std::vector<detail::AreaExtractor::MultiPolyResolver::RawWaySpan> innerWays;
+		//role class of the string table entries of the current block, resolved on first use
+		std::vector<uint8_t> roleClasses;
+		RelationExtractor(Context * ctx, ExtractorCallBack * cb) : EmittingFunctorBase(ctx, cb) {}
+		RelationExtractor(const RelationExtractor & o) : EmittingFunctorBase(o) {}
+		void operator()(osmpbf::PrimitiveBlockInputAdaptor & pbi);
+		RoleClass roleClass(uint32_t roleId);
+	};
+	//Private processor
+	//Assembles ways and relations in a single pass
+	struct AreaAssembler {
+		WayExtractor we;
+		RelationExtractor re;
+		AreaAssembler(Context * ctx, ExtractorCallBack * cb) : we(ctx, cb), re(ctx, cb) {}
+		AreaAssembler(const AreaAssembler & o) : we(o.we), re(o.re) {}
+		void operator()(osmpbf::PrimitiveBlockInputAdaptor & pbi);
+	};
+	//Private processor
+	//Assembles ways and collects the refs of relation member ways in a single pass, needs the dense node store
+	struct DenseWayAssembler {
+		WayRefsExtractor wre;
+		WayExtractor we;
+		DenseWayAssembler(Context * ctx, ExtractorCallBack * cb) : wre(ctx), we(ctx, cb) {}
+		DenseWayAssembler(const DenseWayAssembler & o) : wre(o.wre), we(o.we) {}
+		void operator()(osmpbf::PrimitiveBlockInputAdaptor & pbi);
+	};
+	//Private processor
+	//Collects the ids of the nodes inside the clip region
+	struct ClipNodeCollector {
+		Context * ctx;
+		detail::AreaExtractor::IdCollector::Buffer * myIds;
+		ClipNodeCollector(Context * ctx) : ctx(ctx), myIds(ctx->clipNodeIds.buffer()) {}
+		ClipNodeCollector(const ClipNodeCollector & o) : ctx(o.ctx), myIds(ctx->clipNodeIds.buffer()) {}
 		void operator()(osmpbf::PrimitiveBlockInputAdaptor & pbi);
 	};
 	//No private processor
@@ -153,9 +621,149 @@ private:
 		NodeGatherer(const NodeGatherer & o) : ctx(o.ctx) {}
 		void operator()(osmpbf::PrimitiveBlockInputAdaptor & pbi);
 	};
+	//Private processor
+	//Merge-joins the nodes of a block with Context::joinRefs and appends the locations to Context::joinResults
+	struct NodeJoiner {
+		Context * ctx;
+		std::vector<Context::JoinResult> myResults;
+		NodeJoiner(Context * ctx) : ctx(ctx) {}
+		NodeJoiner(const NodeJoiner & o) : ctx(o.ctx) {}
+		void operator()(osmpbf::PrimitiveBlockInputAdaptor & pbi);
+	};
+	//Assembles large relations on its own threads while the input is still being parsed
+	//Every thread has its own queue of jobs which it processes largest first.
+	//Jobs are distributed round-robin, a thread with an empty queue steals from the queues of the other threads.
+	class RelationAssemblyPool {
+	public:
+		struct Job {
+			int64_t relationId;
+			uint32_t configurations;
+			uint64_t refsSize;
+			bool allWaysAvailable;
+			std::vector<detail::AreaExtractor::MultiPolyResolver::RawWaySpan> outerWays;
+			std::vector<detail::AreaExtractor::MultiPolyResolver::RawWaySpan> innerWays;
+			inline bool operator<(const Job & other) const { return refsSize < other.refsSize; }
+		};
+		struct Result {
+			std::shared_ptr<sserialize::spatial::GeoRegion> region;
+			uint32_t configurations;
+		};
+		typedef std::unordered_map<int64_t, Result> ResultsContainer;
+	public:
+		RelationAssemblyPool(const Context * ctx);
+		~RelationAssemblyPool();
+		void start(uint32_t threadCount);
+		///@thread-safety yes
+		void push(Job && job);
+		///wait until all jobs are done and stop the threads
+		void finish();
+		///relation id -> assembled region, only valid after finish()
+		const ResultsContainer & results() const;
+		int64_t minRelationId() const;
+		int64_t maxRelationId() const;
+	private:
+		struct Queue {
+			//max-heap of jobs
+			std::vector<Job> jobs;
+			std::mutex lock;
+		};
+	private:
+		///take the largest job of queue queueId or steal one from the other queues, only call this after reserving a job
+		void pop(uint32_t queueId, Job & job);
+		void run(uint32_t queueId);
+	private:
+		const Context * m_ctx;
+		std::unique_ptr<Queue[]> m_queues;
+		uint32_t m_queueCount;
+		std::atomic<uint32_t> m_nextQueue;
+		//guards the number of queued but unreserved jobs, m_finishing and the results
+		std::mutex m_lock;
+		std::condition_variable m_cv;
+		uint64_t m_pending;
+		bool m_finishing;
+		std::vector<std::thread> m_threads;
+		ResultsContainer m_results;
+		int64_t m_minRelationId;
+		int64_t m_maxRelationId;
+	};
+	//Private processor
+	//Passes the regions of the relations assembled by the assembly pool to the callback
+	struct AssembledRelationEmitter {
+		Context * ctx;
+		const RelationAssemblyPool * pool;
+		ExtractorCallBack * cb;
+		//created on first use, see EmittingFunctorBase
+		std::unique_ptr<RegionSink> mySink;
+		std::unique_ptr<TagStore::BlockProjector> tagProjector;
+		AssembledRelationEmitter(Context * ctx, const RelationAssemblyPool * pool, ExtractorCallBack * cb) :
+		ctx(ctx), pool(pool), cb(cb), tagProjector(ctx->tagStore ? new TagStore::BlockProjector(ctx->tagStore) : 0) {}
+		AssembledRelationEmitter(const AssembledRelationEmitter & o) :
+		ctx(o.ctx), pool(o.pool), cb(o.cb), tagProjector(ctx->tagStore ? new TagStore::BlockProjector(ctx->tagStore) : 0) {}
+		void operator()(osmpbf::PrimitiveBlockInputAdaptor & pbi);
+	};
 public:
-	AreaExtractor(bool verbose = false, bool snapGeometry = false) : m_verbose(verbose), m_snapGeometry(snapGeometry) {}
+	AreaExtractor(bool verbose = false, bool snapGeometry = false) : m_verbose(verbose), m_snapGeometry(snapGeometry), m_blobIndexSidecar(false), m_nodeStoreMode(NSM_AUTO), m_spillRelationWays(false), m_largeRelationMinRefs(0), m_assemblyThreads(0), m_nodeMemoryBudget(0), m_orderedEmission(false) {}
 	virtual ~AreaExtractor() {}
+	///NSM_DENSE needs the blob index and hence extraction from a file name, otherwise NSM_SPARSE is used.
+	///It builds the blob index with an extra scan of the input if there is none yet.
+	///NSM_DENSE still reads the input in separate passes: the node blobs are read into the store first, then the way blobs are assembled.
+	///It only saves the pass that collects the refs of relevant ways and the lookup of their nodes.
+	///NSM_AUTO uses NSM_DENSE for large files if buildings are extracted and the blob index is already available (default).
+	///NSM_AUTO never builds the blob index itself, hence it uses NSM_SPARSE if the index is not available yet.
+	///Enable setBlobIndexSidecar() to make the index of the first run available to later runs.
+	///NSM_EXTERNAL keeps refs and node locations in temporary files and reads them sequentially, use it if the needed nodes exceed the memory
+	///@param denseStoreDirectory directory of the backing file of the dense node store, anonymous memory is used if empty
+	void setNodeStoreMode(NodeStoreMode mode, const std::string & denseStoreDirectory = std::string()) {
+		m_nodeStoreMode = mode;
+		m_denseStoreDirectory = denseStoreDirectory;
+	}
+	///Reuse the blob index of an input file across runs by storing it in a sidecar-file (default: false)
+	///This only applies to extraction from a file name
+	///@param directory directory of the sidecar-file, next to the input file if empty
+	void setBlobIndexSidecar(bool enable, const std::string & directory = std::string()) {
+		m_blobIndexSidecar = enable;
+		m_blobIndexDirectory = directory;
+	}
+	///Store the refs of the member ways of relations in a temporary file instead of memory (default: false)
+	void setSpillRelationWays(bool enable) { m_spillRelationWays = enable; }
+	///Relations with at least minRefs node-refs are assembled by a separate pool of threadCount threads while parsing continues.
+	///The pool threads are taken from the threads of the extraction, the relation passes decode with the remaining ones.
+	///The callback needs the relations themselves, hence their regions are passed on in an extra pass over the blobs of the assembled relations.
+	///This needs extraction from a file name, the pool is not used otherwise.
+	///@param minRefs 0 disables the pool (default), LargeRelationMinRefs is a sensible value
+	///@param threadCount 0 uses half of the threads of the extraction, at least one thread is left for decoding
+	void setLargeRelationAssembly(uint64_t minRefs, uint32_t threadCount = 0) {
+		m_largeRelationMinRefs = minRefs;
+		m_assemblyThreads = threadCount;
+	}
+	///Limit the memory of fetching node locations with the sparse node store to about bytes.
+	///The estimate covers the sparse node store, the bitmap of the needed ids, the in-memory indexes of the relevant ways
+	///and the buffers of the passes over their refs. Refs and locations of the ways are kept in memory-mapped temporary files,
+	///of these only the chunks being processed are counted. At least half of the budget is left for the nodes.
+	///If the needed nodes exceed it, their locations are fetched in id-range partitions with one node pass each.
+	///The collected node ids and the refs of the ways are spilled to temporary files in chunks bounded by the budget,
+	///and the budget is checked before the ids are merged.
+	///The locations of every partition are written next to the refs of the ways in temporary files,
+	///hence the areas are assembled in a single pass afterwards.
+	///With NSM_EXTERNAL this limits the memory of the sorted runs instead.
+	///@param bytes 0 disables the budget (default)
+	void setNodeMemoryBudget(uint64_t bytes) { m_nodeMemoryBudget = bytes; }
+	///Only extract areas inside rect: only the locations of nodes inside rect expanded by margin (in degrees) are stored
+	///and areas without any node inside are dropped before they are assembled.
+	///Rings leaving the expanded region are dropped as in extracts cut at a border, hence margin should cover the areas of interest.
+	///With the sparse node store an additional node pass marks the nodes inside the region before any refs are collected,
+	///hence only refs and nodes of ways inside the region are stored. The dense node store only touches memory of nodes inside the region.
+	void setClipRegion(const sserialize::spatial::GeoRect & rect, double margin) { m_clip = ClipRegion(rect, margin); }
+	///Only extract areas inside region (a GeoPolygon, GeoMultiPolygon, OsmGeoPolygon or OsmGeoMultiPolygon), see setClipRegion(const GeoRect &, double)
+	///@throws sserialize::TypeMissMatchException for other region types
+	void setClipRegion(const sserialize::spatial::GeoRegion & region, double margin) { m_clip = ClipRegion(region, margin); }
+	///extract areas of the whole input (default)
+	void clearClipRegion() { m_clip = ClipRegion(); }
+	///Emit regions in the order of the input instead of the order in which threads finish them (default: false).
+	///Threads wait with the regions of a block until all earlier blocks are emitted, hence results are reproducible between runs.
+	///Relations assembled by the large relation pool follow in a separate pass, sinks receive complete regions instead of points.
+	///This needs extraction from a file name.
+	void setOrderedEmission(bool enable) { m_orderedEmission = enable; }
 	///@param processor (const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive), MUST be thread-safe
 	///@param filter additional AND-filter 
 	///@param numThreads number of threads, 0 for auto-detecting
@@ -164,9 +772,156 @@ public:
 
 	template<typename TProcessor>
 	bool extract(osmpbf::PbiStream & inData, TProcessor processor, ExtractionTypes extractionTypes = ET_ALL_SPECIAL_BUT_BUILDINGS, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter = generics::RCPtr<osmpbf::AbstractTagFilter>(), uint32_t numThreads = 0, const std::string & msg = std::string("AreaExtractor"));
+	
+	///Project the tags of every extracted area onto tags.keys() and store them in tags instead of reading them in the processor
+	///@param processor (const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive, TagStore::RowId tagsRow), MUST be thread-safe
+	template<typename TProcessor>
+	bool extractTagged(const std::string & inputFileName, TagStore & tags, TProcessor processor, ExtractionTypes extractionTypes = ET_ALL_SPECIAL_BUT_BUILDINGS, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter = generics::RCPtr<osmpbf::AbstractTagFilter>(), uint32_t numThreads = 0, const std::string & msg = std::string("AreaExtractor"));
+	
+	///Write the geometry of the extracted areas directly to sinks instead of creating GeoRegion objects
+	///@param sinkFactory creates one sink per thread and pass, sinks are destroyed after their pass
+	bool extract(const std::string & inputFileName, const RegionSinkFactory & sinkFactory, ExtractionTypes extractionTypes = ET_ALL_SPECIAL_BUT_BUILDINGS, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter = generics::RCPtr<osmpbf::AbstractTagFilter>(), uint32_t numThreads = 0, const std::string & msg = std::string("AreaExtractor"));
+	bool extract(osmpbf::PbiStream & inData, const RegionSinkFactory & sinkFactory, ExtractionTypes extractionTypes = ET_ALL_SPECIAL_BUT_BUILDINGS, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter = generics::RCPtr<osmpbf::AbstractTagFilter>(), uint32_t numThreads = 0, const std::string & msg = std::string("AreaExtractor"));
+	
+	///Add the extracted areas directly to an OsmGridRegionTree without intermediate GeoRegion objects
+	///@param tree OsmGridRegionTree<TValue>
+	///@param valueFunc TValue valueFunc(osmpbf::IPrimitive & primitive), MUST be thread-safe
+	template<typename TTree, typename TValueFunc>
+	bool extractToTree(const std::string & inputFileName, TTree & tree, TValueFunc valueFunc, ExtractionTypes extractionTypes = ET_ALL_SPECIAL_BUT_BUILDINGS, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter = generics::RCPtr<osmpbf::AbstractTagFilter>(), uint32_t numThreads = 0, const std::string & msg = std::string("AreaExtractor")) {
+		RegionSinkFactory sinkFactory = [&tree, valueFunc]() -> RegionSink* {
+			return new GridRegionTreeSink<TTree, TValueFunc>(&tree, valueFunc);
+		};
+		return extract(inputFileName, sinkFactory, extractionTypes, filter, numThreads, msg);
+	}
+	
+	///Extract from inputFileName and store the result in cacheFileName, later runs with the same input and configuration read the cache instead
+	///@param tagKeys the values of these keys are stored in the cache and passed to processor
+	///@param processor (const std::shared_ptr<sserialize::spatial::GeoRegion> & region, const ExtractionCache::Primitive & primitive), MUST be thread-safe
+	///@param filterKey identifies filter, the cache is not used if filter is set and filterKey is empty
+	template<typename TProcessor>
+	bool extractCached(const std::string & inputFileName, const std::string & cacheFileName, const std::vector<std::string> & tagKeys, TProcessor processor, ExtractionTypes extractionTypes = ET_ALL_SPECIAL_BUT_BUILDINGS, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter = generics::RCPtr<osmpbf::AbstractTagFilter>(), const std::string & filterKey = std::string(), uint32_t numThreads = 0, const std::string & msg = std::string("AreaExtractor"));
+	
+	///A configuration of a multi-configuration extraction
+	struct Configuration {
+		ExtractionTypes extractionTypes{ET_ALL_SPECIAL_BUT_BUILDINGS};
+		///additional AND-filter
+		generics::RCPtr<osmpbf::AbstractTagFilter> filter;
+		///MUST be thread-safe
+		std::function<void(const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive)> processor;
+	};
+	static constexpr uint32_t MaxConfigurations = 32;
+	///Extract the areas of up to MaxConfigurations configurations with the passes of a single extraction.
+	///Every area is assembled once and passed to the processor of every configuration whose extraction types and filter match it.
+	bool extract(const std::string & inputFileName, const std::vector<Configuration> & configurations, uint32_t numThreads = 0, const std::string & msg = std::string("AreaExtractor"));
+	
+	///RegionSink adding regions to an OsmGridRegionTree<TValue>, the value of a region is valueFunc(primitive)
+	template<typename TTree, typename TValueFunc>
+	class GridRegionTreeSink: public RegionSink {
+	public:
+		GridRegionTreeSink(TTree * tree, TValueFunc valueFunc) : m_tree(tree), m_writer(tree), m_valueFunc(valueFunc) {}
+		virtual ~GridRegionTreeSink() {}
+		virtual GeoPointStorageBackend & points() override { return m_writer.points(); }
+		virtual void endRing(bool inner) override { m_writer.endRing(inner); }
+		virtual void dropRing() override { m_writer.dropRing(); }
+		virtual bool endRegion(osmpbf::IPrimitive & primitive) override { return m_writer.endRegion(m_valueFunc(primitive)); }
+		virtual void push_back(const sserialize::spatial::GeoRegion & region, osmpbf::IPrimitive & primitive) override {
+			m_tree->push_back(region, m_valueFunc(primitive));
+		}
+	private:
+		TTree * m_tree;
+		typename TTree::RegionWriter m_writer;
+		TValueFunc m_valueFunc;
+	};
+private:
+	///open inputFileName, set up the context of an extraction from it and call extraction(Context & ctx)
+	///@return false if the file could not be opened, the result of extraction otherwise
+	template<typename TExtraction>
+	bool extractFromFile(const std::string & inputFileName, TExtraction extraction);
+	template<typename TProcessor>
+	bool extractAreas(Context & ctx, TProcessor processor, ExtractionTypes extractionTypes, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter, uint32_t numThreads, const std::string & msg);
+	///parse the input of ctx, if the blob index is available only blobs passing blobFilter(const PbfBlobInfo &) are read
+	///@return false if the input could not be read completely, ctx.parseFailed is set then
+	template<typename TPBI_Processor, typename TBlobFilter>
+	bool parse(Context & ctx, TPBI_Processor & processor, TBlobFilter blobFilter, uint32_t numThreads, bool threadPrivateProcessor);
+	///select the node store and set it up if the dense node store is used
+	///this may build the blob index
+	bool initDenseNodeStore(Context & ctx, uint32_t numThreads, const std::string & msg);
+	///memory of fetching node locations that does not depend on the nodes:
+	///the in-memory indexes of the relevant ways and the buffers of the passes over their refs
+	uint64_t nodeFetchFixedMemory(const Context & ctx, uint32_t numThreads) const;
+	///memory of fetching the locations of the sorted ids [begin, end) at once: the sparse node store and the bitmap of the ids
+	static uint64_t nodeFetchMemory(const int64_t * begin, const int64_t * end);
+	///split sorted ids into partitions whose locations can be fetched within the node memory budget
+	///@return the end of every partition
+	std::vector<std::size_t> nodePartitions(const int64_t * ids, std::size_t idsSize, uint64_t fixedMemory, const std::string & msg) const;
+	///fetch the locations of ids in partitions and store them as values of the refs of the relevant ways, this clears ids
+	///@param ids sorted node ids without duplicates
+	///@param partitionEnds end of every partition in ids, see nodePartitions()
+	///@return false if a pass failed
+	bool fetchNodesPartitioned(Context & ctx, sserialize::MMVector<int64_t> & ids, const std::vector<std::size_t> & partitionEnds, uint32_t numThreads, const std::string & msg);
+	///write the refs of rawWays and areaWays to Context::joinRefs as they are flushed
+	void beginJoinRefs(Context & ctx);
+	///store the locations of the refs of rawWays and areaWays as their values with a sort-merge join against the nodes of the input
+	///@return false if a pass failed
+	bool joinNodesExternal(Context & ctx, uint32_t numThreads, const std::string & msg);
+	///stop the extraction after a pass failed and release its stores
+	///@return false
+	bool abortExtraction(Context & ctx, const std::string & msg);
+	//processor of the sink based extraction
+	struct NoOpProcessor {
+		inline void operator()(const std::shared_ptr<sserialize::spatial::GeoRegion> & /*region*/, osmpbf::IPrimitive & /*primitive*/, TagStore::RowId /*tags*/, uint32_t /*configurations*/) {}
+	};
+	//adapts processors without tag projection of a single configuration
+	template<typename TProcessor>
+	struct UntaggedProcessor {
+		TProcessor processor;
+		UntaggedProcessor(const TProcessor & processor) : processor(processor) {}
+		inline void operator()(const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive, TagStore::RowId /*tags*/, uint32_t /*configurations*/) {
+			processor(region, primitive);
+		}
+	};
+	//adapts processors with tag projection of a single configuration
+	template<typename TProcessor>
+	struct TaggedProcessor {
+		TProcessor processor;
+		TaggedProcessor(const TProcessor & processor) : processor(processor) {}
+		inline void operator()(const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive, TagStore::RowId tags, uint32_t /*configurations*/) {
+			processor(region, primitive, tags);
+		}
+	};
+	//passes regions to the processors of the matching configurations
+	struct MultiProcessor {
+		const std::vector<Configuration> * configurations;
+		MultiProcessor(const std::vector<Configuration> * configurations) : configurations(configurations) {}
+		inline void operator()(const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive, TagStore::RowId /*tags*/, uint32_t matching) {
+			for(uint32_t i(0), s((uint32_t) configurations->size()); i < s; ++i) {
+				if ((matching >> i) & 0x1) {
+					(*configurations)[i].processor(region, primitive);
+				}
+			}
+		}
+	};
+private:
+	///minimum input size for NSM_AUTO to select the dense node store
+	static constexpr uint64_t DenseNodeStoreMinFileSize = 1024*1024*1024;
+	///memory of the sorted runs of NSM_EXTERNAL without node memory budget
+	static constexpr uint64_t ExternalSortMemory = 1024*1024*1024;
+public:
+	static constexpr uint64_t LargeRelationMinRefs = 64*1024;
 private:
 	bool m_verbose;
 	bool m_snapGeometry;
+	bool m_blobIndexSidecar;
+	std::string m_blobIndexDirectory;
+	NodeStoreMode m_nodeStoreMode;
+	std::string m_denseStoreDirectory;
+	bool m_spillRelationWays;
+	uint64_t m_largeRelationMinRefs;
+	uint32_t m_assemblyThreads;
+	//empty if areas are not clipped
+	ClipRegion m_clip;
+	uint64_t m_nodeMemoryBudget;
+	bool m_orderedEmission;
 };
 
 template<typename TProcessor>
@@ -178,94 +933,371 @@ AreaExtractor::extract(
 	const generics::RCPtr<osmpbf::AbstractTagFilter> & filter, uint32_t numThreads,
 	const std::string & msg)
 {
-	osmpbf::OSMFileIn inFile(inputFileName);
+	return extractFromFile(inputFileName, [&](Context & ctx) -> bool {
+		return extractAreas(ctx, UntaggedProcessor<TProcessor>(processor), extractionTypes, filter, numThreads, msg);
+	});
+}
+
+
+template<typename TProcessor>
+bool AreaExtractor::extract(osmpbf::PbiStream & inData, TProcessor processor, ExtractionTypes extractionTypes, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter, uint32_t numThreads, const std::string & msg) {
+	Context ctx(inData);
+	return extractAreas(ctx, UntaggedProcessor<TProcessor>(processor), extractionTypes, filter, numThreads, msg);
+}
+
+template<typename TProcessor>
+bool AreaExtractor::extractTagged(const std::string & inputFileName, TagStore & tags, TProcessor processor, ExtractionTypes extractionTypes, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter, uint32_t numThreads, const std::string & msg) {
+	bool ok = extractFromFile(inputFileName, [&](Context & ctx) -> bool {
+		ctx.tagStore = &tags;
+		return extractAreas(ctx, TaggedProcessor<TProcessor>(processor), extractionTypes, filter, numThreads, msg);
+	});
+	if (ok && m_verbose) {
+		std::cout << msg << ": Stored the tags of " << tags.size() << " areas with " << tags.valuesSize() << " distinct values in " << sserialize::prettyFormatSize(tags.storageSize()) << std::endl;
+	}
+	return ok;
+}
+
+template<typename TProcessor>
+bool AreaExtractor::extractCached(
+	const std::string & inputFileName,
+	const std::string & cacheFileName,
+	const std::vector<std::string> & tagKeys,
+	TProcessor processor,
+	ExtractionTypes extractionTypes,
+	const generics::RCPtr<osmpbf::AbstractTagFilter> & filter,
+	const std::string & filterKey,
+	uint32_t numThreads,
+	const std::string & msg)
+{
+	ExtractionCache::Key key;
+	key.inputFileName = inputFileName;
+	key.extractionTypes = extractionTypes;
+	key.snapGeometry = m_snapGeometry;
+	key.filterKey = filterKey;
+	key.clipKey = m_clip.fingerprint();
+	key.tagKeys = tagKeys;
+	ExtractionCache::Writer writer(key);
+	if (filter.get() && !filterKey.size()) {
+		return extract(inputFileName, [&processor, &writer](const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive) {
+			ExtractionCache::Primitive p;
+			writer.project(primitive, p);
+			processor(region, p);
+		}, extractionTypes, filter, numThreads, msg);
+	}
+	{
+		ExtractionCache cache;
+		if (cache.open(cacheFileName, key)) {
+			if (m_verbose) {
+				std::cout << msg << ": Reading " << cache.size() << " regions from " << cacheFileName << std::endl;
+			}
+			cache.replay(processor, numThreads);
+			return true;
+		}
+	}
+	bool ok = extract(inputFileName, [&processor, &writer](const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive) {
+		ExtractionCache::Primitive p;
+		writer.project(primitive, p);
+		writer.push_back(*region, p);
+		processor(region, p);
+	}, extractionTypes, filter, numThreads, msg);
+	if (ok && !writer.store(cacheFileName)) {
+		std::cout << msg << ": Failed to store the extraction cache in " << cacheFileName << std::endl;
+	}
+	return ok;
+}
+
+template<typename TExtraction>
+bool AreaExtractor::extractFromFile(const std::string & inputFileName, TExtraction extraction) {
+	PbfBlobFile inFile(inputFileName);
 	if (!inFile.open()) {
 		std::cout << "Failed to open " <<  inputFileName << std::endl;
 		return false;
 	}
-	osmpbf::PbiStream is(std::move(inFile));
-	return AreaExtractor::extract<TProcessor>(is, processor, extractionTypes, filter, numThreads, msg);
+	Context ctx(inFile);
+	if (m_blobIndexSidecar) {
+		ctx.blobIndexDirectory = m_blobIndexDirectory;
+		ctx.storeBlobIndex = !inFile.loadIndex(m_blobIndexDirectory);
+	}
+	return extraction(ctx);
 }
 
+template<typename TPBI_Processor, typename TBlobFilter>
+bool AreaExtractor::parse(Context & ctx, TPBI_Processor & processor, TBlobFilter blobFilter, uint32_t numThreads, bool threadPrivateProcessor) {
+	if (ctx.blobFile) {
+		if (!parseBlobsCPPThreads(*ctx.blobFile, processor, numThreads, threadPrivateProcessor, blobFilter, ctx.sequencer)) {
+			ctx.parseFailed = true;
+			return false;
+		}
+		if (ctx.storeBlobIndex && ctx.blobFile->index().complete()) {
+			if (!ctx.blobFile->storeIndex(ctx.blobIndexDirectory)) {
+				std::cout << "AreaExtractor: could not store blob index to " << PbfBlobIndex::sidecarFileName(ctx.blobFile->fileName(), ctx.blobIndexDirectory) << std::endl;
+			}
+			ctx.storeBlobIndex = false;
+		}
+	}
+	else {
+		ctx.inFile->reset();
+		osmpbf::parseFileCPPThreads(*ctx.inFile, processor, numThreads, 1, threadPrivateProcessor);
+	}
+	return true;
+}
 
 template<typename TProcessor>
-bool AreaExtractor::extract(osmpbf::PbiStream & inData, TProcessor processor, ExtractionTypes extractionTypes, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter, uint32_t numThreads, const std::string & msg) {
+bool AreaExtractor::extractAreas(Context & ctx, TProcessor processor, ExtractionTypes extractionTypes, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter, uint32_t numThreads, const std::string & msg) {
 	if (! (extractionTypes & (ET_ALL_SPECIAL | ET_ALL_MULTIPOLYGONS))) {
 		return false;
 	}
 	
-	Context ctx(inData);
+	//extractionTypes is the union of the extraction types of all configurations if they are set already
 	ctx.extractionTypes = extractionTypes;
-	ctx.externalFilter = filter;
+	if (ctx.filters.empty()) {
+		ctx.filters.resize(1);
+		ctx.filters.front().compiled.reset(new detail::AreaExtractor::CompiledFilter(extractionTypes));
+		ctx.filters.front().external = filter;
+	}
+	ctx.compiledFilters.clear();
+	for(const Context::FilterConfiguration & fc : ctx.filters) {
+		ctx.compiledFilters.push_back(fc.compiled.get());
+	}
 	ctx.verbose = m_verbose;
 	ctx.snapGeometry = m_snapGeometry;
+	ctx.clip = (m_clip.empty() ? 0 : &m_clip);
+	ctx.externalRefs = (m_nodeStoreMode == NSM_EXTERNAL);
+	ctx.rawWays.setRefsStorage(m_spillRelationWays || ctx.externalRefs || m_nodeMemoryBudget ? sserialize::MM_FILEBASED : sserialize::MM_PROGRAM_MEMORY);
+	ctx.areaWays.setRefsStorage(ctx.externalRefs ? sserialize::MM_FILEBASED : sserialize::MM_PROGRAM_MEMORY);
+	if (ctx.externalRefs) {
+		beginJoinRefs(ctx);
+	}
 	
 	struct MyCB: ExtractorCallBack {
 		TProcessor * processor;
-		virtual void operator()(const std::shared_ptr< sserialize::spatial::GeoRegion >& region, osmpbf::IPrimitive& primitive) {
-			(*processor)(region, primitive);
+		virtual void operator()(const std::shared_ptr< sserialize::spatial::GeoRegion >& region, osmpbf::IPrimitive& primitive, TagStore::RowId tags, uint32_t configurations) {
+			(*processor)(region, primitive, tags, configurations);
 		}
 	} cb;
 	cb.processor = &processor;
 	
+	BlobSequencer sequencer;
+	if (m_orderedEmission) {
+		if (ctx.blobFile) {
+			ctx.sequencer = &sequencer;
+		}
+		else {
+			std::cout << msg << ": Ordered emission needs extraction from a file name, regions are emitted unordered" << std::endl;
+		}
+	}
+	
 	NodeGatherer ng(&ctx);
+	RelationAssemblyPool assemblyPool(&ctx);
 	
-	if (extractionTypes & ET_PRIMITIVE_WAYS) {
-		WayRefsExtractor wre(&ctx);
-		WayExtractor we(&ctx, &cb);
-
-		ctx.pinfo.begin(ctx.inFile.dataSize(), msg + ": Ways' node-refs");
-		ctx.inFile.reset();
-		osmpbf::parseFileCPPThreads(ctx.inFile, wre, numThreads, 1, true);
-		ctx.pinfo.end();
-		
-		std::cout << msg << ": Found " << ctx.relevantWaysSize << " ways\n";
-		std::cout << msg << ": Need to fetch " << ctx.nodes.size() << " nodes" << std::endl;
-
-		ctx.pinfo.begin(ctx.inFile.dataSize(), msg + ": Ways' nodes");
-		ctx.inFile.reset();
-		osmpbf::parseFileCPPThreads(ctx.inFile, ng, numThreads, 1, false);
-		ctx.pinfo.end();
-		
-		ctx.pinfo.begin(ctx.inFile.dataSize(), msg + ": Assembling ways");
-		ctx.inFile.reset();
-		osmpbf::parseFileCPPThreads(ctx.inFile, WayExtractor(&ctx, &cb), numThreads, 1, true);
-		ctx.pinfo.end();
+	//threads that decode blobs of the relation passes, the threads of the assembly pool are taken from these
+	uint32_t relationThreads = (numThreads ? numThreads : std::max<uint32_t>(std::thread::hardware_concurrency(), 1));
+	if ((extractionTypes & ET_PRIMITIVE_RELATIONS) && m_largeRelationMinRefs) {
+		if (!ctx.blobFile) {
+			std::cout << msg << ": Assembling large relations separately needs extraction from a file name, they are assembled while parsing" << std::endl;
+		}
+		else if (relationThreads > 1) {
+			uint32_t assemblyThreads = std::min<uint32_t>(m_assemblyThreads ? m_assemblyThreads : relationThreads/2, relationThreads-1);
+			relationThreads -= assemblyThreads;
+			assemblyPool.start(assemblyThreads);
+			ctx.assemblyPool = &assemblyPool;
+			ctx.largeRelationMinRefs = m_largeRelationMinRefs;
+		}
 	}
 	
-	ctx.nodes.clear();
+	//The ways of relevant relations have to be known before the way pass
 	if (extractionTypes & ET_PRIMITIVE_RELATIONS) {
 		RelationWaysExtractor rwe(&ctx);
-		RelationWayNodeRefsExtractor rwnr(&ctx);
-		RelationExtractor re(&ctx, &cb);
-
-		ctx.pinfo.begin(ctx.inFile.dataSize(), msg + ": Relation's ways");
-		ctx.inFile.reset();
-		osmpbf::parseFileCPPThreads(ctx.inFile, rwe, numThreads, 1, true);
+		
+		ctx.pinfo.begin(ctx.dataSize(), msg + ": Relation's ways");
+		parse(ctx, rwe, [](const PbfBlobInfo & bi) -> bool {
+			return bi.kinds & PbfBlobInfo::BK_RELATIONS;
+		}, numThreads, true);
 		ctx.pinfo.end();
+		if (ctx.parseFailed) {
+			return abortExtraction(ctx, msg);
+		}
+		
+		ctx.rawWays.assign( ctx.rawWayIds.merge(numThreads) );
 
 		std::cout << msg << ": Found " << ctx.relevantRelationsSize << " relations with " << ctx.rawWays.size() << " ways \n";
+	}
+	
+	bool dense = initDenseNodeStore(ctx, numThreads, msg);
+	if (ctx.parseFailed) {
+		return abortExtraction(ctx, msg);
+	}
+	if (dense) {
+		DenseWayAssembler dwa(&ctx, &cb);
+		RelationExtractor re(&ctx, &cb);
+		
+		ctx.pinfo.begin(ctx.dataSize(), msg + ": Nodes");
+		parse(ctx, ng, [](const PbfBlobInfo & bi) -> bool {
+			return bi.kinds & PbfBlobInfo::BK_NODES;
+		}, numThreads, false);
+		ctx.pinfo.end();
+		if (ctx.parseFailed) {
+			return abortExtraction(ctx, msg);
+		}
 		
-		ctx.pinfo.begin(ctx.inFile.dataSize(), msg + ": Relation-ways' node-refs");
-		ctx.inFile.reset();
-		osmpbf::parseFileCPPThreads(ctx.inFile, rwnr, numThreads, 1, true);
+		//relation member ways are only needed if relations are extracted
+		ctx.pinfo.begin(ctx.dataSize(), msg + ": Assembling ways");
+		parse(ctx, dwa, [](const PbfBlobInfo & bi) -> bool {
+			return bi.kinds & PbfBlobInfo::BK_WAYS;
+		}, numThreads, true);
 		ctx.pinfo.end();
+		if (ctx.parseFailed) {
+			return abortExtraction(ctx, msg);
+		}
+		ctx.rawWays.finalize(numThreads);
+		
+		if (extractionTypes & ET_PRIMITIVE_RELATIONS) {
+			ctx.pinfo.begin(ctx.dataSize(), msg + ": Assembling relations");
+			parse(ctx, re, [](const PbfBlobInfo & bi) -> bool {
+				return bi.kinds & PbfBlobInfo::BK_RELATIONS;
+			}, relationThreads, true);
+			ctx.pinfo.end();
+			if (ctx.parseFailed) {
+				return abortExtraction(ctx, msg);
+			}
+		}
+	}
+	else {
+		WayRefsExtractor wre(&ctx);
+		AreaAssembler aa(&ctx, &cb);
+		
+		//ways with nodes outside of the clip region are dropped, hence the store of needed nodes is only sized for the region
+		if (ctx.clip) {
+			ClipNodeCollector cnc(&ctx);
+			ctx.pinfo.begin(ctx.dataSize(), msg + ": Nodes inside the clip region");
+			parse(ctx, cnc, [](const PbfBlobInfo & bi) -> bool {
+				return bi.kinds & PbfBlobInfo::BK_NODES;
+			}, numThreads, true);
+			ctx.pinfo.end();
+			if (ctx.parseFailed) {
+				return abortExtraction(ctx, msg);
+			}
+			ctx.clipNodes.assign(ctx.clipNodeIds.merge(numThreads));
+			ctx.pruneByClip = true;
+			std::cout << msg << ": Marked the nodes inside the clip region in " << sserialize::prettyFormatSize(ctx.clipNodes.storageSize()) << std::endl;
+		}
 		
-		std::cout << msg << ": Need to fetch " << ctx.nodes.size() << " nodes" << std::endl;
+		//with a node memory budget the collected refs are spilled, every thread keeps at most its share of the budget in memory
+		if (m_nodeMemoryBudget && !ctx.externalRefs) {
+			uint32_t threads = (numThreads ? numThreads : std::max<uint32_t>(std::thread::hardware_concurrency(), 1));
+			ctx.nodeRefs.setSpill(std::max<uint64_t>(m_nodeMemoryBudget/(uint64_t(threads)*sizeof(int64_t)), 1));
+		}
 		
-		ctx.pinfo.begin(ctx.inFile.dataSize(), msg + ": Relation-ways' nodes");
-		ctx.inFile.reset();
-		osmpbf::parseFileCPPThreads(ctx.inFile, ng, numThreads, 1, false);
+		//node-refs of relevant ways and of the ways of relevant relations
+		ctx.pinfo.begin(ctx.dataSize(), msg + ": Ways' node-refs");
+		parse(ctx, wre, [&ctx](const PbfBlobInfo & bi) -> bool {
+			return (bi.kinds & PbfBlobInfo::BK_WAYS) &&
+				((ctx.extractionTypes & ET_PRIMITIVE_WAYS) || (bi.maxWayId >= ctx.rawWays.minId() && bi.minWayId <= ctx.rawWays.maxId()));
+		}, numThreads, true);
 		ctx.pinfo.end();
+		if (ctx.parseFailed) {
+			return abortExtraction(ctx, msg);
+		}
+		ctx.rawWays.finalize(numThreads);
 		
-		ctx.pinfo.begin(ctx.inFile.dataSize(), msg + ": Assembling relations");
-		ctx.inFile.reset();
-		osmpbf::parseFileCPPThreads(ctx.inFile, re, numThreads, 1, true);
+		if (extractionTypes & ET_PRIMITIVE_WAYS) {
+			std::cout << msg << ": Found " << ctx.relevantWaysSize << " ways\n";
+		}
+		if (ctx.externalRefs) {
+			if (!joinNodesExternal(ctx, numThreads, msg)) {
+				return abortExtraction(ctx, msg);
+			}
+		}
+		else {
+			const uint64_t fixedMemory = (m_nodeMemoryBudget ? nodeFetchFixedMemory(ctx, numThreads) : 0);
+			//ids whose locations may exceed the budget are merged in a temporary file
+			sserialize::MMVector<int64_t> spilledIds(sserialize::MM_FILEBASED);
+			std::vector<int64_t> nodeIds;
+			if (m_nodeMemoryBudget && ctx.nodeRefs.sizeBound()*SparseNodeStore::NodeBytes + fixedMemory > m_nodeMemoryBudget) {
+				ctx.nodeRefs.merge(spilledIds, m_nodeMemoryBudget, numThreads);
+			}
+			else {
+				nodeIds = ctx.nodeRefs.merge(numThreads);
+				//the bitmap of widely spread ids may still exceed the budget
+				if (m_nodeMemoryBudget && nodeFetchMemory(nodeIds.data(), nodeIds.data()+nodeIds.size()) + fixedMemory > m_nodeMemoryBudget) {
+					spilledIds.push_back(nodeIds.begin(), nodeIds.end());
+					nodeIds = std::vector<int64_t>();
+				}
+			}
+			if (spilledIds.size()) {
+				if (!fetchNodesPartitioned(ctx, spilledIds, nodePartitions(spilledIds.data(), spilledIds.size(), fixedMemory, msg), numThreads, msg)) {
+					return abortExtraction(ctx, msg);
+				}
+			}
+			else {
+				ctx.nodes.assign( std::move(nodeIds) );
+				ctx.neededNodes.assign(ctx.nodes.ids());
+				std::cout << msg << ": Need to fetch " << ctx.nodes.size() << " nodes" << std::endl;
+				
+				//blobs without any needed node are skipped before they are read
+				ctx.pinfo.begin(ctx.dataSize(), msg + ": Nodes");
+				parse(ctx, ng, [&ctx](const PbfBlobInfo & bi) -> bool {
+					return (bi.kinds & PbfBlobInfo::BK_NODES) && ctx.neededNodes.any(bi.minNodeId, bi.maxNodeId);
+				}, numThreads, false);
+				ctx.pinfo.end();
+				ctx.neededNodes.clear();
+				if (ctx.parseFailed) {
+					return abortExtraction(ctx, msg);
+				}
+			}
+		}
+		ctx.clipNodes.clear();
+		ctx.pruneByClip = false;
+		
+		ctx.pinfo.begin(ctx.dataSize(), msg + ": Assembling areas");
+		parse(ctx, aa, [&ctx](const PbfBlobInfo & bi) -> bool {
+			return ((ctx.extractionTypes & ET_PRIMITIVE_WAYS) && (bi.kinds & PbfBlobInfo::BK_WAYS)) ||
+				((ctx.extractionTypes & ET_PRIMITIVE_RELATIONS) && (bi.kinds & PbfBlobInfo::BK_RELATIONS));
+		}, relationThreads, true);
 		ctx.pinfo.end();
+		if (ctx.parseFailed) {
+			return abortExtraction(ctx, msg);
+		}
 	}
+	
+	//the callback needs the relation itself, hence relations assembled by the pool are passed on in an extra pass over their blobs
+	if (ctx.assemblyPool) {
+		assemblyPool.finish();
+		ctx.assemblyPool = 0;
+		if (assemblyPool.results().size()) {
+			AssembledRelationEmitter are(&ctx, &assemblyPool, &cb);
+			ctx.pinfo.begin(ctx.dataSize(), msg + ": Large relations");
+			parse(ctx, are, [&assemblyPool](const PbfBlobInfo & bi) -> bool {
+				return (bi.kinds & PbfBlobInfo::BK_RELATIONS) &&
+					bi.maxRelationId >= assemblyPool.minRelationId() && bi.minRelationId <= assemblyPool.maxRelationId();
+			}, numThreads, true);
+			ctx.pinfo.end();
+			if (ctx.parseFailed) {
+				return abortExtraction(ctx, msg);
+			}
+		}
+	}
+	
+	ctx.denseNodes.clear();
 	ctx.nodes.clear();
+	ctx.clipNodes.clear();
+	ctx.pruneByClip = false;
+	ctx.rawWays.clear();
+	ctx.areaWays.clear();
+	ctx.packedRefs = false;
+	ctx.externalRefs = false;
+	if (ctx.sequencer) {
+		std::cout << msg << ": Reorder buffer held up to " << sequencer.highWaterMark() << " blocks" << std::endl;
+		ctx.sequencer = 0;
+	}
 
 	std::cout << msg << ": Assembled " << ctx.assembledRelevantWays << "/" << ctx.relevantWaysSize << " ways and " << ctx.assembledRelevantRelations << "/" << ctx.relevantRelationsSize << " relations" << std::endl;
+	if (ctx.clip) {
+		std::cout << msg << ": Dropped " << ctx.clippedAreas << " areas outside of the clip region" << std::endl;
+	}
+	if (ctx.missingRefsWays) {
+		std::cout << msg << ": Skipped " << ctx.missingRefsWays << " ways with missing refs" << std::endl;
+	}
 	
 	return true;
 }
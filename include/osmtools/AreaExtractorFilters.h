@@ -1,6 +1,11 @@
 #ifndef LIBOSMTOOLS_AREA_EXTRACTOR_FILTERS_H
 #define LIBOSMTOOLS_AREA_EXTRACTOR_FILTERS_H
 #include <osmpbf/filter.h>
+#include <osmpbf/primitiveblockinputadaptor.h>
+#include <osmpbf/iprimitive.h>
+#include <vector>
+#include <string>
+#include <unordered_map>
 /**
   * This is the base of the AreaExtractor. It's only dependency is the osmpbf library
   */
@@ -21,9 +26,136 @@ struct Base {
 		ET_ALL_MULTIPOLYGONS=ET_MULTIPOLYGONS|ET_PRIMITIVE_RELATIONS,
 // 		ET_ALL=ET_ALL_SPECIAL|ET_ALL_MULTIPOLYGONS
 	} ExtractionTypes;
+	///The tag filter of the rules of extractionTypes, see ExtractionRule
 	static generics::RCPtr<osmpbf::AbstractTagFilter> createExtractionFilter(ExtractionTypes extractionTypes);
 };
 
+///The extraction rules of a set of extraction types as an expression tree.
+///This is the single definition of the rules, Base::createExtractionFilter() and CompiledFilter are built from it.
+struct ExtractionRule {
+	typedef enum {
+		RT_WAY, RT_RELATION, //the primitive type
+		RT_KEY, //the key is set
+		RT_KEY_VALUES, //the key has one of values
+		RT_KEY_FALSE, //the key has a false value, see osmpbf::BoolTagFilter
+		RT_AND, RT_OR
+	} Type;
+	Type type;
+	std::string key;
+	std::vector<std::string> values;
+	std::vector<ExtractionRule> children;
+	///@return the rules of extractionTypes, an RT_OR without children if neither ways nor relations are extracted
+	static ExtractionRule create(Base::ExtractionTypes extractionTypes);
+};
+
+///The rules of ExtractionRule compiled into a flat program.
+///Tags are tested by atoms (a key, optionally with a set of values) that are resolved to string table ids once per block.
+///A primitive sets the bits of the atoms its tags match, a short postfix program combines them.
+///The filter is immutable and can be shared by all threads, the per-block state is kept in a BlockState per thread.
+class CompiledFilter {
+public:
+	class BlockState {
+	public:
+		BlockState();
+		~BlockState();
+		///resolve the string table of pbi
+		///@return false if no primitive of the block can match filter
+		bool reset(const CompiledFilter & filter, osmpbf::PrimitiveBlockInputAdaptor & pbi);
+	private:
+		friend class CompiledFilter;
+		friend class CompiledFilterSet;
+		static constexpr uint8_t NoKey = 0xFF;
+		//key index of every string table entry
+		std::vector<uint8_t> m_keys;
+		//value set bits of every string table entry
+		std::vector<uint32_t> m_valueSets;
+	};
+public:
+	///@throws std::out_of_range if the rules of extractionTypes exceed MaxAtoms, MaxValueSets or MaxStackSize
+	CompiledFilter(Base::ExtractionTypes extractionTypes);
+	~CompiledFilter();
+	///@param state the state of the block of primitive
+	bool matches(const BlockState & state, const osmpbf::IPrimitive & primitive) const;
+private:
+	friend class CompiledFilterSet;
+	typedef enum { OP_WAY, OP_RELATION, OP_ATOM, OP_AND, OP_OR } OpCode;
+	struct Op {
+		uint8_t code;
+		//atom index or number of operands
+		uint8_t arg;
+	};
+	struct Atom {
+		uint8_t key;
+		//0 if the atom only tests the key
+		uint32_t valueSet;
+	};
+	struct StringInfo {
+		uint8_t key{BlockState::NoKey};
+		uint32_t valueSets{0};
+	};
+	static constexpr uint32_t MaxAtoms = 32;
+	static constexpr uint32_t MaxValueSets = 32;
+	static constexpr uint32_t MaxStackSize = 32;
+private:
+	///append the program of rule
+	void compile(const ExtractionRule & rule);
+	///@return the stack size needed to evaluate rule
+	static uint32_t stackSize(const ExtractionRule & rule);
+	uint8_t addKey(const std::string & key);
+	void atom(const std::string & key);
+	void atom(const std::string & key, const std::vector<std::string> & values);
+	void op(OpCode code, uint8_t arg = 0);
+	bool eval(uint32_t atoms, osmpbf::PrimitiveType type) const;
+private:
+	std::vector<Op> m_program;
+	std::vector<Atom> m_atoms;
+	//atoms of every key
+	std::vector< std::vector<uint8_t> > m_keyAtoms;
+	std::unordered_map<std::string, StringInfo> m_strings;
+	uint32_t m_valueSetsSize;
+	//true if primitives without any relevant tag may match
+	bool m_matchesUntagged;
+};
+
+///The compiled filters of several configurations.
+///The strings of all filters are kept in one map, hence the string table of a block is resolved once for all configurations.
+class CompiledFilterSet {
+public:
+	class BlockState {
+	public:
+		BlockState();
+		~BlockState();
+		///resolve the string table of pbi for every configuration
+		///@return bits of the configurations whose filter may match primitives of the block
+		uint32_t reset(const CompiledFilterSet & filters, osmpbf::PrimitiveBlockInputAdaptor & pbi);
+		///the state of the filter of configuration
+		inline const CompiledFilter::BlockState & at(uint32_t configuration) const { return m_states[configuration]; }
+	private:
+		std::vector<CompiledFilter::BlockState> m_states;
+	};
+public:
+	CompiledFilterSet();
+	~CompiledFilterSet();
+	static constexpr uint32_t MaxConfigurations = 32;
+	///add the filter of the next configuration, filter has to outlive the set
+	///@throws std::out_of_range if the set already holds MaxConfigurations filters
+	void push_back(const CompiledFilter * filter);
+	void clear();
+	///number of configurations
+	uint32_t size() const;
+	inline const CompiledFilter & at(uint32_t configuration) const { return *m_filters[configuration]; }
+private:
+	struct Entry {
+		uint32_t configuration;
+		uint8_t key;
+		uint32_t valueSets;
+	};
+private:
+	std::vector<const CompiledFilter*> m_filters;
+	//key and value sets of a string in every configuration whose filter contains it
+	std::unordered_map<std::string, std::vector<Entry> > m_strings;
+};
+
 
 
 }}}//end namespace osmtools
@@ -0,0 +1,64 @@
+#ifndef OSM_TOOLS_CLIP_REGION_H
+#define OSM_TOOLS_CLIP_REGION_H
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <sserialize/spatial/GeoPolygon.h>
+#include <sserialize/spatial/GeoMultiPolygon.h>
+
+namespace osmtools {
+
+///Region of interest of a clipped extraction, expanded by a margin given in degrees.
+///Polygons are rasterized into a grid of GridSize x GridSize cells over their expanded bounding box.
+///A cell is part of the region if its center is inside the polygon or if it is within the margin of an edge.
+///Hence contains() is a conservative O(1) test independent of the size of the polygon.
+class ClipRegion {
+public:
+	static constexpr uint32_t GridSize = 512;
+public:
+	///an empty region which does not contain anything
+	ClipRegion();
+	ClipRegion(const sserialize::spatial::GeoRect & rect, double margin);
+	///@param region a GeoPolygon, GeoMultiPolygon, OsmGeoPolygon or OsmGeoMultiPolygon, inner rings are holes
+	///@throws sserialize::TypeMissMatchException for other region types
+	ClipRegion(const sserialize::spatial::GeoRegion & region, double margin);
+	~ClipRegion();
+	bool empty() const;
+	///the expanded bounding box
+	sserialize::spatial::GeoRect boundary() const;
+	///identifies the region, e.g. for caches, empty if the region is empty
+	std::string fingerprint() const;
+	inline bool contains(double lat, double lon) const {
+		if (!(lat >= m_minLat && lat <= m_maxLat && lon >= m_minLon && lon <= m_maxLon)) {
+			return false;
+		}
+		if (!m_cells.size()) {
+			return true;
+		}
+		return m_cells[cellY(lat)*GridSize + cellX(lon)];
+	}
+private:
+	typedef std::vector<sserialize::spatial::GeoPoint> Ring;
+	inline uint32_t cellY(double lat) const {
+		return std::min<uint32_t>((uint32_t)((lat - m_minLat)*m_latScale), GridSize-1);
+	}
+	inline uint32_t cellX(double lon) const {
+		return std::min<uint32_t>((uint32_t)((lon - m_minLon)*m_lonScale), GridSize-1);
+	}
+	void rasterize(const std::vector<const Ring*> & rings, double margin);
+	void markRect(double minLat, double maxLat, double minLon, double maxLon);
+private:
+	double m_minLat;
+	double m_maxLat;
+	double m_minLon;
+	double m_maxLon;
+	double m_latScale;
+	double m_lonScale;
+	//empty if the region is a rectangle
+	std::vector<uint8_t> m_cells;
+};
+
+}//end namespace osmtools
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef OSM_TOOLS_EXTERNAL_SORT_H
+#define OSM_TOOLS_EXTERNAL_SORT_H
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <sserialize/containers/MMVector.h>
+
+namespace osmtools {
+
+///Sort data in runs of at most runSize elements which are merged into a new array afterwards.
+///Runs are sorted in memory by threadCount threads, hence at most threadCount*runSize elements are held in memory.
+///Runs are read and the result is written sequentially, which allows data to be much larger than the memory if it is file-based.
+///@param mmt storage of the merged array
+template<typename T, typename TCompare>
+void externalSort(sserialize::MMVector<T> & data, TCompare comp, uint64_t runSize, uint32_t threadCount, sserialize::MmappedMemoryType mmt = sserialize::MM_FILEBASED) {
+	if (!threadCount) {
+		threadCount = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	const uint64_t size = data.size();
+	runSize = std::max<uint64_t>(runSize, 1);
+	const uint64_t runsCount = (size + runSize - 1)/runSize;
+
+	std::atomic<uint64_t> nextRun(0);
+	std::vector<std::thread> threads;
+	for(uint32_t i(0); i < std::min<uint64_t>(threadCount, runsCount); ++i) {
+		threads.emplace_back([&data, &comp, &nextRun, runSize, runsCount, size]() {
+			std::vector<T> run;
+			while (true) {
+				uint64_t runId = nextRun.fetch_add(1, std::memory_order_relaxed);
+				if (runId >= runsCount) {
+					return;
+				}
+				T * begin = data.begin() + runId*runSize;
+				T * end = data.begin() + std::min(size, (runId+1)*runSize);
+				run.assign(begin, end);
+				std::sort(run.begin(), run.end(), comp);
+				std::copy(run.begin(), run.end(), begin);
+			}
+		});
+	}
+	for(std::thread & t : threads) {
+		t.join();
+	}
+	if (runsCount <= 1) {
+		return;
+	}
+
+	//k-way merge of the runs with a heap of their current positions
+	typedef std::pair<uint64_t, uint64_t> Cursor;
+	auto heapComp = [&data, &comp](const Cursor & a, const Cursor & b) {
+		return comp(data[b.first], data[a.first]);
+	};
+	std::vector<Cursor> heap;
+	heap.reserve(runsCount);
+	for(uint64_t i(0); i < runsCount; ++i) {
+		heap.emplace_back(i*runSize, std::min(size, (i+1)*runSize));
+	}
+	std::make_heap(heap.begin(), heap.end(), heapComp);
+	sserialize::MMVector<T> result(mmt);
+	result.reserve(size);
+	while (heap.size()) {
+		std::pop_heap(heap.begin(), heap.end(), heapComp);
+		Cursor & c = heap.back();
+		result.push_back(data[c.first]);
+		++c.first;
+		if (c.first < c.second) {
+			std::push_heap(heap.begin(), heap.end(), heapComp);
+		}
+		else {
+			heap.pop_back();
+		}
+	}
+	data = std::move(result);
+}
+
+}//end namespace osmtools
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef OSM_TOOLS_EXTRACTION_CACHE_H
+#define OSM_TOOLS_EXTRACTION_CACHE_H
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <sserialize/spatial/GeoPolygon.h>
+#include <sserialize/spatial/GeoMultiPolygon.h>
+#include <sserialize/containers/MMVector.h>
+#include <sserialize/mt/ThreadPool.h>
+#include <osmpbf/iprimitive.h>
+
+/** Persistent cache of the regions assembled by the AreaExtractor
+  * A cache file holds the points and rings of every region, the id and type of its primitive and the values of a fixed set of tag keys.
+  * Points are stored as doubles and every region keeps its shape type, hence replaying the cache yields exactly the regions of the extraction.
+  * It is only used if it was created from the current version of the input file with the same extraction configuration.
+  * Cache files are memory-mapped, hence reading them does not need any parsing.
+  */
+
+namespace osmtools {
+
+class ExtractionCache {
+private:
+	struct Header;
+	struct RegionEntry {
+		int64_t id;
+		uint16_t type;
+		//1 if the region is a GeoMultiPolygon, 0 if it is a GeoPolygon
+		uint16_t multi;
+		uint32_t ringsSize;
+		uint64_t ringsBegin;
+	};
+	struct RingEntry {
+		uint64_t pointsBegin;
+		uint32_t pointsSize;
+		uint32_t inner;
+	};
+	struct PointEntry {
+		double lat;
+		double lon;
+	};
+public:
+	///Identifies the input and the configuration of an extraction
+	struct Key {
+		std::string inputFileName;
+		uint32_t extractionTypes{0};
+		bool snapGeometry{false};
+		///identifies the external filter, empty if there is none
+		std::string filterKey;
+		///identifies the clip region, empty if there is none
+		std::string clipKey;
+		///the values of these keys are stored for every region
+		std::vector<std::string> tagKeys;
+	};
+	///The primitive of a region, values are in the order of Key::tagKeys and empty if the primitive does not have the tag
+	struct Primitive {
+		int64_t id{0};
+		osmpbf::PrimitiveType type{osmpbf::WayPrimitive};
+		std::vector<std::string> values;
+	};
+	///Every thread appends its regions to its own buffer whose entries are kept in temporary files,
+	///store() merges the buffers into the cache file
+	class Writer {
+	public:
+		Writer(const Key & key);
+		~Writer();
+		///set p to the projection of primitive onto the tag keys
+		void project(osmpbf::IPrimitive & primitive, Primitive & p) const;
+		///@thread-safety yes
+		void push_back(const sserialize::spatial::GeoRegion & region, const Primitive & p);
+		///write to a temporary file which is renamed to cacheFileName
+		bool store(const std::string & cacheFileName) const;
+	private:
+		//entries of the regions of a single thread, rings and points are relative to the buffer
+		struct Buffer {
+			sserialize::MMVector<RegionEntry> regions;
+			sserialize::MMVector<RingEntry> rings;
+			sserialize::MMVector<PointEntry> points;
+			//ids of the values in strings
+			sserialize::MMVector<uint32_t> values;
+			std::unordered_map<std::string, uint32_t> stringIds;
+			std::vector<std::string> strings;
+			Buffer();
+			uint32_t stringId(const std::string & str);
+		};
+	private:
+		///the buffer of the calling thread
+		Buffer & localBuffer();
+	private:
+		Key m_key;
+		//distinguishes writers in the buffer cache of a thread
+		uint64_t m_id;
+		std::unordered_map<std::string, uint32_t> m_tagKeyIds;
+		std::deque<Buffer> m_buffers;
+		std::unordered_map<std::thread::id, Buffer*> m_threadBuffers;
+		std::mutex m_lock;
+	};
+public:
+	ExtractionCache();
+	~ExtractionCache();
+	///map cacheFileName if it holds a cache for key
+	bool open(const std::string & cacheFileName, const Key & key);
+	void close();
+	std::size_t size() const;
+	void primitive(std::size_t pos, Primitive & p) const;
+	///@return a new region of the same type as the one passed to Writer::push_back()
+	sserialize::spatial::GeoRegion * region(std::size_t pos) const;
+	///pass all regions to processor(const std::shared_ptr<sserialize::spatial::GeoRegion> & region, const Primitive & primitive)
+	///@param processor MUST be thread-safe
+	template<typename TProcessor>
+	void replay(TProcessor & processor, uint32_t threadCount) const {
+		if (!threadCount) {
+			threadCount = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+		}
+		struct WorkContext {
+			std::atomic<std::size_t> nextRegion{0};
+			const ExtractionCache * cache;
+			TProcessor * processor;
+		};
+		struct Worker {
+			WorkContext * ctx;
+			Worker(WorkContext * ctx) : ctx(ctx) {}
+			Worker(const Worker & other) : ctx(other.ctx) {}
+			void operator()() {
+				Primitive p;
+				while (true) {
+					std::size_t pos = ctx->nextRegion.fetch_add(1, std::memory_order_relaxed);
+					if (pos >= ctx->cache->size()) {
+						return;
+					}
+					std::shared_ptr<sserialize::spatial::GeoRegion> r( ctx->cache->region(pos) );
+					ctx->cache->primitive(pos, p);
+					(*(ctx->processor))(r, p);
+				}
+			}
+		};
+		WorkContext wctx;
+		wctx.cache = this;
+		wctx.processor = &processor;
+		sserialize::ThreadPool::execute(Worker(&wctx), std::max<uint32_t>(std::min<std::size_t>(threadCount, size()), 1), sserialize::ThreadPool::CopyTaskTag());
+	}
+private:
+	static std::string serializeKey(const Key & key);
+private:
+	char * m_data;
+	std::size_t m_dataSize;
+	const Header * m_header;
+	const RegionEntry * m_regions;
+	const RingEntry * m_rings;
+	const PointEntry * m_points;
+	const uint32_t * m_values;
+	const uint64_t * m_stringOffsets;
+	const char * m_stringData;
+};
+
+}//end namespace osmtools
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef OSM_TOOLS_NODE_STORE_H
+#define OSM_TOOLS_NODE_STORE_H
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <memory>
+#include <sserialize/Static/GeoPoint.h>
+
+namespace osmtools {
+
+///Locations are stored in the fixed-point representation of sserialize::Static::spatial::GeoPoint,
+///hence stored locations are exactly the snapped locations of the regions built from them
+struct FixedPointCoord {
+	///marks a slot without location, this is above the representation of any valid coordinate
+	static constexpr uint32_t Null = std::numeric_limits<uint32_t>::max();
+	static inline uint32_t toFixedLat(double v) { return sserialize::Static::spatial::GeoPoint::toIntLat(v); }
+	static inline uint32_t toFixedLon(double v) { return sserialize::Static::spatial::GeoPoint::toIntLon(v); }
+	static inline double toDoubleLat(uint32_t v) { return sserialize::Static::spatial::GeoPoint::toDoubleLat(v); }
+	static inline double toDoubleLon(uint32_t v) { return sserialize::Static::spatial::GeoPoint::toDoubleLon(v); }
+	///pack a location into a single 64 bit value, locations with Null latitude are missing
+	static inline int64_t pack(uint32_t lat, uint32_t lon) { return (int64_t)(((uint64_t)lat << 32) | lon); }
+	static inline uint32_t unpackLat(int64_t v) { return (uint32_t)((uint64_t)v >> 32); }
+	static inline uint32_t unpackLon(int64_t v) { return (uint32_t)v; }
+	///packed value of a missing location
+	static inline int64_t missing() { return pack(Null, Null); }
+};
+
+///Stores the locations of a set of nodes known in advance.
+///Node ids are kept in a sorted, deduplicated id array with parallel fixed-point coordinate arrays (16 Bytes per node).
+class SparseNodeStore {
+public:
+	typedef std::pair<double, double> Point;
+	static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+	///memory of a node in Bytes
+	static constexpr std::size_t NodeBytes = sizeof(int64_t) + 2*sizeof(uint32_t);
+public:
+	SparseNodeStore();
+	~SparseNodeStore();
+	///set the node ids and allocate the coordinates
+	///@param ids sorted and free of duplicates
+	void assign(std::vector<int64_t> && ids);
+	void clear();
+	///remove all nodes without location, this changes the positions of nodes
+	void compact();
+	std::size_t size() const;
+	bool empty() const;
+	int64_t minId() const;
+	int64_t maxId() const;
+	const std::vector<int64_t> & ids() const;
+	///@return position of id or npos
+	inline std::size_t find(int64_t id) const {
+		std::size_t n = m_ids.size();
+		if (!n) {
+			return npos;
+		}
+		//branch-free binary search for the last element <= id
+		const int64_t * base = m_ids.data();
+		while (n > 1) {
+			std::size_t half = n/2;
+			base = (base[half] <= id) ? base+half : base;
+			n -= half;
+		}
+		return (*base == id ? (std::size_t)(base-m_ids.data()) : npos);
+	}
+	///Slots are written lock-free, different threads have to write to different positions
+	///@thread-safety yes for different positions
+	inline void set(std::size_t pos, double lat, double lon) {
+		m_lat[pos] = FixedPointCoord::toFixedLat(lat);
+		m_lon[pos] = FixedPointCoord::toFixedLon(lon);
+	}
+	///true if the location of the node at pos was set
+	inline bool has(std::size_t pos) const {
+		return m_lat[pos] != FixedPointCoord::Null;
+	}
+	inline Point at(std::size_t pos) const {
+		return Point(FixedPointCoord::toDoubleLat(m_lat[pos]), FixedPointCoord::toDoubleLon(m_lon[pos]));
+	}
+	///the location of the node at pos packed by FixedPointCoord::pack()
+	inline int64_t packed(std::size_t pos) const {
+		return FixedPointCoord::pack(m_lat[pos], m_lon[pos]);
+	}
+	///@return true if the node is part of the store and has a location
+	inline bool get(int64_t id, Point & p) const {
+		std::size_t pos = find(id);
+		if (pos == npos || !has(pos)) {
+			return false;
+		}
+		p = at(pos);
+		return true;
+	}
+private:
+	std::vector<int64_t> m_ids;
+	std::vector<uint32_t> m_lat;
+	std::vector<uint32_t> m_lon;
+};
+
+///Two-level bitmap over a set of node ids.
+///The first level holds a pointer per page of 4096 ids, only pages containing at least one id are allocated.
+class NodeIdBitmap {
+private:
+	static constexpr uint32_t PageBits = 12;
+	static constexpr uint32_t PageWords = (uint32_t(1) << PageBits)/64;
+	typedef std::unique_ptr<uint64_t[]> Page;
+public:
+	NodeIdBitmap();
+	~NodeIdBitmap();
+	///@param ids sorted
+	void assign(const std::vector<int64_t> & ids);
+	void clear();
+	///storage size in Bytes
+	std::size_t storageSize() const;
+	///the page of id in a bitmap whose smallest id is base
+	static inline uint64_t page(int64_t base, int64_t id) { return ((uint64_t)id - (uint64_t)base) >> PageBits; }
+	///storage size in Bytes of a bitmap whose ids span spanPages pages of which usedPages contain ids
+	static inline std::size_t storageSize(uint64_t spanPages, uint64_t usedPages) {
+		return spanPages*sizeof(Page) + usedPages*PageWords*sizeof(uint64_t);
+	}
+	inline bool test(int64_t id) const {
+		uint64_t off = (uint64_t)id - (uint64_t)m_base;
+		if (id < m_base || (off >> PageBits) >= m_pages.size()) {
+			return false;
+		}
+		const Page & page = m_pages[off >> PageBits];
+		return page && ((page[(off >> 6) & (PageWords-1)] >> (off & 63)) & 0x1);
+	}
+	///@return true if any id in [first, last] is set
+	bool any(int64_t first, int64_t last) const;
+private:
+	int64_t m_base;
+	std::vector<Page> m_pages;
+};
+
+///Stores the locations of all nodes with ids in [0, maxId] in an mmap-backed array indexed by node id (8 Bytes per id).
+///Pages without nodes are never touched, hence memory (or disk space) is only used for ranges containing nodes.
+class DenseNodeStore {
+public:
+	typedef std::pair<double, double> Point;
+private:
+	//an all-zero slot has no location, hence lat is stored with an offset
+	static constexpr uint32_t LatOffset = 1;
+	struct Slot {
+		uint32_t lat;
+		uint32_t lon;
+	};
+public:
+	DenseNodeStore();
+	~DenseNodeStore();
+	///@param directory the array is backed by an unlinked temporary file in directory, if empty anonymous memory is used
+	///@return false if the memory could not be mapped
+	bool init(int64_t maxId, const std::string & directory = std::string());
+	void clear();
+	///number of storable ids
+	std::size_t size() const;
+	///@thread-safety yes for different ids
+	inline void set(int64_t id, double lat, double lon) {
+		if (id >= 0 && (std::size_t) id < m_size) {
+			Slot & s = m_data[id];
+			s.lat = FixedPointCoord::toFixedLat(lat) + LatOffset;
+			s.lon = FixedPointCoord::toFixedLon(lon);
+		}
+	}
+	///@return true if the node has a location
+	inline bool get(int64_t id, Point & p) const {
+		if (id < 0 || (std::size_t) id >= m_size || !m_data[id].lat) {
+			return false;
+		}
+		const Slot & s = m_data[id];
+		p.first = FixedPointCoord::toDoubleLat(s.lat - LatOffset);
+		p.second = FixedPointCoord::toDoubleLon(s.lon);
+		return true;
+	}
+private:
+	Slot * m_data;
+	std::size_t m_size;
+	int m_fd;
+};
+
+}//end namespace osmtools
+
+#endif
@@ -5,7 +5,9 @@
 #include <sserialize/iterator/RangeGenerator.h>
 #include <sserialize/utility/printers.h>
 #include <osmtools/types.h>
+#include <iterator>
 #include <mutex>
+#include <deque>
 
 namespace osmtools {
 
@@ -19,6 +21,15 @@ public:
 private:
 	typedef GeoPointStorageBackend PointDataContainer;
 	typedef OsmGeoPolygonStorageBackend PolygonsContainer;
+	
+	///Storage of the regions added by a single RegionWriter
+	struct StorageSegment {
+		PointDataContainer points;
+		PolygonsContainer polygons;
+		std::deque<osmtools::OsmGeoPolygon> polygonRegions;
+		std::deque<osmtools::OsmGeoMultiPolygon> multiPolygonRegions;
+		StorageSegment();
+	};
 
 	template<typename T_GP_TYPE>
 	struct ConvertGP {
@@ -29,6 +40,15 @@ private:
 			pointsDest.push_back(gp->cbegin(), gp->cend());
 			return new osmtools::OsmGeoPolygon(osmtools::OsmGeoPolygon::PointsContainer(&pointsDest, pointsBegin, pointsSize));
 		}
+		static uint32_t pointsSize(const sserialize::spatial::GeoRegion * r) {
+			return static_cast<const T_GP_TYPE*>(r)->size();
+		}
+		///convert into preallocated storage, pointsDest has to hold pointsSize(r) points starting at pointsBegin
+		static void conv(PointDataContainer & pointsDest, sserialize::OffsetType pointsBegin, const sserialize::spatial::GeoRegion * r, osmtools::OsmGeoPolygon & dest) {
+			const T_GP_TYPE * gp = static_cast<const T_GP_TYPE*>(r);
+			std::copy(gp->cbegin(), gp->cend(), pointsDest.begin()+pointsBegin);
+			dest = osmtools::OsmGeoPolygon(osmtools::OsmGeoPolygon::PointsContainer(&pointsDest, pointsBegin, gp->size()));
+		}
 	};
 
 	template<typename T_GMP_TYPE>
@@ -60,6 +80,46 @@ private:
 													gmp->innerPolygonsBoundary()
 			);
 		}
+		static uint32_t pointsSize(const sserialize::spatial::GeoRegion * r) {
+			typedef typename T_GMP_TYPE::GeoPolygon MyGeoPolygon;
+			const T_GMP_TYPE * gmp = static_cast<const T_GMP_TYPE*>(r);
+			uint32_t result = 0;
+			for(const MyGeoPolygon & gp : gmp->outerPolygons()) {
+				result += gp.size();
+			}
+			for(const MyGeoPolygon & gp : gmp->innerPolygons()) {
+				result += gp.size();
+			}
+			return result;
+		}
+		static uint32_t polygonsSize(const sserialize::spatial::GeoRegion * r) {
+			const T_GMP_TYPE * gmp = static_cast<const T_GMP_TYPE*>(r);
+			return gmp->outerPolygons().size() + gmp->innerPolygons().size();
+		}
+		///convert into preallocated storage, see pointsSize() and polygonsSize()
+		static void conv(PointDataContainer & pointsDest, sserialize::OffsetType pointsBegin,
+						PolygonsContainer & polygonsDest, sserialize::OffsetType polygonsBegin,
+						const sserialize::spatial::GeoRegion * r, osmtools::OsmGeoMultiPolygon & dest)
+		{
+			typedef typename T_GMP_TYPE::GeoPolygon MyGeoPolygon;
+			const T_GMP_TYPE * gmp = static_cast<const T_GMP_TYPE*>(r);
+			sserialize::OffsetType outerBegin = polygonsBegin;
+			sserialize::OffsetType innerBegin = outerBegin + gmp->outerPolygons().size();
+			for(int inner(0); inner < 2; ++inner) {
+				for(const MyGeoPolygon & gp : (inner ? gmp->innerPolygons() : gmp->outerPolygons())) {
+					std::copy(gp.cbegin(), gp.cend(), pointsDest.begin()+pointsBegin);
+					polygonsDest[polygonsBegin] = osmtools::OsmGeoPolygon(gp.boundary(), osmtools::OsmGeoPolygon::PointsContainer(&pointsDest, pointsBegin, gp.size()));
+					pointsBegin += gp.size();
+					++polygonsBegin;
+				}
+			}
+			dest = osmtools::OsmGeoMultiPolygon(gmp->size(),
+												osmtools::OsmGeoMultiPolygon::PolygonList(&polygonsDest, outerBegin, gmp->outerPolygons().size()),
+												osmtools::OsmGeoMultiPolygon::PolygonList(&polygonsDest, innerBegin, gmp->innerPolygons().size()),
+												gmp->outerPolygonsBoundary(),
+												gmp->innerPolygonsBoundary()
+			);
+		}
 	};
 	
 	class FixedSizeDiagRefiner final {
@@ -73,11 +133,75 @@ private:
 		~FixedSizeDiagRefiner();
 		bool operator()(const sserialize::spatial::GeoRect& maxBounds, const std::vector<sserialize::spatial::GeoRegion*>& rId2Ptr, const std::vector<uint32_t> & sortedRegions, sserialize::spatial::GeoGrid & newGrid) const;
 	};
+	///Output iterator mapping the region ids of a raster cell to the ids of the tree
+	template<typename T_OUTPUT_ITERATOR>
+	class RegionIdMapper {
+	public:
+		typedef std::output_iterator_tag iterator_category;
+		typedef void value_type;
+		typedef void difference_type;
+		typedef void pointer;
+		typedef void reference;
+	public:
+		RegionIdMapper(const uint32_t * ids, T_OUTPUT_ITERATOR out) : m_ids(ids), m_out(out) {}
+		inline RegionIdMapper & operator*() { return *this; }
+		inline RegionIdMapper & operator++() { return *this; }
+		inline RegionIdMapper & operator++(int) { return *this; }
+		inline RegionIdMapper & operator=(uint32_t cellRegionId) {
+			*m_out = m_ids[cellRegionId];
+			++m_out;
+			return *this;
+		}
+		inline const T_OUTPUT_ITERATOR & base() const { return m_out; }
+	private:
+		const uint32_t * m_ids;
+		T_OUTPUT_ITERATOR m_out;
+	};
+	static constexpr uint32_t NoCell = 0xFFFFFFFF;
+	///cells are enlarged by this (in degrees) to catch rounding errors of the cell computation
+	static constexpr double CellMargin = 1e-7;
+	///statistics of the last addPolygonsToRaster(), times are in microseconds
+	///Refinement below the root grid happens within sserialize::spatial::GridRegionTree, hence levels 1+ are timed together
+	struct RasterStats {
+		uint32_t latCount{0};
+		uint32_t lonCount{0};
+		///number of threads that built the tree
+		uint32_t threadCount{0};
+		///(root cell, region) pairs, only set if the root cells were built by several threads
+		uint64_t cellRegions{0};
+		///number of non-empty root cells with their own GridRegionTree, only set if the root cells were built by several threads
+		uint32_t cellTrees{0};
+		///level 0: assigning regions to the cells of the root grid
+		uint64_t level0Time{0};
+		///levels 1+: wall time of the refinement of the root cells, with a single thread this includes level 0
+		uint64_t levelsTime{0};
+		///levels 1+: sum of the refinement times of all root cells
+		uint64_t cellsTime{0};
+		///levels 1+: slowest root cell
+		uint64_t maxCellTime{0};
+	};
 private:
+	//the top-level raster, every cell has its own GridRegionTree which is built independently
+	sserialize::spatial::GeoRect m_rasterBounds;
+	uint32_t m_rasterLatCount;
+	uint32_t m_rasterLonCount;
+	double m_rasterLatStep;
+	double m_rasterLonStep;
+	//the tree built by a single thread, empty if the root cells were built by several threads
 	sserialize::spatial::GridRegionTree m_grt;
+	std::vector<sserialize::spatial::GridRegionTree> m_cellTrees;
+	//regions of cell i are at [m_cellRegionsOffsets[i], m_cellRegionsOffsets[i+1]) of m_cellRegions and m_cellRegionPtrs
+	std::vector<uint32_t> m_cellRegionsOffsets;
+	std::vector<uint32_t> m_cellRegions;
+	RegionsContainer m_cellRegionPtrs;
+	RasterStats m_rasterStats;
 	PointDataContainer m_polygonPoints;
 	PolygonsContainer m_polygonsContainer;
 	RegionsContainer m_regions;
+	//regions created by push_back, regions of RegionWriters are owned by their segment
+	RegionsContainer m_allocatedRegions;
+	std::deque<StorageSegment> m_segments;
+	std::mutex m_segmentsLock;
 	uint32_t m_latRefineCount;
 	uint32_t m_lonRefineCount;
 	double m_refineMinDiag;
@@ -86,29 +210,148 @@ protected:
 	void reorderRegions(const T_REORDER_MAP & rm) {
 		sserialize::reorder(m_regions, rm);
 	}
+	///Convert regions by threadCount threads into a new storage segment, dest[i] is the converted regions[i]
+	///Threads reserve their ranges of points and polygons with an atomic fetch-add, hence no lock is held during conversion
+	///The converted regions are not part of the tree until they are added by appendRegions()
+	///@thread-safety yes
+	void convertRegions(const std::vector<const sserialize::spatial::GeoRegion*> & regions, uint32_t threadCount, RegionsContainer & dest);
+	///@thread-safety no
+	void appendRegions(const RegionsContainer & regions);
+public:
+	///Writes regions directly into storage of the tree without intermediate GeoPolygon objects.
+	///Every writer appends to its own storage segment, hence writers of different threads do not interfere.
+	///The segment is created on first use, writers without regions do not add segments to the tree.
+	///Finished regions are added to the tree in batches by OsmGridRegionTree::RegionWriter
+	class RegionWriter {
+	public:
+		///append the points of the current ring to this storage
+		inline PointDataContainer & points() { return segment().points; }
+		///the points appended since the last call to endRing() or dropRing() form a ring of the current region
+		void endRing(bool inner);
+		///remove the points appended since the last call to endRing() or dropRing()
+		void dropRing();
+		///drop the current region
+		void dropRegion();
+	protected:
+		RegionWriter(OsmGridRegionTreeBase * tree);
+		~RegionWriter();
+		///finish the current region and add it to the pending regions
+		///@return false if the region has no outer ring, it is dropped in this case
+		bool endRegion();
+		///add pending regions to the tree
+		///@thread-safety no
+		void flushRegions();
+		std::size_t pendingSize() const;
+	private:
+		inline StorageSegment & segment() {
+			if (!m_seg) {
+				createSegment();
+			}
+			return *m_seg;
+		}
+		void createSegment();
+	private:
+		struct Ring {
+			sserialize::OffsetType begin;
+			uint32_t size;
+			bool inner;
+		};
+	private:
+		OsmGridRegionTreeBase * m_tree;
+		StorageSegment * m_seg;
+		sserialize::OffsetType m_ringBegin;
+		std::vector<Ring> m_rings;
+		RegionsContainer m_pending;
+	};
+	///Result and reusable buffers of a batch query, see find(const Point*, std::size_t, BatchQuery&, uint32_t)
+	///Buffers keep their capacity, hence reusing a BatchQuery for several queries does not allocate memory after the first ones
+	class BatchQuery {
+	public:
+		BatchQuery();
+		~BatchQuery();
+		///number of points of the last query
+		std::size_t size() const;
+		///regions of point i are regionIds()[offsets()[i], offsets()[i+1]) in ascending order
+		inline const std::vector<uint64_t> & offsets() const { return m_offsets; }
+		inline const std::vector<uint32_t> & regionIds() const { return m_regionIds; }
+		inline const uint32_t * regionsBegin(std::size_t i) const { return m_regionIds.data() + m_offsets[i]; }
+		inline const uint32_t * regionsEnd(std::size_t i) const { return m_regionIds.data() + m_offsets[i+1]; }
+	private:
+		friend class OsmGridRegionTreeBase;
+		///buffers of a single thread
+		struct Scratch {
+			//processed points in the order of processing
+			std::vector<std::size_t> points;
+			//their regions
+			std::vector<uint32_t> regionIds;
+		};
+	private:
+		std::vector<uint64_t> m_offsets;
+		std::vector<uint32_t> m_regionIds;
+		//raster cell of every point
+		std::vector<uint32_t> m_cells;
+		//points ordered by their raster cell
+		std::vector<std::size_t> m_order;
+		std::vector<std::size_t> m_cellOffsets;
+		std::vector<Scratch> m_scratch;
+	};
 public:
 	OsmGridRegionTreeBase();
 	virtual ~OsmGridRegionTreeBase();
-	const sserialize::spatial::GridRegionTree & grt() const;
 	void clearGRT();
 	void clear();
 	///@thread-safety no
 	void push_back(const sserialize::spatial::GeoRegion * p);
+	///Add regions in parallel, regions get consecutive ids in the order of regions
+	///@param threadCount 0 for hardware concurrency
+	///@thread-safety no
+	void push_back(const std::vector<const sserialize::spatial::GeoRegion*> & regions, uint32_t threadCount = 0);
 	///"snap" points to the accuracy of sserialize::Static::spatial::GeoPoint
+	///Points are already stored with this accuracy if LIBOSMTOOLS_FIXED_POINT_STORAGE is set (the default)
 	///This will also recalculate the bbox of all regions
 	void snapPoints();
 	void printStats(std::ostream & out);
+	const RasterStats & rasterStats() const;
 	std::size_t size() const;
+	///points added by push_back, points of RegionWriters are stored in separate segments
 	const PointDataContainer & points() const;
 	const RegionsContainer & regions() const;
 	void setRefinerOptions(uint32_t latRefineCount, uint32_t lonRefineCount, double minDiag);
 	///you can still add more regions after calling this but they will not be part of the tree
 	///if you want them in the tree aswell then you should call this again (which will rebuild the tree)
-	void addPolygonsToRaster(unsigned int gridLatCount, unsigned int gridLonCount);
-	
+	///gridLatCount x gridLonCount is the root grid of the tree, its cells are refined by the refiner set by setRefinerOptions()
+	///With threadCount == 1 a single GridRegionTree is built, see grt().
+	///Otherwise the root cells are refined in parallel into one GridRegionTree per cell, see grt(cell).
+	///This stores the ids of every region once per root cell overlapping its bbox in addition to the leaves of the trees.
+	///@param threadCount 0 for hardware concurrency
+	void addPolygonsToRaster(unsigned int gridLatCount, unsigned int gridLonCount, uint32_t threadCount = 1);
+	///the tree built by addPolygonsToRaster() with a single thread, empty if the root cells were built by several threads
+	const sserialize::spatial::GridRegionTree & grt() const;
+	///number of root cells with their own tree, 0 if the tree was built by a single thread
+	inline uint32_t cellCount() const { return (uint32_t) m_cellTrees.size(); }
+	///@return root cell of p or NoCell if p is not within a root cell with its own tree
+	uint32_t rasterCell(const Point & p) const;
+	///GridRegionTree of a root cell, its region ids are cell-local, use cellRegions(cell) to map them to region ids
+	inline const sserialize::spatial::GridRegionTree & grt(uint32_t cell) const { return m_cellTrees.at(cell); }
+	///number of regions in the tree of cell
+	inline uint32_t cellRegionsSize(uint32_t cell) const { return m_cellRegionsOffsets[cell+1] - m_cellRegionsOffsets[cell]; }
+	///region ids of the tree of cell, cellRegions(cell)[i] is the region id of the cell-local id i
+	inline const uint32_t * cellRegions(uint32_t cell) const { return m_cellRegions.data() + m_cellRegionsOffsets[cell]; }
+
 	template<typename T_OUTPUT_ITERATOR1, typename T_OUTPUT_ITERATOR2>
 	void test(const Point & p, T_OUTPUT_ITERATOR1 definiteEnclosing, T_OUTPUT_ITERATOR2 candidateEnclosing) const {
-		m_grt.find(p, definiteEnclosing, candidateEnclosing);
+		if (!m_cellTrees.size()) {
+			m_grt.find(p, definiteEnclosing, candidateEnclosing);
+			return;
+		}
+		uint32_t cell = rasterCell(p);
+		if (cell == NoCell) {
+			return;
+		}
+		m_cellTrees[cell].find(p,
+			RegionIdMapper<T_OUTPUT_ITERATOR1>(cellRegions(cell), definiteEnclosing),
+			RegionIdMapper<T_OUTPUT_ITERATOR2>(cellRegions(cell), candidateEnclosing)
+		);
 	}
 	
 	///This is thread safe if you do not after calling addPolygonsToRaster()
@@ -116,7 +359,7 @@ public:
 	template<typename T_CONTAINER_TYPE>
 	void test(const Point & p, T_CONTAINER_TYPE & dest) const {
 		std::insert_iterator<T_CONTAINER_TYPE> inserter(dest, dest.end());
-		m_grt.find(p, inserter);
+		find(p, inserter);
 	}
 	
 	///This is thread safe if you do not after calling addPolygonsToRaster()
@@ -127,7 +370,17 @@ public:
 	
 	template<typename T_OUTPUT_ITERATOR>
 	void find(const Point & p, T_OUTPUT_ITERATOR & dest) const {
-		m_grt.find(p, dest);
+		if (!m_cellTrees.size()) {
+			m_grt.find(p, dest);
+			return;
+		}
+		uint32_t cell = rasterCell(p);
+		if (cell == NoCell) {
+			return;
+		}
+		RegionIdMapper<T_OUTPUT_ITERATOR> mapper(cellRegions(cell), dest);
+		m_cellTrees[cell].find(p, mapper);
+		dest = mapper.base();
 	}
 	
 	///This is thread safe if you do not after calling addPolygonsToRaster()
@@ -136,6 +389,12 @@ public:
 		find(Point(lat, lon), dest);
 	}
 	
+	///Find the regions of many points at once
+	///Points are sorted by their root cell if the root cells have their own trees and processed in this order by threadCount threads
+	///@param threadCount 0 for hardware concurrency
+	///This is thread safe if you do not after calling addPolygonsToRaster()
+	void find(const Point * points, std::size_t pointsSize, BatchQuery & query, uint32_t threadCount = 0) const;
+	
 	///This is thread safe if you do not after calling addPolygonsToRaster()
 	template<typename T_SET_TYPE = std::set<uint32_t> >
 	T_SET_TYPE test(const Point & p) const {
@@ -182,6 +441,45 @@ public:
 		sserialize::reorder(m_values, tmp);
 		reorderRegions(tmp);
 	}
+	///RegionWriter storing a value for every region
+	///Create one writer per thread, regions are added when the writer is flushed or destroyed
+	class RegionWriter: public OsmGridRegionTreeBase::RegionWriter {
+	public:
+		static constexpr std::size_t FlushSize = 1024;
+	public:
+		RegionWriter(OsmGridRegionTree * tree) : OsmGridRegionTreeBase::RegionWriter(tree), m_tree(tree) {}
+		RegionWriter(const RegionWriter & other) = delete;
+		~RegionWriter() {
+			flush();
+		}
+		///finish the current region
+		///@return false if the region has no outer ring, it is dropped in this case
+		bool endRegion(const value_type & value) {
+			if (!OsmGridRegionTreeBase::RegionWriter::endRegion()) {
+				return false;
+			}
+			m_values.push_back(value);
+			if (m_values.size() >= FlushSize) {
+				flush();
+			}
+			return true;
+		}
+		///add all finished regions to the tree
+		///@thread-safety yes
+		void flush() {
+			if (!m_values.size()) {
+				return;
+			}
+			std::lock_guard<std::mutex> lck(m_tree->m_mtx);
+			flushRegions();
+			m_tree->m_values.insert(m_tree->m_values.end(), std::make_move_iterator(m_values.begin()), std::make_move_iterator(m_values.end()));
+			m_values.clear();
+		}
+	private:
+		OsmGridRegionTree * m_tree;
+		ValuesContainer m_values;
+	};
+public:
 	///this is thread-safe
 	uint32_t push_back(const sserialize::spatial::GeoRegion & p, const value_type & value) {
 		std::lock_guard<std::mutex> lck(m_mtx);
@@ -198,6 +496,23 @@ public:
 		m_values.emplace_back(value);
 		return pid;
 	}
+	///Add regions in parallel, the value of regions[i] is values[i]
+	///Regions are converted without holding the lock of the tree, only their ids are published under the lock
+	///@param threadCount 0 for hardware concurrency
+	///@return id of the first region, regions get consecutive ids in the order of regions
+	///@thread-safety yes
+	template<typename T_VALUE_ITERATOR>
+	uint32_t push_back(const std::vector<const sserialize::spatial::GeoRegion*> & regions, T_VALUE_ITERATOR values, uint32_t threadCount = 0) {
+		RegionsContainer converted;
+		convertRegions(regions, threadCount, converted);
+		std::lock_guard<std::mutex> lck(m_mtx);
+		uint32_t pid = (uint32_t) size();
+		appendRegions(converted);
+		for(std::size_t i(0), s(regions.size()); i < s; ++i, ++values) {
+			m_values.push_back(*values);
+		}
+		return pid;
+	}
 private:
 	ValuesContainer m_values;
 	std::mutex m_mtx;
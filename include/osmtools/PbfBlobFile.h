@@ -0,0 +1,252 @@
+#ifndef OSM_TOOLS_PBF_BLOB_FILE_H
+#define OSM_TOOLS_PBF_BLOB_FILE_H
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+#include <thread>
+#include <iostream>
+#include <osmpbf/primitiveblockinputadaptor.h>
+
+/** Blob-level access to OpenStreetMap pbf-files
+  * The first full scan of a file records a per-blob index (file offset, primitive kinds and id ranges).
+  * Later scans use this index to only read and inflate blobs that can contribute to a pass.
+  * The index can be stored in a sidecar file and is reused as long as the input file did not change.
+  * The file is memory-mapped if possible, blobs are then parsed and inflated directly from the mapping.
+  */
+
+namespace osmtools {
+
+struct PbfBlobInfo {
+	typedef enum {
+		BK_NONE=0x0, BK_HEADER=0x1, BK_NODES=0x2, BK_WAYS=0x4, BK_RELATIONS=0x8,
+		BK_PRIMITIVES=BK_NODES|BK_WAYS|BK_RELATIONS
+	} Kinds;
+	///offset of the blob-header length field
+	uint64_t offset{0};
+	uint32_t headerSize{0};
+	uint32_t dataSize{0};
+	uint32_t kinds{BK_NONE};
+	int64_t minNodeId{0};
+	int64_t maxNodeId{0};
+	int64_t minWayId{0};
+	int64_t maxWayId{0};
+	int64_t minRelationId{0};
+	int64_t maxRelationId{0};
+	inline uint64_t dataOffset() const { return offset+4+headerSize; }
+	inline uint64_t endOffset() const { return dataOffset()+dataSize; }
+};
+
+class PbfBlobIndex {
+public:
+	typedef std::vector<PbfBlobInfo> BlobsContainer;
+public:
+	PbfBlobIndex();
+	~PbfBlobIndex();
+	///true if the index covers the whole file
+	bool complete() const;
+	std::size_t size() const;
+	const PbfBlobInfo & at(std::size_t pos) const;
+	const BlobsContainer & blobs() const;
+	void clear();
+	///the sidecar-file of the index of the file fileName
+	///@param directory directory of the sidecar-file, the directory of fileName if empty
+	static std::string sidecarFileName(const std::string & fileName, const std::string & directory = std::string());
+	///loads the index from the sidecar file of fileName iff it was created for the current version of fileName
+	bool load(const std::string & fileName, const std::string & directory = std::string());
+	///only complete indexes are stored
+	bool store(const std::string & fileName, const std::string & directory = std::string()) const;
+	///set kinds and id ranges of info from the data in pbi
+	static void fill(PbfBlobInfo & info, osmpbf::PrimitiveBlockInputAdaptor & pbi);
+private:
+	friend class PbfBlobFile;
+	BlobsContainer m_blobs;
+	bool m_complete;
+};
+
+class PbfBlobFile {
+public:
+	typedef std::vector<char> BlobBuffer;
+public:
+	PbfBlobFile(const std::string & fileName);
+	~PbfBlobFile();
+	bool open();
+	void close();
+	const std::string & fileName() const;
+	uint64_t dataSize() const;
+	///offset of the last blob handed out in the current scan
+	uint64_t dataPosition() const;
+	void reset();
+	const PbfBlobIndex & index() const;
+	///try to load the index from its sidecar-file
+	///@param directory see PbfBlobIndex::sidecarFileName
+	bool loadIndex(const std::string & directory = std::string());
+	bool storeIndex(const std::string & directory = std::string()) const;
+	///true if the file is memory-mapped
+	bool mapped() const;
+	///@param compressed buffer of the compressed blob, unused if the file is memory-mapped
+	///@thread-safety yes
+	bool readBlob(const PbfBlobInfo & info, BlobBuffer & compressed, BlobBuffer & dest) const;
+public: //used by parseBlobsCPPThreads
+	///Get the next blob during a sequential scan, this adds the blob to the index
+	///@thread-safety yes
+	///@return false if there are no more blobs
+	bool nextBlob(PbfBlobInfo & info, uint32_t & blobId);
+	///@thread-safety yes
+	void updateBlob(uint32_t blobId, const PbfBlobInfo & info);
+	///@thread-safety yes
+	void advance(const PbfBlobInfo & info);
+	///Abort the current scan, e.g. if a blob can not be read or inflated
+	///@thread-safety yes
+	void failScan();
+	///true if the current scan was aborted
+	///@thread-safety yes
+	bool scanFailed() const;
+	///Marks the index as complete if the last sequential scan reached the end of the file without errors
+	///and every blob of the scan was resolved by updateBlob()
+	void finishScan();
+private:
+	bool readBlobHeader(uint64_t offset, PbfBlobInfo & info) const;
+	bool readAt(uint64_t offset, char * dest, std::size_t size) const;
+	///@return pointer to size bytes at offset, either into the mapping or into buffer
+	const char * dataAt(uint64_t offset, std::size_t size, BlobBuffer & buffer) const;
+private:
+	std::string m_fileName;
+	int m_fd;
+	//0 if the file is not memory-mapped
+	const char * m_data;
+	uint64_t m_size;
+	int64_t m_mtime;
+	PbfBlobIndex m_index;
+	std::mutex m_scanLock;
+	uint64_t m_scanOffset;
+	//number of primitive blobs handed out by nextBlob() but not yet passed to updateBlob()
+	uint32_t m_unresolvedBlobs;
+	std::atomic<bool> m_scanError;
+	std::atomic<uint64_t> m_dataPosition;
+};
+
+///Orders work on blobs processed in parallel by their blob ids.
+///A thread may wait() until all blobs before its current blob are finished, e.g. to emit results in file order.
+///Blobs finished before an earlier one are kept in a reorder buffer, which is bounded by the number of threads.
+class BlobSequencer {
+public:
+	BlobSequencer();
+	~BlobSequencer();
+	///start a new scan at blob 0
+	void reset();
+	///set the current blob of the calling thread
+	void begin(uint32_t blobId);
+	///wait until all blobs before the current blob of the calling thread are finished
+	///@thread-safety yes
+	void wait();
+	///mark blobId as finished, every blob of a scan has to be finished, including skipped ones
+	///@thread-safety yes
+	void finish(uint32_t blobId);
+	///maximum number of blobs that waited for or were finished before an earlier blob
+	uint32_t highWaterMark() const;
+private:
+	static thread_local uint32_t s_currentBlob;
+	std::mutex m_lock;
+	std::condition_variable m_cv;
+	uint32_t m_next;
+	std::unordered_set<uint32_t> m_finished;
+	uint32_t m_waiting;
+	uint32_t m_highWaterMark;
+};
+
+///Blob-level counterpart of osmpbf::parseFileCPPThreads
+///If the index of inFile is complete, only blobs for which blobFilter(const PbfBlobInfo &) returns true are read,
+///otherwise all blobs are read and the index is built on the fly
+///@param threadPrivateProcessor each thread gets its own copy of processor
+///@param sequencer if set, it is reset and the processor may wait for earlier blobs with sequencer->wait()
+///@return false if a blob could not be read, the scan is aborted and the processor did not see all relevant blobs
+template<typename TPBI_Processor, typename TBlobFilter>
+bool parseBlobsCPPThreads(PbfBlobFile & inFile, TPBI_Processor processor, uint32_t threadCount, bool threadPrivateProcessor, TBlobFilter blobFilter, BlobSequencer * sequencer = 0) {
+	if (!threadCount) {
+		threadCount = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	inFile.reset();
+	if (sequencer) {
+		sequencer->reset();
+	}
+	const bool indexed = inFile.index().complete();
+	std::atomic<uint32_t> nextIndexedBlob(0);
+
+	auto workFunc = [&inFile, &blobFilter, &nextIndexedBlob, indexed, sequencer](TPBI_Processor & myProcessor) {
+		osmpbf::PrimitiveBlockInputAdaptor pbi;
+		PbfBlobFile::BlobBuffer compressed, data;
+		PbfBlobInfo info;
+		uint32_t blobId = 0;
+		//@return false if the blob was skipped
+		auto processBlob = [&]() -> bool {
+			if (indexed && (!(info.kinds & PbfBlobInfo::BK_PRIMITIVES) || !blobFilter(info))) {
+				return false;
+			}
+			if (!indexed && (info.kinds & PbfBlobInfo::BK_HEADER)) {
+				return false;
+			}
+			if (!inFile.readBlob(info, compressed, data)) {
+				std::cerr << "parseBlobsCPPThreads: could not read or inflate blob at offset " << info.offset << " in " << inFile.fileName() << std::endl;
+				inFile.failScan();
+				return false;
+			}
+			pbi.parseData(data.data(), data.size());
+			if (!indexed) {
+				PbfBlobIndex::fill(info, pbi);
+				inFile.updateBlob(blobId, info);
+				if (!blobFilter(info)) {
+					return false;
+				}
+			}
+			if (sequencer) {
+				sequencer->begin(blobId);
+			}
+			myProcessor(pbi);
+			return true;
+		};
+		while (!inFile.scanFailed()) {
+			if (indexed) {
+				blobId = nextIndexedBlob.fetch_add(1, std::memory_order_relaxed);
+				if (blobId >= inFile.index().size()) {
+					break;
+				}
+				info = inFile.index().at(blobId);
+				inFile.advance(info);
+			}
+			else if (!inFile.nextBlob(info, blobId)) {
+				break;
+			}
+			processBlob();
+			if (sequencer) {
+				sequencer->finish(blobId);
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for(uint32_t i(0); i < threadCount; ++i) {
+		threads.emplace_back([&workFunc, &processor, threadPrivateProcessor]() {
+			if (threadPrivateProcessor) {
+				TPBI_Processor myProcessor(processor);
+				workFunc(myProcessor);
+			}
+			else {
+				workFunc(processor);
+			}
+		});
+	}
+	for(std::thread & t : threads) {
+		t.join();
+	}
+	if (!indexed) {
+		inFile.finishScan();
+	}
+	return !inFile.scanFailed();
+}
+
+}//end namespace osmtools
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef OSM_TOOLS_TAG_STORE_H
+#define OSM_TOOLS_TAG_STORE_H
+#include <vector>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <limits>
+#include <cstdint>
+#include <osmpbf/primitiveblockinputadaptor.h>
+#include <osmpbf/iprimitive.h>
+
+namespace osmtools {
+
+///Columnar store of the values of a fixed list of tag keys (the projection).
+///Every row holds the values of one primitive, every key has its own column of value ids.
+///Values are dictionary-encoded, all keys share a single dictionary, hence a row needs 4 Bytes per key.
+///Rows are reserved with an atomic counter and stored in chunks of ChunkRows rows which never move,
+///hence projectors of different threads add rows without locking and a row can be read as soon as push_back() returned it.
+///Values are interned under a lock once per block and string table entry.
+///value() and find() are only valid after the extraction, i.e. if no values are inserted concurrently.
+class TagStore {
+public:
+	typedef uint32_t RowId;
+	typedef uint32_t ValueId;
+	static constexpr RowId NoRow = std::numeric_limits<RowId>::max();
+	///value id of primitives without the key, maps to the empty string
+	static constexpr ValueId NoValue = 0;
+	static constexpr uint32_t NoKey = std::numeric_limits<uint32_t>::max();
+	///number of rows per storage chunk
+	static constexpr RowId ChunkRows = RowId(1) << 16;
+	///Projects the primitives of a block, every thread uses its own projector.
+	///Keys and values are resolved once per block by their string table ids.
+	class BlockProjector {
+	public:
+		BlockProjector(TagStore * store);
+		~BlockProjector();
+		///call this for every new block before push_back()
+		void reset(osmpbf::PrimitiveBlockInputAdaptor & pbi);
+		///add the projection of primitive of the current block to the store
+		RowId push_back(const osmpbf::IPrimitive & primitive);
+	private:
+		static constexpr uint32_t Unresolved = std::numeric_limits<uint32_t>::max()-1;
+	private:
+		TagStore * m_store;
+		osmpbf::PrimitiveBlockInputAdaptor * m_pbi;
+		//key index of the string table entries of the current block
+		std::vector<uint32_t> m_keyIndex;
+		//value id of the string table entries of the current block
+		std::vector<ValueId> m_valueIds;
+		std::vector<ValueId> m_row;
+	};
+public:
+	TagStore(const std::vector<std::string> & keys);
+	~TagStore();
+	const std::vector<std::string> & keys() const;
+	///@return index of key in keys() or NoKey
+	uint32_t keyIndex(const std::string & key) const;
+	///number of rows
+	std::size_t size() const;
+	///number of distinct values
+	std::size_t valuesSize() const;
+	///storage size in Bytes
+	std::size_t storageSize() const;
+	inline ValueId valueId(RowId row, uint32_t keyIndex) const {
+		return m_chunks[row/ChunkRows].load(std::memory_order_acquire)[keyIndex*ChunkRows + row%ChunkRows];
+	}
+	inline const std::string & value(ValueId id) const { return m_values[id]; }
+	inline const std::string & value(RowId row, uint32_t keyIndex) const { return value(valueId(row, keyIndex)); }
+	///@return id of value or NoValue if value is not part of the dictionary
+	ValueId find(const std::string & value) const;
+private:
+	///@thread-safety yes
+	ValueId insert(const std::string & value);
+	///@param values one value id per key
+	///@thread-safety yes
+	RowId push_back(const ValueId * values);
+	///@return the chunk chunkId, allocates it on first use
+	///@thread-safety yes
+	ValueId * chunk(std::size_t chunkId);
+private:
+	static constexpr std::size_t MaxChunks = (std::size_t(NoRow)+1)/ChunkRows;
+private:
+	std::vector<std::string> m_keys;
+	std::unordered_map<std::string, uint32_t> m_keyIndex;
+	//chunk i holds the value ids of the rows [i*ChunkRows, (i+1)*ChunkRows), one column after the other
+	std::unique_ptr< std::atomic<ValueId*>[] > m_chunks;
+	std::atomic<RowId> m_rows;
+	std::unordered_map<std::string, ValueId> m_valueIds;
+	//references to values stay valid on insertion
+	std::deque<std::string> m_values;
+	//guards the dictionary
+	std::mutex m_lock;
+};
+
+}//end namespace osmtools
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef OSM_TOOLS_WAY_STORE_H
+#define OSM_TOOLS_WAY_STORE_H
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <limits>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <sserialize/containers/MMVector.h>
+
+namespace osmtools {
+
+///Stores the node-refs of a set of ways: a sorted way id array with the offset and size of every way in one ref array.
+///Refs are collected in per-thread buffers which append them to the ref array in chunks of FlushRefs refs,
+///hence only the ids, offsets and sizes of the ways stay in memory until finalize() indexes them by way id.
+class RawWayStore {
+public:
+	static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+	///number of refs a buffer collects before they are appended to the ref array
+	static constexpr std::size_t FlushRefs = 64*1024;
+	///number of refs a thread of mapLocations() processes at once
+	static constexpr std::size_t MapChunkRefs = 64*1024;
+	///memory of the index of a way in Bytes, its refs and their values are not included
+	static constexpr std::size_t WayIndexBytes = sizeof(int64_t) + sizeof(uint64_t) + sizeof(uint32_t);
+	///refs of the ways of a single thread in input order
+	class Buffer {
+	public:
+		Buffer(RawWayStore * store) : m_store(store) {}
+		template<typename TRefIterator>
+		void push_back(int64_t id, TRefIterator refBegin, TRefIterator refEnd) {
+			std::size_t pendingSize = m_pending.size();
+			m_pending.insert(m_pending.end(), refBegin, refEnd);
+			m_ids.push_back(id);
+			m_sizes.push_back((uint32_t) (m_pending.size()-pendingSize));
+			if (m_pending.size() >= FlushRefs) {
+				m_store->flush(*this);
+			}
+		}
+	private:
+		friend class RawWayStore;
+		RawWayStore * m_store;
+		std::vector<int64_t> m_ids;
+		std::vector<uint32_t> m_sizes;
+		//offsets of the ways whose refs are in the ref array, the refs of the remaining ways are pending
+		std::vector<uint64_t> m_offsets;
+		std::vector<int64_t> m_pending;
+	};
+	typedef std::pair<const int64_t*, const int64_t*> Refs;
+	///receives the refs appended to the ref array by a flush and the offset of the first one
+	typedef std::function<void(const int64_t * refs, std::size_t size, uint64_t offset)> FlushCallback;
+public:
+	RawWayStore();
+	~RawWayStore();
+	///@param mmt storage of the ref array, use sserialize::MM_FILEBASED to spill refs to a temporary file
+	///call this before any refs are stored
+	void setRefsStorage(sserialize::MmappedMemoryType mmt);
+	///cb is called after every flush of a buffer, e.g. to write the refs to a join as they are produced
+	///@param cb MUST be thread-safe
+	void setFlushCallback(const FlushCallback & cb);
+	///set the way ids, this keeps refs and buffers
+	///@param ids sorted and free of duplicates
+	void assign(std::vector<int64_t> && ids);
+	///clear ids, refs, buffers and the flush callback
+	void clear();
+	std::size_t size() const;
+	bool empty() const;
+	int64_t minId() const;
+	int64_t maxId() const;
+	///@return position of id or npos
+	inline std::size_t find(int64_t id) const {
+		std::size_t n = m_ids.size();
+		if (!n) {
+			return npos;
+		}
+		const int64_t * base = m_ids.data();
+		while (n > 1) {
+			std::size_t half = n/2;
+			base = (base[half] <= id) ? base+half : base;
+			n -= half;
+		}
+		return (*base == id ? (std::size_t)(base-m_ids.data()) : npos);
+	}
+	///create a new buffer, call this once per thread
+	///@thread-safety yes
+	Buffer * buffer();
+	///append the pending refs of all buffers and index the ways of the buffers by their id, this clears all buffers
+	///ways without refs in any buffer stay empty
+	void finalize(uint32_t threadCount);
+	///@return the refs of the way at position pos, only valid after finalize()
+	inline Refs refs(std::size_t pos) const {
+		const int64_t * begin = m_refs.data()+m_offsets[pos];
+		return Refs(begin, begin+m_sizes[pos]);
+	}
+	///total number of refs in the ref array, refs of different ways are in the order in which they were flushed
+	uint64_t refsSize() const;
+	///all refs, only valid after finalize()
+	inline const int64_t * refsData() const { return m_refs.data(); }
+	///sorted ids of the ways in all buffers, e.g. to assign() them if the ways are not known in advance
+	std::vector<int64_t> bufferedIds() const;
+	///Set up a value for every ref, e.g. node locations fetched in partitions, the refs themselves are kept.
+	///@param mmt storage of the values
+	///@param init initial value of every ref
+	void beginLocations(sserialize::MmappedMemoryType mmt, int64_t init);
+	///set the value of every ref r in [first, last] to mapper(r)
+	///@param mapper int64_t mapper(int64_t ref), MUST be thread-safe
+	template<typename TMapper>
+	void mapLocations(int64_t first, int64_t last, TMapper mapper, uint32_t threadCount);
+	///values of all refs in the order of refs(), to set them directly
+	inline int64_t * locationsData() { return m_locations.data(); }
+	///@return the values of the refs of the way at position pos, only valid after beginLocations()
+	inline const int64_t * locations(std::size_t pos) const { return m_locations.data()+m_offsets[pos]; }
+private:
+	///append the pending refs of buffer to the ref array
+	///@thread-safety yes
+	void flush(Buffer & buffer);
+private:
+	std::vector<int64_t> m_ids;
+	std::vector<uint64_t> m_offsets;
+	std::vector<uint32_t> m_sizes;
+	sserialize::MMVector<int64_t> m_refs;
+	sserialize::MmappedMemoryType m_refsStorage;
+	//values of the refs set by beginLocations()
+	sserialize::MMVector<int64_t> m_locations;
+	std::deque<Buffer> m_buffers;
+	FlushCallback m_flushCallback;
+	std::mutex m_lock;
+};
+
+template<typename TMapper>
+void RawWayStore::mapLocations(int64_t first, int64_t last, TMapper mapper, uint32_t threadCount) {
+	if (!threadCount) {
+		threadCount = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	const uint64_t chunkSize = MapChunkRefs;
+	const uint64_t size = m_refs.size();
+	std::atomic<uint64_t> nextChunk(0);
+	std::vector<std::thread> threads;
+	for(uint32_t i(0); i < threadCount; ++i) {
+		threads.emplace_back([this, first, last, size, chunkSize, &nextChunk, &mapper]() {
+			const int64_t * refs = m_refs.data();
+			int64_t * values = m_locations.data();
+			while (true) {
+				uint64_t begin = nextChunk.fetch_add(chunkSize, std::memory_order_relaxed);
+				if (begin >= size) {
+					return;
+				}
+				for(uint64_t j(begin), end(std::min(begin+chunkSize, size)); j < end; ++j) {
+					if (refs[j] >= first && refs[j] <= last) {
+						values[j] = mapper(refs[j]);
+					}
+				}
+			}
+		});
+	}
+	for(std::thread & t : threads) {
+		t.join();
+	}
+}
+
+}//end namespace osmtools
+
+#endif
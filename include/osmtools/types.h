@@ -4,10 +4,46 @@
 #include <sserialize/spatial/GeoPolygon.h>
 #include <sserialize/spatial/GeoMultiPolygon.h>
 #include <sserialize/containers/MMVector.h>
+#include <sserialize/Static/GeoPoint.h>
+
+//Region points are stored as FixedGeoPoint if LIBOSMTOOLS_FIXED_POINT_STORAGE is defined, this halves the point storage
+//but every point is snapped to the accuracy of sserialize::Static::spatial::GeoPoint when it is stored.
+//The definition is set by the CMake option of the same name (default ON) and is exported to every consumer of the library,
+//since it changes the layout of OsmGeoPolygon and everything that stores one.
 
 namespace osmtools {
 
+///A GeoPoint stored with the fixed-point precision of sserialize::Static::spatial::GeoPoint (8 instead of 16 Bytes).
+///Points are snapped when they are stored, hence they are exactly the snapped sserialize::spatial::GeoPoint
+///This is the point type of GeoPointStorageBackend if LIBOSMTOOLS_FIXED_POINT_STORAGE is defined
+class FixedGeoPoint {
+public:
+	FixedGeoPoint() : m_lat(0), m_lon(0) {}
+	FixedGeoPoint(double lat, double lon) :
+	m_lat(sserialize::Static::spatial::GeoPoint::toIntLat(lat)),
+	m_lon(sserialize::Static::spatial::GeoPoint::toIntLon(lon))
+	{}
+	FixedGeoPoint(const sserialize::spatial::GeoPoint & p) : FixedGeoPoint(p.lat(), p.lon()) {}
+	inline double lat() const { return sserialize::Static::spatial::GeoPoint::toDoubleLat(m_lat); }
+	inline double lon() const { return sserialize::Static::spatial::GeoPoint::toDoubleLon(m_lon); }
+	inline uint32_t intLat() const { return m_lat; }
+	inline uint32_t intLon() const { return m_lon; }
+	///stored points are always snapped
+	inline void snap() {}
+	inline bool valid() const { return sserialize::spatial::GeoPoint(lat(), lon()).valid(); }
+	inline bool operator==(const FixedGeoPoint & other) const { return m_lat == other.m_lat && m_lon == other.m_lon; }
+	inline bool operator!=(const FixedGeoPoint & other) const { return !(*this == other); }
+	inline operator sserialize::spatial::GeoPoint() const { return sserialize::spatial::GeoPoint(lat(), lon()); }
+private:
+	uint32_t m_lat;
+	uint32_t m_lon;
+};
+
+#if defined(LIBOSMTOOLS_FIXED_POINT_STORAGE)
+typedef sserialize::MMVector<FixedGeoPoint> GeoPointStorageBackend;
+#else
 typedef sserialize::MMVector<sserialize::spatial::GeoPoint> GeoPointStorageBackend;
+#endif
 
 typedef sserialize::CFLArray<GeoPointStorageBackend> PolygonPointsContainer;
 
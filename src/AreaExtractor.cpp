@@ -1,69 +1,153 @@
 #include <osmtools/AreaExtractor.h>
+#include <osmtools/ExternalSort.h>
 #include <sserialize/utility/assert.h>
+#include <sserialize/mt/ThreadPool.h>
+#include <stdexcept>
+#include <algorithm>
 
 namespace osmtools {
 namespace detail {
 namespace AreaExtractor {
 
-bool MultiPolyResolver::closedPolysFromWays(const std::vector<RawWay> & ways, std::vector<RawWay> & closedWays) {
-	using std::swap;
-	typedef std::unordered_set<uint32_t> ActiveWaysContainer;
-	ActiveWaysContainer activeWays; //contains only ways with at least two nodes
-	bool allOk = true;
-	std::vector<RawWay> resultWays;
-	for(uint32_t i = 0, s = (uint32_t) ways.size(); i < s; ++i) {
-		if (ways[i].size() > 1)
-			activeWays.insert(i);
-	}
-		
-	while (activeWays.size()) {
-		RawWay activeWay = ways[*activeWays.begin()];
-		activeWays.erase(activeWays.begin());
-		for(ActiveWaysContainer::iterator it(activeWays.begin()), end(activeWays.end()); activeWay.front() != activeWay.back() && it != end;) {
-			bool matched = true;
-			const RawWay & otherWay = ways[*it];
-			//now check if we can append this way to our current active way
-			if (activeWay.back() == otherWay.front()) {
-				activeWay.insert(activeWay.end(), otherWay.begin()+1, otherWay.end());
-			}
-			else if (activeWay.back() == otherWay.back()) {
-				activeWay.insert(activeWay.end(), otherWay.rbegin()+1, otherWay.rend());
-			}
-			else if (activeWay.front() == otherWay.front()) {
-				RawWay tmp;
-				tmp.reserve(activeWay.size()+otherWay.size());
-				tmp.insert(tmp.end(), otherWay.rbegin(), otherWay.rend());
-				tmp.insert(tmp.end(), activeWay.begin()+1, activeWay.end());
-				swap(activeWay, tmp);
-			}
-			else if (activeWay.front() == otherWay.back()) {
-				RawWay tmp;
-				tmp.reserve(activeWay.size()+otherWay.size());
-				tmp.insert(tmp.end(), otherWay.begin(), otherWay.end());
-				tmp.insert(tmp.end(), activeWay.begin()+1, activeWay.end());
-				swap(activeWay, tmp);
+bool MultiPolyResolver::ringsFromWayEnds(const std::vector<WayEnds> & ways, std::vector<Ring> & rings) {
+	typedef std::unordered_map<int64_t, uint32_t> HeadsContainer;
+	const uint32_t npos = std::numeric_limits<uint32_t>::max();
+	//endpoint 2*i is the front of way i, endpoint 2*i+1 its back
+	//endpoints of unused ways sharing the same node form a doubly linked list
+	HeadsContainer heads;
+	std::vector<uint32_t> prev(2*ways.size(), npos);
+	std::vector<uint32_t> next(2*ways.size(), npos);
+	std::vector<bool> used(ways.size(), true); //ways with less than two nodes are never used
+	
+	auto nodeOf = [&ways](uint32_t ep) -> int64_t {
+		return ((ep & 0x1) ? ways[ep/2].back : ways[ep/2].front);
+	};
+	auto link = [&](uint32_t ep) {
+		std::pair<HeadsContainer::iterator, bool> r = heads.emplace(nodeOf(ep), ep);
+		if (!r.second) {
+			next[ep] = r.first->second;
+			prev[r.first->second] = ep;
+			r.first->second = ep;
+		}
+	};
+	auto unlink = [&](uint32_t ep) {
+		if (prev[ep] != npos) {
+			next[prev[ep]] = next[ep];
+		}
+		else {
+			HeadsContainer::iterator it = heads.find(nodeOf(ep));
+			if (next[ep] != npos) {
+				it->second = next[ep];
 			}
 			else {
-				matched = false;
+				heads.erase(it);
 			}
-			
-			if (matched) {
-				activeWays.erase(it);
-				it = activeWays.begin();
+		}
+		if (next[ep] != npos) {
+			prev[next[ep]] = prev[ep];
+		}
+	};
+	auto use = [&](uint32_t way) {
+		used[way] = true;
+		unlink(2*way);
+		unlink(2*way+1);
+	};
+	
+	heads.reserve(2*ways.size());
+	for(uint32_t i(0), s((uint32_t) ways.size()); i < s; ++i) {
+		if (ways[i].size > 1) {
+			used[i] = false;
+			link(2*i);
+			link(2*i+1);
+		}
+	}
+	
+	bool allOk = true;
+	std::deque<RingSegment> chain;
+	for(uint32_t start(0), s((uint32_t) ways.size()); start < s; ++start) {
+		if (used[start]) {
+			continue;
+		}
+		use(start);
+		chain.clear();
+		chain.emplace_back(start, false);
+		int64_t front = ways[start].front;
+		int64_t back = ways[start].back;
+		std::size_t nodeCount = ways[start].size;
+		//extend the chain at its back, then at its front until it is closed
+		while (front != back) {
+			HeadsContainer::const_iterator it = heads.find(back);
+			if (it == heads.cend()) {
+				break;
 			}
-			else {
-				++it;
+			uint32_t ep = it->second;
+			const WayEnds & w = ways[ep/2];
+			use(ep/2);
+			//joining at the front of the other way traverses it from front to back
+			chain.emplace_back(ep/2, ep & 0x1);
+			back = ((ep & 0x1) ? w.front : w.back);
+			nodeCount += w.size-1;
+		}
+		while (front != back) {
+			HeadsContainer::const_iterator it = heads.find(front);
+			if (it == heads.cend()) {
+				break;
 			}
+			uint32_t ep = it->second;
+			const WayEnds & w = ways[ep/2];
+			use(ep/2);
+			//joining at the back of the other way traverses it from front to back
+			chain.emplace_front(ep/2, !(ep & 0x1));
+			front = ((ep & 0x1) ? w.front : w.back);
+			nodeCount += w.size-1;
 		}
 		//check if way is an area and closed
-		if (activeWay.size() >= 4 && activeWay.front() == activeWay.back()) {
-			resultWays.push_back(activeWay);
+		if (nodeCount >= 4 && front == back) {
+			rings.emplace_back(chain.begin(), chain.end());
 		}
 		else {
-// 			std::cout << "Unclosed way detected, discarding\n";
 			allOk = false;
 		}
 	}
+	return allOk;
+}
+
+bool MultiPolyResolver::closedPolysFromWays(const std::vector<RawWay> & ways, std::vector<RawWay> & closedWays) {
+	std::vector<WayEnds> wayEnds;
+	wayEnds.reserve(ways.size());
+	for(const RawWay & w : ways) {
+		if (w.size()) {
+			wayEnds.emplace_back(w.front(), w.back(), (uint32_t) w.size());
+		}
+		else {
+			wayEnds.emplace_back(0, 0, 0);
+		}
+	}
+	
+	std::vector<Ring> rings;
+	bool allOk = ringsFromWayEnds(wayEnds, rings);
+	
+	std::vector<RawWay> resultWays(rings.size());
+	for(std::size_t i(0), s(rings.size()); i < s; ++i) {
+		const Ring & ring = rings[i];
+		RawWay & rw = resultWays[i];
+		std::size_t ringSize = 1;
+		for(const RingSegment & seg : ring) {
+			ringSize += ways[seg.way].size()-1;
+		}
+		rw.reserve(ringSize);
+		for(const RingSegment & seg : ring) {
+			const RawWay & w = ways[seg.way];
+			//the first node of a segment is the last node of the previous one
+			std::size_t skip = (rw.size() ? 1 : 0);
+			if (seg.reversed) {
+				rw.insert(rw.end(), w.rbegin()+skip, w.rend());
+			}
+			else {
+				rw.insert(rw.end(), w.begin()+skip, w.end());
+			}
+		}
+	}
 	
 	closedWays.swap(resultWays);
 	
@@ -89,224 +173,981 @@ bool MultiPolyResolver::multiPolyFromWays(const std::vector<RawWay> & innerIn, c
 	return ok;
 }
 
+IdCollector::IdCollector() :
+m_flushIds(0),
+m_spilled(sserialize::MM_FILEBASED)
+{}
+
+IdCollector::~IdCollector() {}
+
+void IdCollector::setSpill(std::size_t flushIds) {
+	m_flushIds = flushIds;
+}
+
+IdCollector::Buffer * IdCollector::buffer() {
+	std::lock_guard<std::mutex> lck(m_lock);
+	m_buffers.emplace_back();
+	return &m_buffers.back();
+}
+
+void IdCollector::flushIfFull(Buffer & buffer) {
+	if (!m_flushIds || buffer.size() < m_flushIds) {
+		return;
+	}
+	std::sort(buffer.begin(), buffer.end());
+	buffer.resize(std::unique(buffer.begin(), buffer.end()) - buffer.begin());
+	{
+		std::lock_guard<std::mutex> lck(m_lock);
+		m_spilled.push_back(buffer.begin(), buffer.end());
+	}
+	buffer.clear();
+}
+
+uint64_t IdCollector::sizeBound() const {
+	uint64_t result = m_spilled.size();
+	for(const Buffer & b : m_buffers) {
+		result += b.size();
+	}
+	return result;
+}
+
+void IdCollector::merge(sserialize::MMVector<int64_t> & dest, uint64_t sortMemory, uint32_t threadCount) {
+	if (!threadCount) {
+		threadCount = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	for(Buffer & b : m_buffers) {
+		m_spilled.push_back(b.begin(), b.end());
+		b = Buffer();
+	}
+	m_buffers.clear();
+	externalSort(m_spilled, std::less<int64_t>(), sortMemory/(threadCount*sizeof(int64_t)), threadCount);
+	dest = sserialize::MMVector<int64_t>(sserialize::MM_FILEBASED);
+	for(const int64_t * it(m_spilled.data()), * end(it+m_spilled.size()); it != end; ++it) {
+		if (it == m_spilled.data() || *(it-1) != *it) {
+			dest.push_back(*it);
+		}
+	}
+	m_spilled = sserialize::MMVector<int64_t>(sserialize::MM_FILEBASED);
+}
+
+std::vector<int64_t> IdCollector::merge(uint32_t threadCount) {
+	if (!threadCount) {
+		threadCount = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	//spilled ids are merged like another buffer
+	if (m_spilled.size()) {
+		m_buffers.emplace_back(m_spilled.data(), m_spilled.data()+m_spilled.size());
+		m_spilled = sserialize::MMVector<int64_t>(sserialize::MM_FILEBASED);
+	}
+	
+	struct WorkContext {
+		std::atomic<std::size_t> nextTask{0};
+		std::vector< std::pair<std::size_t, std::size_t> > tasks;
+		std::deque<Buffer> * buffers;
+		std::vector<int64_t> * dest;
+		std::vector<std::size_t> * bounds;
+	};
+	
+	//sort and deduplicate every buffer (phase 0) or merge two adjacent sorted ranges of dest (phase 1)
+	struct Worker {
+		WorkContext * ctx;
+		int phase;
+		Worker(WorkContext * ctx, int phase) : ctx(ctx), phase(phase) {}
+		Worker(const Worker & other) : ctx(other.ctx), phase(other.phase) {}
+		void operator()() {
+			while (true) {
+				std::size_t task = ctx->nextTask.fetch_add(1, std::memory_order_relaxed);
+				if (task >= ctx->tasks.size()) {
+					return;
+				}
+				if (phase == 0) {
+					Buffer & b = (*ctx->buffers)[task];
+					std::sort(b.begin(), b.end());
+					b.resize(std::unique(b.begin(), b.end()) - b.begin());
+				}
+				else {
+					const std::pair<std::size_t, std::size_t> & t = ctx->tasks[task];
+					std::vector<std::size_t> & bounds = *(ctx->bounds);
+					auto begin = ctx->dest->begin();
+					std::inplace_merge(begin+bounds[t.first], begin+bounds[t.first+1], begin+bounds[t.second]);
+				}
+			}
+		}
+	};
+	
+	WorkContext wctx;
+	wctx.buffers = &m_buffers;
+	wctx.tasks.resize(m_buffers.size());
+	sserialize::ThreadPool::execute(Worker(&wctx, 0), threadCount, sserialize::ThreadPool::CopyTaskTag());
+	
+	std::vector<int64_t> result;
+	std::vector<std::size_t> bounds(1, 0);
+	{
+		std::size_t resultSize = 0;
+		for(const Buffer & b : m_buffers) {
+			resultSize += b.size();
+		}
+		result.reserve(resultSize);
+		for(Buffer & b : m_buffers) {
+			if (b.size()) {
+				result.insert(result.end(), b.begin(), b.end());
+				bounds.push_back(result.size());
+			}
+			b = Buffer();
+		}
+		m_buffers.clear();
+	}
+	wctx.dest = &result;
+	wctx.bounds = &bounds;
+	
+	//merge adjacent runs pairwise in parallel until only one run is left
+	while (bounds.size() > 2) {
+		wctx.tasks.clear();
+		wctx.nextTask = 0;
+		for(std::size_t i(0); i+2 < bounds.size(); i += 2) {
+			wctx.tasks.emplace_back(i, i+2);
+		}
+		sserialize::ThreadPool::execute(Worker(&wctx, 1), std::min<uint32_t>(threadCount, wctx.tasks.size()), sserialize::ThreadPool::CopyTaskTag());
+		std::vector<std::size_t> newBounds;
+		for(std::size_t i(0); i < bounds.size(); i += 2) {
+			newBounds.push_back(bounds[i]);
+		}
+		if (newBounds.back() != bounds.back()) {
+			newBounds.push_back(bounds.back());
+		}
+		bounds.swap(newBounds);
+	}
+	result.resize(std::unique(result.begin(), result.end()) - result.begin());
+	return result;
+}
+
 }}//end namespace detail::AreaExtractor
 
 
 AreaExtractor::ExtractionFunctorBase::ExtractionFunctorBase(AreaExtractor::Context* ctx) :
 ctx(ctx),
-pbi(0)
+pbi(0),
+externalFilters(ctx->filters.size()),
+activeConfigurations(0),
+tagProjector(ctx->tagStore ? new TagStore::BlockProjector(ctx->tagStore) : 0)
 {
-	generics::RCPtr<osmpbf::AbstractTagFilter> tmp( detail::AreaExtractor::Base::createExtractionFilter(ctx->extractionTypes) );
-	if (ctx->externalFilter.get()) {
-		mainFilter.reset( osmpbf::newAnd(ctx->externalFilter->copy(), tmp.get()) );
+	for(std::size_t i(0), s(ctx->filters.size()); i < s; ++i) {
+		if (ctx->filters[i].external.get()) {
+			externalFilters[i].reset(ctx->filters[i].external->copy());
+		}
+	}
+}
+
+AreaExtractor::ExtractionFunctorBase::ExtractionFunctorBase(const AreaExtractor::ExtractionFunctorBase & other) :
+ExtractionFunctorBase(other.ctx)
+{}
+
+void AreaExtractor::ExtractionFunctorBase::assignInputAdaptor(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
+	if (this->pbi != &pbi) {
+		for(generics::RCPtr<osmpbf::AbstractTagFilter> & filter : externalFilters) {
+			if (filter.get()) {
+				filter->assignInputAdaptor(&pbi);
+			}
+		}
+		this->pbi = &pbi;
+	}
+	if (tagProjector) {
+		tagProjector->reset(pbi);
+	}
+}
+
+bool AreaExtractor::ExtractionFunctorBase::rebuildFilter() {
+	activeConfigurations = filterState.reset(ctx->compiledFilters, *pbi);
+	for(uint32_t i(0), s((uint32_t) externalFilters.size()); i < s; ++i) {
+		if (((activeConfigurations >> i) & 0x1) && externalFilters[i].get() && !externalFilters[i]->rebuildCache()) {
+			activeConfigurations &= ~(uint32_t(1) << i);
+		}
+	}
+	return activeConfigurations;
+}
+
+void AreaExtractor::EmittingFunctorBase::emit(const std::shared_ptr<sserialize::spatial::GeoRegion> & region, osmpbf::IPrimitive & primitive, uint32_t position, uint32_t configurations) {
+	if (ctx->sequencer) {
+		pendingRegions.push_back(PendingRegion{position, configurations, region});
+	}
+	else if (hasSink()) {
+		sink()->push_back(*region, primitive);
 	}
 	else {
-		mainFilter = tmp;
+		cb->operator()(region, primitive, tagRow(primitive), configurations);
 	}
 }
 
-AreaExtractor::ExtractionFunctorBase::ExtractionFunctorBase(const AreaExtractor::ExtractionFunctorBase & other) :
-ctx(other.ctx),
-pbi(0)
-{
-	generics::RCPtr<osmpbf::AbstractTagFilter> tmp( detail::AreaExtractor::Base::createExtractionFilter(ctx->extractionTypes) );
-	if (ctx->externalFilter.get()) {
-		mainFilter.reset( osmpbf::newAnd(ctx->externalFilter->copy(), tmp.get()) );
+template<typename TStream>
+void AreaExtractor::EmittingFunctorBase::emitPending(TStream stream) {
+	if (pendingRegions.empty()) {
+		return;
+	}
+	ctx->sequencer->wait();
+	//regions were deferred in stream order
+	uint32_t position = 0;
+	for(const PendingRegion & pr : pendingRegions) {
+		for(; position < pr.position; ++position) {
+			stream.next();
+		}
+		if (hasSink()) {
+			sink()->push_back(*pr.region, stream);
+		}
+		else {
+			cb->operator()(pr.region, stream, tagRow(stream), pr.configurations);
+		}
+	}
+	pendingRegions.clear();
+}
+
+constexpr uint64_t AreaExtractor::DenseNodeStoreMinFileSize;
+constexpr uint64_t AreaExtractor::ExternalSortMemory;
+constexpr uint64_t AreaExtractor::Context::AreaRefFlag;
+constexpr uint32_t AreaExtractor::MaxConfigurations;
+constexpr uint64_t AreaExtractor::LargeRelationMinRefs;
+
+bool AreaExtractor::extract(const std::string & inputFileName, const RegionSinkFactory & sinkFactory, ExtractionTypes extractionTypes, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter, uint32_t numThreads, const std::string & msg) {
+	return extractFromFile(inputFileName, [&](Context & ctx) -> bool {
+		ctx.sinkFactory = sinkFactory;
+		return extractAreas(ctx, NoOpProcessor(), extractionTypes, filter, numThreads, msg);
+	});
+}
+
+bool AreaExtractor::extract(const std::string & inputFileName, const std::vector<Configuration> & configurations, uint32_t numThreads, const std::string & msg) {
+	if (configurations.empty() || configurations.size() > MaxConfigurations) {
+		std::cout << msg << ": Need between 1 and " << MaxConfigurations << " configurations" << std::endl;
+		return false;
+	}
+	return extractFromFile(inputFileName, [&](Context & ctx) -> bool {
+		//the passes are selected by the union of the extraction types, the filters decide about every single area
+		int extractionTypes = ET_NONE;
+		ctx.filters.resize(configurations.size());
+		for(std::size_t i(0), s(configurations.size()); i < s; ++i) {
+			extractionTypes |= configurations[i].extractionTypes;
+			ctx.filters[i].compiled.reset(new detail::AreaExtractor::CompiledFilter(configurations[i].extractionTypes));
+			ctx.filters[i].external = configurations[i].filter;
+		}
+		return extractAreas(ctx, MultiProcessor(&configurations), (ExtractionTypes) extractionTypes, generics::RCPtr<osmpbf::AbstractTagFilter>(), numThreads, msg);
+	});
+}
+
+bool AreaExtractor::extract(osmpbf::PbiStream & inData, const RegionSinkFactory & sinkFactory, ExtractionTypes extractionTypes, const generics::RCPtr<osmpbf::AbstractTagFilter> & filter, uint32_t numThreads, const std::string & msg) {
+	Context ctx(inData);
+	ctx.sinkFactory = sinkFactory;
+	return extractAreas(ctx, NoOpProcessor(), extractionTypes, filter, numThreads, msg);
+}
+
+bool AreaExtractor::initDenseNodeStore(Context & ctx, uint32_t numThreads, const std::string & msg) {
+	ctx.useDenseNodes = false;
+	if (!ctx.blobFile || m_nodeStoreMode == NSM_SPARSE || m_nodeStoreMode == NSM_EXTERNAL) {
+		return false;
+	}
+	if (m_nodeStoreMode == NSM_AUTO) {
+		bool wayHeavy = (ctx.extractionTypes & ET_PRIMITIVE_WAYS) && (ctx.extractionTypes & ET_BUILDING) == ET_BUILDING;
+		if (!wayHeavy || !ctx.blobFile->index().complete() || ctx.blobFile->dataSize() < DenseNodeStoreMinFileSize) {
+			return false;
+		}
+	}
+	if (!ctx.blobFile->index().complete()) {
+		struct NoOp {
+			void operator()(osmpbf::PrimitiveBlockInputAdaptor &) {}
+		} noop;
+		ctx.pinfo.begin(ctx.dataSize(), msg + ": Indexing");
+		parse(ctx, noop, [](const PbfBlobInfo &) -> bool { return false; }, numThreads, true);
+		ctx.pinfo.end();
+		if (!ctx.blobFile->index().complete()) {
+			return false;
+		}
+	}
+	int64_t maxNodeId = -1;
+	for(const PbfBlobInfo & bi : ctx.blobFile->index().blobs()) {
+		if (bi.kinds & PbfBlobInfo::BK_NODES) {
+			maxNodeId = std::max(maxNodeId, bi.maxNodeId);
+		}
+	}
+	if (!ctx.denseNodes.init(maxNodeId, m_denseStoreDirectory)) {
+		std::cout << msg << ": Could not allocate the dense node store, falling back to the sparse node store" << std::endl;
+		return false;
+	}
+	std::cout << msg << ": Using dense node store for node ids up to " << maxNodeId << std::endl;
+	ctx.useDenseNodes = true;
+	return true;
+}
+
+uint64_t AreaExtractor::nodeFetchFixedMemory(const Context & ctx, uint32_t numThreads) const {
+	if (!numThreads) {
+		numThreads = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	//the ways are indexed in memory, their refs and locations are in temporary files
+	uint64_t result = uint64_t(ctx.rawWays.size())*RawWayStore::WayIndexBytes;
+	if (ctx.extractionTypes & ET_PRIMITIVE_WAYS) {
+		result += uint64_t(ctx.relevantWaysSize)*RawWayStore::WayIndexBytes;
+	}
+	//pending refs of the buffers of the ref pass and the refs and locations mapped at once
+	result += uint64_t(numThreads)*(RawWayStore::FlushRefs + 2*RawWayStore::MapChunkRefs)*sizeof(int64_t);
+	return result;
+}
+
+uint64_t AreaExtractor::nodeFetchMemory(const int64_t * begin, const int64_t * end) {
+	if (begin == end) {
+		return 0;
+	}
+	uint64_t usedPages = 1;
+	for(const int64_t * it(begin+1); it != end; ++it) {
+		if (NodeIdBitmap::page(*begin, *it) != NodeIdBitmap::page(*begin, *(it-1))) {
+			++usedPages;
+		}
+	}
+	return uint64_t(end-begin)*SparseNodeStore::NodeBytes + NodeIdBitmap::storageSize(NodeIdBitmap::page(*begin, *(end-1))+1, usedPages);
+}
+
+std::vector<std::size_t> AreaExtractor::nodePartitions(const int64_t * ids, std::size_t idsSize, uint64_t fixedMemory, const std::string & msg) const {
+	uint64_t available = m_nodeMemoryBudget/2;
+	if (fixedMemory < available) {
+		available = m_nodeMemoryBudget - fixedMemory;
 	}
 	else {
-		mainFilter = tmp;
+		std::cout << msg << ": The ways need about " << fixedMemory << " Bytes of the node memory budget of " << m_nodeMemoryBudget << " Bytes" << std::endl;
+	}
+	//partitions are cut greedily, the memory of a partition only grows with its ids
+	std::vector<std::size_t> result;
+	std::size_t begin = 0;
+	uint64_t usedPages = 0;
+	for(std::size_t i(0); i < idsSize; ++i) {
+		uint64_t page = NodeIdBitmap::page(ids[begin], ids[i]);
+		if (i == begin || page != NodeIdBitmap::page(ids[begin], ids[i-1])) {
+			++usedPages;
+		}
+		uint64_t memory = uint64_t(i+1-begin)*SparseNodeStore::NodeBytes + NodeIdBitmap::storageSize(page+1, usedPages);
+		if (memory > available && i > begin) {
+			result.push_back(i);
+			begin = i;
+			usedPages = 1;
+		}
 	}
+	if (idsSize) {
+		result.push_back(idsSize);
+	}
+	return result;
 }
 
-void AreaExtractor::ExtractionFunctorBase::assignInputAdaptor(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
-	if (this->pbi != &pbi) {
-		mainFilter->assignInputAdaptor(&pbi);
-		this->pbi = &pbi;
+bool AreaExtractor::fetchNodesPartitioned(Context & ctx, sserialize::MMVector<int64_t> & ids, const std::vector<std::size_t> & partitionEnds, uint32_t numThreads, const std::string & msg) {
+	const uint32_t partitions = (uint32_t) partitionEnds.size();
+	std::cout << msg << ": Need to fetch " << ids.size() << " nodes in " << partitions << " partitions" << std::endl;
+	
+	//the refs of relevant ways are needed to write the locations of every partition next to them
+	if (ctx.extractionTypes & ET_PRIMITIVE_WAYS) {
+		AreaWaysExtractor awe(&ctx);
+		ctx.areaWays.setRefsStorage(sserialize::MM_FILEBASED);
+		ctx.pinfo.begin(ctx.dataSize(), msg + ": Ways' refs");
+		parse(ctx, awe, [](const PbfBlobInfo & bi) -> bool {
+			return bi.kinds & PbfBlobInfo::BK_WAYS;
+		}, numThreads, true);
+		ctx.pinfo.end();
+		if (ctx.parseFailed) {
+			return false;
+		}
+		ctx.areaWays.assign(ctx.areaWays.bufferedIds());
+		ctx.areaWays.finalize(numThreads);
 	}
+	
+	//the refs stay node ids, hence rings are joined by id even if nodes share a location
+	ctx.rawWays.beginLocations(sserialize::MM_FILEBASED, FixedPointCoord::missing());
+	ctx.areaWays.beginLocations(sserialize::MM_FILEBASED, FixedPointCoord::missing());
+	
+	NodeGatherer ng(&ctx);
+	const Context & cctx = ctx;
+	auto locationOf = [&cctx](int64_t nodeId) -> int64_t {
+		std::size_t pos = cctx.nodes.find(nodeId);
+		if (pos == SparseNodeStore::npos || !cctx.nodes.has(pos)) {
+			return FixedPointCoord::missing();
+		}
+		return cctx.nodes.packed(pos);
+	};
+	for(uint32_t i(0); i < partitions; ++i) {
+		std::size_t begin = (i ? partitionEnds[i-1] : 0);
+		std::size_t end = partitionEnds[i];
+		int64_t firstId = ids.at(begin);
+		int64_t lastId = ids.at(end-1);
+		ctx.nodes.assign(std::vector<int64_t>(ids.begin()+begin, ids.begin()+end));
+		ctx.neededNodes.assign(ctx.nodes.ids());
+		
+		ctx.pinfo.begin(ctx.dataSize(), msg + ": Nodes " + std::to_string(i+1) + "/" + std::to_string(partitions));
+		parse(ctx, ng, [&ctx, firstId, lastId](const PbfBlobInfo & bi) -> bool {
+			return (bi.kinds & PbfBlobInfo::BK_NODES) && bi.maxNodeId >= firstId && bi.minNodeId <= lastId && ctx.neededNodes.any(bi.minNodeId, bi.maxNodeId);
+		}, numThreads, false);
+		ctx.pinfo.end();
+		ctx.neededNodes.clear();
+		if (ctx.parseFailed) {
+			return false;
+		}
+		
+		ctx.rawWays.mapLocations(firstId, lastId, locationOf, numThreads);
+		ctx.areaWays.mapLocations(firstId, lastId, locationOf, numThreads);
+		ctx.nodes.clear();
+	}
+	ids = sserialize::MMVector<int64_t>(sserialize::MM_FILEBASED);
+	
+	ctx.packedRefs = true;
+	return true;
+}
+
+void AreaExtractor::beginJoinRefs(Context & ctx) {
+	ctx.joinRefs = sserialize::MMVector<Context::JoinRef>(sserialize::MM_FILEBASED);
+	for(RawWayStore * store : {&ctx.rawWays, &ctx.areaWays}) {
+		uint64_t posFlag = (store == &ctx.areaWays ? uint64_t(Context::AreaRefFlag) : uint64_t(0));
+		store->setFlushCallback([&ctx, posFlag](const int64_t * refs, std::size_t size, uint64_t offset) {
+			std::vector<Context::JoinRef> joinRefs;
+			joinRefs.reserve(size);
+			for(std::size_t i(0); i < size; ++i) {
+				joinRefs.push_back(Context::JoinRef{refs[i], posFlag | (offset+i)});
+			}
+			std::lock_guard<std::mutex> lck(ctx.joinRefsLock);
+			ctx.joinRefs.push_back(joinRefs.begin(), joinRefs.end());
+		});
+	}
+}
+
+bool AreaExtractor::joinNodesExternal(Context & ctx, uint32_t numThreads, const std::string & msg) {
+	if (!numThreads) {
+		numThreads = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	uint64_t sortMemory = (m_nodeMemoryBudget ? m_nodeMemoryBudget : ExternalSortMemory);
+	
+	//this flushes the remaining refs of the buffers to joinRefs
+	ctx.areaWays.assign(ctx.areaWays.bufferedIds());
+	ctx.areaWays.finalize(numThreads);
+	
+	std::cout << msg << ": Sorting " << ctx.joinRefs.size() << " node-refs" << std::endl;
+	externalSort(ctx.joinRefs, std::less<Context::JoinRef>(), sortMemory/(numThreads*sizeof(Context::JoinRef)), numThreads);
+	
+	ctx.joinResults = sserialize::MMVector<Context::JoinResult>(sserialize::MM_FILEBASED);
+	const Context::JoinRef * refsBegin = ctx.joinRefs.data();
+	const Context::JoinRef * refsEnd = refsBegin + ctx.joinRefs.size();
+	NodeJoiner nj(&ctx);
+	ctx.pinfo.begin(ctx.dataSize(), msg + ": Joining nodes");
+	parse(ctx, nj, [refsBegin, refsEnd](const PbfBlobInfo & bi) -> bool {
+		if (!(bi.kinds & PbfBlobInfo::BK_NODES)) {
+			return false;
+		}
+		const Context::JoinRef * it = std::lower_bound(refsBegin, refsEnd, Context::JoinRef{bi.minNodeId, 0});
+		return it != refsEnd && it->nodeId <= bi.maxNodeId;
+	}, numThreads, true);
+	ctx.pinfo.end();
+	ctx.joinRefs = sserialize::MMVector<Context::JoinRef>();
+	if (ctx.parseFailed) {
+		ctx.joinResults = sserialize::MMVector<Context::JoinResult>();
+		return false;
+	}
+	
+	//write the locations in the order of the refs, refs without a result stay missing
+	//the refs stay node ids, hence rings are joined by id even if nodes share a location
+	externalSort(ctx.joinResults, std::less<Context::JoinResult>(), sortMemory/(numThreads*sizeof(Context::JoinResult)), numThreads);
+	ctx.rawWays.beginLocations(sserialize::MM_FILEBASED, FixedPointCoord::missing());
+	ctx.areaWays.beginLocations(sserialize::MM_FILEBASED, FixedPointCoord::missing());
+	int64_t * rawValues = ctx.rawWays.locationsData();
+	int64_t * areaValues = ctx.areaWays.locationsData();
+	for(const Context::JoinResult * it(ctx.joinResults.data()), * end(it+ctx.joinResults.size()); it != end; ++it) {
+		if (it->pos & Context::AreaRefFlag) {
+			areaValues[it->pos & ~Context::AreaRefFlag] = it->location;
+		}
+		else {
+			rawValues[it->pos] = it->location;
+		}
+	}
+	std::cout << msg << ": Found the locations of " << ctx.joinResults.size() << " node-refs" << std::endl;
+	ctx.joinResults = sserialize::MMVector<Context::JoinResult>();
+	
+	ctx.packedRefs = true;
+	return true;
+}
+
+bool AreaExtractor::abortExtraction(Context & ctx, const std::string & msg) {
+	//the pool still reads the node store
+	if (ctx.assemblyPool) {
+		ctx.assemblyPool->finish();
+		ctx.assemblyPool = 0;
+	}
+	ctx.denseNodes.clear();
+	ctx.nodes.clear();
+	ctx.neededNodes.clear();
+	ctx.clipNodes.clear();
+	ctx.pruneByClip = false;
+	ctx.rawWays.clear();
+	ctx.areaWays.clear();
+	ctx.packedRefs = false;
+	ctx.externalRefs = false;
+	ctx.joinRefs = sserialize::MMVector<Context::JoinRef>();
+	ctx.sequencer = 0;
+	std::cout << msg << ": Aborted since the input could not be read completely" << std::endl;
+	return false;
+}
+
+//BEGIN: RelationAssemblyPool
+
+AreaExtractor::RelationAssemblyPool::RelationAssemblyPool(const Context * ctx) :
+m_ctx(ctx),
+m_queueCount(0),
+m_nextQueue(0),
+m_pending(0),
+m_finishing(false),
+m_minRelationId(std::numeric_limits<int64_t>::max()),
+m_maxRelationId(std::numeric_limits<int64_t>::min())
+{}
+
+AreaExtractor::RelationAssemblyPool::~RelationAssemblyPool() {
+	finish();
+}
+
+void AreaExtractor::RelationAssemblyPool::start(uint32_t threadCount) {
+	if (!threadCount) {
+		threadCount = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	m_finishing = false;
+	m_queues.reset(new Queue[threadCount]);
+	m_queueCount = threadCount;
+	for(uint32_t i(0); i < threadCount; ++i) {
+		m_threads.emplace_back(&RelationAssemblyPool::run, this, i);
+	}
+}
+
+void AreaExtractor::RelationAssemblyPool::push(Job && job) {
+	Queue & q = m_queues[m_nextQueue.fetch_add(1, std::memory_order_relaxed) % m_queueCount];
+	{
+		std::lock_guard<std::mutex> lck(q.lock);
+		q.jobs.push_back(std::move(job));
+		std::push_heap(q.jobs.begin(), q.jobs.end());
+	}
+	{
+		std::lock_guard<std::mutex> lck(m_lock);
+		++m_pending;
+	}
+	m_cv.notify_one();
+}
+
+void AreaExtractor::RelationAssemblyPool::finish() {
+	{
+		std::lock_guard<std::mutex> lck(m_lock);
+		m_finishing = true;
+	}
+	m_cv.notify_all();
+	for(std::thread & t : m_threads) {
+		t.join();
+	}
+	m_threads.clear();
+}
+
+const AreaExtractor::RelationAssemblyPool::ResultsContainer & AreaExtractor::RelationAssemblyPool::results() const {
+	return m_results;
+}
+
+int64_t AreaExtractor::RelationAssemblyPool::minRelationId() const {
+	return m_minRelationId;
+}
+
+int64_t AreaExtractor::RelationAssemblyPool::maxRelationId() const {
+	return m_maxRelationId;
+}
+
+void AreaExtractor::RelationAssemblyPool::pop(uint32_t queueId, Job & job) {
+	//every reserved job is in some queue, but another thread may take the one seen here first
+	while (true) {
+		for(uint32_t i(0); i < m_queueCount; ++i) {
+			Queue & q = m_queues[(queueId+i) % m_queueCount];
+			std::lock_guard<std::mutex> lck(q.lock);
+			if (q.jobs.size()) {
+				std::pop_heap(q.jobs.begin(), q.jobs.end());
+				job = std::move(q.jobs.back());
+				q.jobs.pop_back();
+				return;
+			}
+		}
+	}
+}
+
+void AreaExtractor::RelationAssemblyPool::run(uint32_t queueId) {
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lck(m_lock);
+			m_cv.wait(lck, [this]() { return m_pending || m_finishing; });
+			if (!m_pending) {
+				return;
+			}
+			--m_pending;
+		}
+		Job job;
+		pop(queueId, job);
+		bool allOk = true;
+		std::shared_ptr<sserialize::spatial::GeoRegion> region( detail::AreaExtractor::MultiPolyResolver::multiPolyFromWaySpans(job.innerWays, job.outerWays, NodeMapper(m_ctx), allOk) );
+		if (!allOk && job.allWaysAvailable && m_ctx->verbose) {
+			std::cerr << "Failed to fully create MultiPolygon from multiple ways for relation " << job.relationId << '\n';
+		}
+		if (region) {
+			std::lock_guard<std::mutex> lck(m_lock);
+			m_results[job.relationId] = Result{region, job.configurations};
+			m_minRelationId = std::min(m_minRelationId, job.relationId);
+			m_maxRelationId = std::max(m_maxRelationId, job.relationId);
+		}
+	}
+}
+
+//END: RelationAssemblyPool
+
+bool AreaExtractor::Context::anyNodePoint(const std::vector<detail::AreaExtractor::MultiPolyResolver::RawWaySpan> & ways) const {
+	Point p;
+	for(const detail::AreaExtractor::MultiPolyResolver::RawWaySpan & w : ways) {
+		for(uint32_t i(0), s(w.size()); i < s; ++i) {
+			if (refPoint(w.value(i), p)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+sserialize::spatial::GeoPoint AreaExtractor::NodeMapper::at(int64_t nodeId) const {
+	Point p;
+	if (!ctx->refPoint(nodeId, p)) {
+		throw std::out_of_range("AreaExtractor: missing node");
+	}
+	return sserialize::spatial::GeoPoint(p.first, p.second);
 }
 
 void AreaExtractor::NodeGatherer::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
-	ctx->pinfo(ctx->inFile.dataPosition());
+	ctx->pinfo(ctx->dataPosition());
 	if (!pbi.nodesSize()) {
 		return;
 	}
 	
-	for(osmpbf::INodeStream node(pbi.getNodeStream()); !node.isNull(); node.next()) {
-		int64_t nid = node.id();
-		if (ctx->nodes.count( nid ) ) {
-			Point & gp = ctx->nodes.at(nid);
-			gp.first = node.latd();
-			gp.second = node.lond();
-			if (ctx->snapGeometry) {
-				gp.first = sserialize::spatial::GeoPoint::snapLat(gp.first);
-				gp.second = sserialize::spatial::GeoPoint::snapLon(gp.second);
+	//every node is part of exactly one block, hence threads write to different slots
+	//nodes outside of the clip region are treated as missing
+	const ClipRegion * clip = ctx->clip;
+	if (ctx->useDenseNodes) {
+		for(osmpbf::INodeStream node(pbi.getNodeStream()); !node.isNull(); node.next()) {
+			if (clip && !clip->contains(node.latd(), node.lond())) {
+				continue;
 			}
+			ctx->denseNodes.set(node.id(), node.latd(), node.lond());
+		}
+		return;
+	}
+	for(osmpbf::INodeStream node(pbi.getNodeStream()); !node.isNull(); node.next()) {
+		int64_t nodeId = node.id();
+		if (!ctx->neededNodes.test(nodeId) || (clip && !clip->contains(node.latd(), node.lond()))) {
+			continue;
 		}
+		std::size_t pos = ctx->nodes.find(nodeId);
+		SSERIALIZE_CHEAP_ASSERT(pos != SparseNodeStore::npos);
+		ctx->nodes.set(pos, node.latd(), node.lond());
 	}
 }
 
-void AreaExtractor::WayRefsExtractor::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
-	ctx->pinfo(ctx->inFile.dataPosition());
-	if (!pbi.waysSize())
+void AreaExtractor::ClipNodeCollector::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
+	ctx->pinfo(ctx->dataPosition());
+	if (!pbi.nodesSize()) {
+		return;
+	}
+	const ClipRegion & clip = *(ctx->clip);
+	for(osmpbf::INodeStream node(pbi.getNodeStream()); !node.isNull(); node.next()) {
+		if (clip.contains(node.latd(), node.lond())) {
+			myIds->push_back(node.id());
+		}
+	}
+}
+
+void AreaExtractor::NodeJoiner::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
+	ctx->pinfo(ctx->dataPosition());
+	if (!pbi.nodesSize()) {
 		return;
+	}
+	
+	const Context::JoinRef * refsBegin = ctx->joinRefs.data();
+	const Context::JoinRef * refsEnd = refsBegin + ctx->joinRefs.size();
+	const ClipRegion * clip = ctx->clip;
+	myResults.clear();
+	
+	//nodes of a block are usually sorted by id, hence the refs are walked along with them
+	const Context::JoinRef * it = refsEnd;
+	int64_t prevNodeId = std::numeric_limits<int64_t>::max();
+	for(osmpbf::INodeStream node(pbi.getNodeStream()); !node.isNull(); node.next()) {
+		int64_t nodeId = node.id();
+		if (nodeId < prevNodeId) {
+			it = std::lower_bound(refsBegin, refsEnd, Context::JoinRef{nodeId, 0});
+		}
+		else {
+			for(; it != refsEnd && it->nodeId < nodeId; ++it) {}
+		}
+		prevNodeId = nodeId;
+		if (it == refsEnd || it->nodeId != nodeId || (clip && !clip->contains(node.latd(), node.lond()))) {
+			continue;
+		}
+		int64_t location = FixedPointCoord::pack(FixedPointCoord::toFixedLat(node.latd()), FixedPointCoord::toFixedLon(node.lond()));
+		for(; it != refsEnd && it->nodeId == nodeId; ++it) {
+			myResults.push_back(Context::JoinResult{it->pos, location});
+		}
+	}
+	
+	if (myResults.size()) {
+		std::lock_guard<std::mutex> lck(ctx->joinResultsLock);
+		ctx->joinResults.push_back(myResults.begin(), myResults.end());
+	}
+}
+
+void AreaExtractor::AreaWaysExtractor::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
+	ctx->pinfo(ctx->dataPosition());
+	if (!pbi.waysSize()) {
+		return;
+	}
 	
 	assignInputAdaptor(pbi);
+	
+	if (!rebuildFilter()) {
+		return;
+	}
+	
+	for(osmpbf::IWayStream way(pbi.getWayStream()); !way.isNull(); way.next()) {
+		if (way.refsSize() > 4 && *way.refBegin() == *(way.refBegin()+(way.refsSize()-1)) && matches(way) && ctx->insideClip(way)) {
+			myWays->push_back(way.id(), way.refBegin(), way.refEnd());
+		}
+	}
+}
 
-	if (!mainFilter->rebuildCache()) {
+void AreaExtractor::WayRefsExtractor::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
+	ctx->pinfo(ctx->dataPosition());
+	if (!pbi.waysSize())
+		return;
+	
+	//the filter only decides about area-ways, ways of relations are selected by their id
+	//area-ways are directly assembled if all node locations are available
+	bool checkAreaWays = false;
+	if ((ctx->extractionTypes & ET_PRIMITIVE_WAYS) && !ctx->useDenseNodes) {
+		assignInputAdaptor(pbi);
+		checkAreaWays = rebuildFilter();
+	}
+	bool checkRelationWays = !ctx->rawWays.empty();
+	
+	if (!checkAreaWays && !checkRelationWays) {
 		return;
 	}
 	
 	uint32_t myRelevantWays = 0;
-	myRefs.clear();
+	std::size_t myRefsBegin = myRefs->size();
 	
 	for(osmpbf::IWayStream way(pbi.getWayStream()); !way.isNull(); way.next()) {
-		if (way.refsSize() > 4 && *way.refBegin() == *(way.refBegin()+(way.refsSize()-1)) && mainFilter->matches(way)) {
-			myRefs.insert(way.refBegin(), way.refEnd());
+		if (checkAreaWays && way.refsSize() > 4 && *way.refBegin() == *(way.refBegin()+(way.refsSize()-1)) && matches(way)) {
 			++myRelevantWays;
+			//ways leaving the clip region are dropped during assembly, hence their refs are not needed
+			if (ctx->insideClip(way)) {
+				if (myAreaWays) {
+					myAreaWays->push_back(way.id(), way.refBegin(), way.refEnd());
+				}
+				else {
+					myRefs->insert(myRefs->end(), way.refBegin(), way.refEnd());
+				}
+			}
+		}
+		if (checkRelationWays) {
+			//refs are indexed by way id in rawWays after this pass
+			//ways outside of the clip region stay empty, rings with them are dropped during assembly anyway
+			if (ctx->rawWays.find(way.id()) != RawWayStore::npos && ctx->insideClip(way)) {
+				myWays->push_back(way.id(), way.refBegin(), way.refEnd());
+				if (!ctx->useDenseNodes && !myAreaWays) {
+					myRefs->insert(myRefs->end(), way.refBegin(), way.refEnd());
+				}
+			}
 		}
 	}
 	ctx->relevantWaysSize += myRelevantWays;
-	std::lock_guard<std::mutex> lck(ctx->nodesLock);
-	ctx->nodes.reserve(ctx->nodes.size()+myRefs.size());
-	for(int64_t x : myRefs) {
-		ctx->nodes[x];
+	//refs of neighboring ways are often shared, remove duplicates of this block early
+	std::sort(myRefs->begin()+myRefsBegin, myRefs->end());
+	myRefs->resize(std::unique(myRefs->begin()+myRefsBegin, myRefs->end()) - myRefs->begin());
+	ctx->nodeRefs.flushIfFull(*myRefs);
+}
+
+template<typename TRefIterator>
+int AreaExtractor::WayExtractor::assemble(osmpbf::IWay & way, uint32_t position, uint32_t configurations, TRefIterator refBegin, TRefIterator refEnd, std::size_t refsSize) {
+	//ways with missing nodes are dropped entirely if clipped, this checks the first node before any allocation
+	Point p;
+	if (ctx->clip && !ctx->refPoint(*refBegin, p)) {
+		return -1;
 	}
-	myRefs.clear();
+	if (directSink()) {
+		GeoPointStorageBackend & points = sink()->points();
+		bool hasPoints = false;
+		for(TRefIterator it(refBegin); it != refEnd; ++it) {
+			if (ctx->refPoint(*it, p)) {
+				points.emplace_back(p.first, p.second);
+				hasPoints = true;
+			}
+			else if (ctx->clip) {
+				sink()->dropRing();
+				return -1;
+			}
+			else {
+				std::cout << "Way has missing node\n";
+				break;
+			}
+		}
+		if (hasPoints) {
+			sink()->endRing(false);
+			return (sink()->endRegion(way) ? 1 : 0);
+		}
+		return 0;
+	}
+	std::shared_ptr<sserialize::spatial::GeoPolygon> gpo( new sserialize::spatial::GeoPolygon() );
+	sserialize::spatial::GeoPolygon::PointsContainer & gpops = gpo->points();
+	gpops.reserve(refsSize);
+	for(TRefIterator it(refBegin); it != refEnd; ++it) {
+		if (ctx->refPoint(*it, p)) {
+			gpops.emplace_back(p.first, p.second);
+		}
+		else if (ctx->clip) {
+			return -1;
+		}
+		else {
+			std::cout << "Way has missing node\n";
+			break;
+		}
+	}
+	if (!gpo->points().size()) {
+		return 0;
+	}
+	gpo->recalculateBoundary();
+	emit(gpo, way, position, configurations);
+	return 1;
 }
 
 void AreaExtractor::WayExtractor::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
-	ctx->pinfo(ctx->inFile.dataPosition());
+	ctx->pinfo(ctx->dataPosition());
 	if (!pbi.waysSize()) {
 		return;
 	}
 	
 	assignInputAdaptor(pbi);
 
-	if (!mainFilter->rebuildCache()) {
+	if (!rebuildFilter()) {
 		return;
 	}
 	
+	uint32_t myRelevantWays = 0;
 	uint32_t myAssembledRelevantWays = 0;
+	uint32_t myClippedWays = 0;
+	uint32_t myMissingRefsWays = 0;
+	uint32_t position = 0;
 	
-	for(osmpbf::IWayStream way(pbi.getWayStream()); !way.isNull(); way.next()) {
-		if (way.refsSize() > 4 && *way.refBegin() == *(way.refBegin()+(way.refsSize()-1)) && mainFilter->matches(way)) {
-			std::shared_ptr<sserialize::spatial::GeoPolygon> gpo( new sserialize::spatial::GeoPolygon() );
-			sserialize::spatial::GeoPolygon::PointsContainer & gpops = gpo->points();
-			gpops.reserve(way.refsSize());
-			for(osmpbf::IWayStream::RefIterator it(way.refBegin()), end(way.refEnd()); it != end; ++it) {
-				int64_t wr = *it;
-				if (ctx->nodes.count(wr)) {
-					gpops.push_back(ctx->nodes[wr]);
-				}
-				else {
-					std::cout << "Way has missing node\n";
-					break;
+	for(osmpbf::IWayStream way(pbi.getWayStream()); !way.isNull(); way.next(), ++position) {
+		if (way.refsSize() <= 4 || *way.refBegin() != *(way.refBegin()+(way.refsSize()-1))) {
+			continue;
+		}
+		uint32_t configurations = matches(way);
+		if (configurations) {
+			++myRelevantWays;
+			int result = 0;
+			if (ctx->packedRefs) {
+				std::size_t pos = ctx->areaWays.find(way.id());
+				if (pos == RawWayStore::npos) {
+					std::cout << "Way has missing refs\n";
+					++myMissingRefsWays;
+					continue;
 				}
+				RawWayStore::Refs refs = ctx->areaWays.refs(pos);
+				const int64_t * locations = ctx->areaWays.locations(pos);
+				result = assemble(way, position, configurations, locations, locations+(refs.second-refs.first), refs.second-refs.first);
+			}
+			else {
+				result = assemble(way, position, configurations, way.refBegin(), way.refEnd(), way.refsSize());
 			}
-			if (gpo->points().size()) {
-				gpo->recalculateBoundary();
-				cb->operator()(gpo, way);
+			if (result > 0) {
 				++myAssembledRelevantWays;
 			}
+			else if (result < 0) {
+				++myClippedWays;
+			}
 		}
 	}
+	//ways are not counted in a ref pass if the dense node store is used
+	if (ctx->useDenseNodes) {
+		ctx->relevantWaysSize += myRelevantWays;
+	}
 	ctx->assembledRelevantWays += myAssembledRelevantWays;
+	ctx->clippedAreas += myClippedWays;
+	ctx->missingRefsWays += myMissingRefsWays;
+	if (ctx->sequencer) {
+		emitPending(pbi.getWayStream());
+	}
 }
 
 void AreaExtractor::RelationWaysExtractor::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
-	ctx->pinfo(ctx->inFile.dataPosition());
+	ctx->pinfo(ctx->dataPosition());
 	if (!pbi.relationsSize()) {
 		return;
 	}
 	
 	assignInputAdaptor(pbi);
 
-	if (!mainFilter->rebuildCache()) {
+	if (!rebuildFilter()) {
 		return;
 	}
 	
 	uint32_t myRelevantRelations = 0;
-	myWayIds.clear();
 	
 	for (osmpbf::IRelationStream rel = pbi.getRelationStream(); !rel.isNull(); rel.next()) {
-		if (mainFilter->matches(rel)) {
+		if (matches(rel)) {
 			for(osmpbf::IMemberStream mem = rel.getMemberStream(); !mem.isNull(); mem.next()) {
 				if (mem.type() == osmpbf::WayPrimitive) {
-					myWayIds.insert(mem.id());
+					myWayIds->push_back(mem.id());
 				}
 			}
 			++myRelevantRelations;
 		}
 	}
 	ctx->relevantRelationsSize += myRelevantRelations;
-	std::lock_guard<std::mutex> lck(ctx->rawWaysLock);
-	ctx->rawWays.reserve(ctx->rawWays.size()+myWayIds.size());
-	for(int64_t x : myWayIds) {
-		ctx->rawWays[x];
-	}
-	myWayIds.clear();
-}
-
-void AreaExtractor::RelationWayNodeRefsExtractor::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
-	ctx->pinfo(ctx->inFile.dataPosition());
-	if (!pbi.waysSize()) {
-		return;
-	}
-	
-	myWayRefs.clear();
-	
-	for (osmpbf::IWayStream way = pbi.getWayStream(); !way.isNull(); way.next()) {
-		int64_t wid = way.id();
-		if (ctx->rawWays.count(wid)) {
-			detail::AreaExtractor::MultiPolyResolver::RawWay & rw = ctx->rawWays[wid];
-			rw.insert(rw.end(), way.refBegin(), way.refEnd());
-			rw.shrink_to_fit();
-			myWayRefs.insert(way.refBegin(), way.refEnd());
-		}
-	}
-	std::lock_guard<std::mutex> lck(ctx->nodesLock);
-	ctx->nodes.reserve(ctx->nodes.size() + myWayRefs.size());
-	for(int64_t x : myWayRefs) {
-		ctx->nodes[x];
-	}
 }
 
 void AreaExtractor::RelationExtractor::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
-	ctx->pinfo(ctx->inFile.dataPosition());
+	ctx->pinfo(ctx->dataPosition());
 	if (!pbi.relationsSize()) {
 		return;
 	}
 	
 	assignInputAdaptor(pbi);
 
-	if (!mainFilter->rebuildCache()) {
+	if (!rebuildFilter()) {
 		return;
 	}
 	
 	uint32_t myAssembledRelevantRelations = 0;
+	uint32_t myClippedRelations = 0;
+	roleClasses.assign(pbi.stringTableSize(), RC_UNRESOLVED);
+	uint32_t position = 0;
 	
-	for(osmpbf::IRelationStream rel(pbi.getRelationStream()); !rel.isNull(); rel.next()) {
-		if (!mainFilter->matches(rel)) {
+	for(osmpbf::IRelationStream rel(pbi.getRelationStream()); !rel.isNull(); rel.next(), ++position) {
+		uint32_t configurations = matches(rel);
+		if (!configurations) {
 			continue;
 		}
-		std::vector< detail::AreaExtractor::MultiPolyResolver::RawWay > outerWays, innerWays;
+		outerWays.clear();
+		innerWays.clear();
 		
 		bool allWaysAvailable = true;
 		
 		for(osmpbf::IMemberStream mem = rel.getMemberStream(); !mem.isNull(); mem.next()) {
 			if (mem.type() == osmpbf::WayPrimitive) {
-				if (ctx->rawWays.count(mem.id())) {
-					const detail::AreaExtractor::MultiPolyResolver::RawWay & rw = ctx->rawWays[ mem.id() ];
+				std::size_t rwPos = ctx->rawWays.find(mem.id());
+				if (rwPos != RawWayStore::npos) {
+					RawWayStore::Refs refs = ctx->rawWays.refs(rwPos);
 					
-					if (!rw.size()) {
+					if (refs.first == refs.second) {
 						continue;
 					}
+					detail::AreaExtractor::MultiPolyResolver::RawWaySpan rw(refs.first, refs.second, (ctx->packedRefs ? ctx->rawWays.locations(rwPos) : 0));
 					
-					if (mem.role() == "outer" || mem.role() == "" || mem.role() == "exclave" || mem.role() == "Outer" || mem.role() == "outer:FIXME") {
-						outerWays.push_back(rw);
+					RoleClass rc = roleClass(mem.roleId());
+					if (rc == RC_OUTER) {
+						outerWays.emplace_back(rw);
 					}
-					else if (mem.role() == "inner" || mem.role() == "enclave") {
-						innerWays.push_back(rw);
+					else if (rc == RC_INNER) {
+						innerWays.emplace_back(rw);
 					}
 					else if (ctx->verbose) {
 						std::cout << "Illegal role in relation " << rel.id() << ": " << mem.role() << '\n';
@@ -317,19 +1158,135 @@ void AreaExtractor::RelationExtractor::operator()(osmpbf::PrimitiveBlockInputAda
 				}
 			}
 		}
-		if (outerWays.size() && !detail::AreaExtractor::MultiPolyResolver::multiPolyFromWays(innerWays, outerWays, innerWays, outerWays) && allWaysAvailable) {
-			if (ctx->verbose) {
+		//relations without any node inside the clip region are dropped before assembly
+		if (ctx->clip && !ctx->anyNodePoint(outerWays)) {
+			++myClippedRelations;
+			continue;
+		}
+		if (ctx->assemblyPool && outerWays.size()) {
+			uint64_t refsSize = 0;
+			for(const detail::AreaExtractor::MultiPolyResolver::RawWaySpan & w : outerWays) {
+				refsSize += w.size();
+			}
+			for(const detail::AreaExtractor::MultiPolyResolver::RawWaySpan & w : innerWays) {
+				refsSize += w.size();
+			}
+			if (refsSize >= ctx->largeRelationMinRefs) {
+				RelationAssemblyPool::Job job;
+				job.relationId = rel.id();
+				job.configurations = configurations;
+				job.refsSize = refsSize;
+				job.allWaysAvailable = allWaysAvailable;
+				job.outerWays = outerWays;
+				job.innerWays = innerWays;
+				ctx->assemblyPool->push(std::move(job));
+				continue;
+			}
+		}
+		bool allOk = true;
+		if (directSink()) {
+			if (!outerWays.size()) {
+				continue;
+			}
+			SinkRingWriter outerWriter(sink(), false);
+			SinkRingWriter innerWriter(sink(), true);
+			allOk = detail::AreaExtractor::MultiPolyResolver::writeRings(outerWays, NodeMapper(ctx), outerWriter);
+			allOk = detail::AreaExtractor::MultiPolyResolver::writeRings(innerWays, NodeMapper(ctx), innerWriter) && allOk;
+			if (!allOk && allWaysAvailable && ctx->verbose) {
 				std::cerr << "Failed to fully create MultiPolygon from multiple ways for relation " << rel.id() << '\n';
 			}
+			if (sink()->endRegion(rel)) {
+				++myAssembledRelevantRelations;
+			}
+			continue;
+		}
+		std::shared_ptr<sserialize::spatial::GeoRegion> gmpo( detail::AreaExtractor::MultiPolyResolver::multiPolyFromWaySpans(innerWays, outerWays, NodeMapper(ctx), allOk) );
+		if (!allOk && allWaysAvailable && ctx->verbose) {
+			std::cerr << "Failed to fully create MultiPolygon from multiple ways for relation " << rel.id() << '\n';
 		}
-		if (outerWays.size()) {
-			std::shared_ptr<sserialize::spatial::GeoRegion> gmpo( detail::AreaExtractor::MultiPolyResolver::multiPolyFromClosedWays(innerWays, outerWays, ctx->nodes) );
-			cb->operator()(gmpo, rel);
+		if (gmpo) {
+			emit(gmpo, rel, position, configurations);
 			++myAssembledRelevantRelations;
 		}
 	}
 	
 	ctx->assembledRelevantRelations += myAssembledRelevantRelations;
+	ctx->clippedAreas += myClippedRelations;
+	if (ctx->sequencer) {
+		emitPending(pbi.getRelationStream());
+	}
+}
+
+void AreaExtractor::AssembledRelationEmitter::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
+	ctx->pinfo(ctx->dataPosition());
+	if (!pbi.relationsSize()) {
+		return;
+	}
+	
+	uint32_t myAssembledRelevantRelations = 0;
+	if (tagProjector) {
+		tagProjector->reset(pbi);
+	}
+	//nothing is assembled here, hence blocks simply wait for their turn
+	if (ctx->sequencer) {
+		ctx->sequencer->wait();
+	}
+	
+	const RelationAssemblyPool::ResultsContainer & results = pool->results();
+	for(osmpbf::IRelationStream rel(pbi.getRelationStream()); !rel.isNull(); rel.next()) {
+		RelationAssemblyPool::ResultsContainer::const_iterator it = results.find(rel.id());
+		if (it != results.cend()) {
+			if (ctx->sinkFactory) {
+				if (!mySink) {
+					mySink.reset(ctx->sinkFactory());
+				}
+				mySink->push_back(*(it->second.region), rel);
+			}
+			else {
+				cb->operator()(it->second.region, rel, (tagProjector ? tagProjector->push_back(rel) : TagStore::NoRow), it->second.configurations);
+			}
+			++myAssembledRelevantRelations;
+		}
+	}
+	
+	ctx->assembledRelevantRelations += myAssembledRelevantRelations;
+}
+
+AreaExtractor::RelationExtractor::RoleClass AreaExtractor::RelationExtractor::roleClass(uint32_t roleId) {
+	if (roleId >= roleClasses.size()) {
+		return RC_OTHER;
+	}
+	if (roleClasses[roleId] == RC_UNRESOLVED) {
+		const std::string & role = pbi->queryStringTable(roleId);
+		if (role == "outer" || role == "" || role == "exclave" || role == "Outer" || role == "outer:FIXME") {
+			roleClasses[roleId] = RC_OUTER;
+		}
+		else if (role == "inner" || role == "enclave") {
+			roleClasses[roleId] = RC_INNER;
+		}
+		else {
+			roleClasses[roleId] = RC_OTHER;
+		}
+	}
+	return (RoleClass) roleClasses[roleId];
+}
+
+void AreaExtractor::DenseWayAssembler::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
+	if (!wre.ctx->rawWays.empty()) {
+		wre(pbi);
+	}
+	if (we.ctx->extractionTypes & ET_PRIMITIVE_WAYS) {
+		we(pbi);
+	}
+}
+
+void AreaExtractor::AreaAssembler::operator()(osmpbf::PrimitiveBlockInputAdaptor& pbi) {
+	if (we.ctx->extractionTypes & ET_PRIMITIVE_WAYS) {
+		we(pbi);
+	}
+	if (re.ctx->extractionTypes & ET_PRIMITIVE_RELATIONS) {
+		re(pbi);
+	}
 }
 
 }//end namespace
@@ -1,96 +1,407 @@
 #include <osmtools/AreaExtractorFilters.h>
 #include <vector>
+#include <stdexcept>
 #include <osmpbf/iprimitive.h>
+#include <sserialize/utility/assert.h>
 
 namespace osmtools {
 namespace detail {
 namespace AreaExtractor {
 
-generics::RCPtr<osmpbf::AbstractTagFilter> Base::createExtractionFilter(ExtractionTypes extractionTypes) {
-	if (! (extractionTypes & (~(ET_PRIMITIVE_RELATIONS|ET_PRIMITIVE_WAYS)))) { //extract all
-		
+namespace {
+
+ExtractionRule rule(ExtractionRule::Type type, const std::string & key = std::string(), const std::vector<std::string> & values = std::vector<std::string>()) {
+	ExtractionRule r;
+	r.type = type;
+	r.key = key;
+	r.values = values;
+	return r;
+}
+
+ExtractionRule rule(ExtractionRule::Type type, std::vector<ExtractionRule> && children) {
+	ExtractionRule r;
+	r.type = type;
+	r.children = std::move(children);
+	return r;
+}
+
+osmpbf::AbstractTagFilter * toTagFilter(const ExtractionRule & r) {
+	switch (r.type) {
+	case ExtractionRule::RT_WAY:
+		return new osmpbf::PrimitiveTypeFilter(osmpbf::WayPrimitive);
+	case ExtractionRule::RT_RELATION:
+		return new osmpbf::PrimitiveTypeFilter(osmpbf::RelationPrimitive);
+	case ExtractionRule::RT_KEY:
+		return new osmpbf::KeyOnlyTagFilter(r.key);
+	case ExtractionRule::RT_KEY_VALUES:
+	{
+		if (r.values.size() == 1) {
+			return new osmpbf::KeyValueTagFilter(r.key, r.values.front());
+		}
+		osmpbf::OrTagFilter * f = new osmpbf::OrTagFilter();
+		for(const std::string & value : r.values) {
+			f->addChild(new osmpbf::KeyValueTagFilter(r.key, value));
+		}
+		return f;
+	}
+	case ExtractionRule::RT_KEY_FALSE:
+		return new osmpbf::BoolTagFilter(r.key, false);
+	case ExtractionRule::RT_AND:
+	{
+		osmpbf::AndTagFilter * f = new osmpbf::AndTagFilter();
+		for(const ExtractionRule & child : r.children) {
+			f->addChild(toTagFilter(child));
+		}
+		return f;
+	}
+	case ExtractionRule::RT_OR:
+	default:
+	{
+		osmpbf::OrTagFilter * f = new osmpbf::OrTagFilter();
+		for(const ExtractionRule & child : r.children) {
+			f->addChild(toTagFilter(child));
+		}
+		return f;
+	}
 	}
+}
+
+}//end namespace
+
+generics::RCPtr<osmpbf::AbstractTagFilter> Base::createExtractionFilter(ExtractionTypes extractionTypes) {
 	generics::RCPtr<osmpbf::AbstractTagFilter> mainFilter;
-	generics::RCPtr<osmpbf::OrTagFilter> areaFilter(new osmpbf::OrTagFilter());
+	if (extractionTypes & (ET_PRIMITIVE_WAYS|ET_PRIMITIVE_RELATIONS)) {
+		mainFilter.reset( toTagFilter(ExtractionRule::create(extractionTypes)) );
+	}
+	return mainFilter;
+}
 
-	generics::RCPtr<osmpbf::AndTagFilter> wayFilter(new osmpbf::AndTagFilter());
-	generics::RCPtr<osmpbf::AndTagFilter> relationFilter(new osmpbf::AndTagFilter());
-	
-	//setup primitive type filters
-	wayFilter->addChild(new osmpbf::PrimitiveTypeFilter(osmpbf::WayPrimitive));
-	relationFilter->addChild(new osmpbf::PrimitiveTypeFilter(osmpbf::RelationPrimitive));
-	
-	if ((extractionTypes & ET_BUILDING) == ET_BUILDING) {
-		areaFilter->addChild(new osmpbf::KeyOnlyTagFilter("building"));
+//BEGIN: ExtractionRule
+
+ExtractionRule ExtractionRule::create(Base::ExtractionTypes et) {
+	std::vector<ExtractionRule> areas;
+	if ((et & Base::ET_BUILDING) == Base::ET_BUILDING) {
+		areas.push_back(rule(RT_KEY, "building"));
 	}
-	if (extractionTypes & ET_BOUNDARIES) {
-		areaFilter->addChild(new osmpbf::KeyOnlyTagFilter("boundary"));
+	if (et & Base::ET_BOUNDARIES) {
+		areas.push_back(rule(RT_KEY, "boundary"));
 	}
-	if (extractionTypes & ET_LANDUSE) {
-		areaFilter->addChild(new osmpbf::KeyOnlyTagFilter("landuse"));
+	if (et & Base::ET_LANDUSE) {
+		areas.push_back(rule(RT_KEY, "landuse"));
 	}
-	if (extractionTypes & ET_NATURAL) {
-		areaFilter->addChild(new osmpbf::KeyOnlyTagFilter("natural"));
+	if (et & Base::ET_NATURAL) {
+		areas.push_back(rule(RT_KEY, "natural"));
 	}
-	if (extractionTypes & ET_ISLAND) {
-		areaFilter->addChild(new osmpbf::KeyMultiValueTagFilter("place", {"island", "archipelago", "islet"}));
+	if (et & Base::ET_ISLAND) {
+		areas.push_back(rule(RT_KEY_VALUES, "place", {"island", "archipelago", "islet"}));
 	}
-	if (extractionTypes & ET_AREA) {
-		osmpbf::AbstractTagFilter * areaTagFilter = 0;
-		std::vector<osmpbf::AbstractTagFilter*> areaExclusions;
-		if ((extractionTypes & ET_BUILDING) != ET_BUILDING) {
-			areaExclusions.push_back(new osmpbf::BoolTagFilter("building", false));
+	if (et & Base::ET_AREA) {
+		//area=* is only an area of its own if it is not extracted as one of the other types
+		std::vector<ExtractionRule> exclusions;
+		if ((et & Base::ET_BUILDING) != Base::ET_BUILDING) {
+			exclusions.push_back(rule(RT_KEY_FALSE, "building"));
 		}
-		if ((extractionTypes & ET_BOUNDARIES) != ET_BOUNDARIES) {
-			areaExclusions.push_back(new osmpbf::BoolTagFilter("boundary", false));
+		if ((et & Base::ET_BOUNDARIES) != Base::ET_BOUNDARIES) {
+			exclusions.push_back(rule(RT_KEY_FALSE, "boundary"));
 		}
-		if ((extractionTypes & ET_LANDUSE) != ET_LANDUSE) {
-			areaExclusions.push_back(new osmpbf::BoolTagFilter("landuse", false));
+		if ((et & Base::ET_LANDUSE) != Base::ET_LANDUSE) {
+			exclusions.push_back(rule(RT_KEY_FALSE, "landuse"));
 		}
-		if ((extractionTypes & ET_NATURAL) != ET_NATURAL) {
-			areaExclusions.push_back(new osmpbf::BoolTagFilter("natural", false));
+		if ((et & Base::ET_NATURAL) != Base::ET_NATURAL) {
+			exclusions.push_back(rule(RT_KEY_FALSE, "natural"));
 		}
-		if (areaExclusions.size()) {
-			osmpbf::AndTagFilter * andTagFilter = new osmpbf::AndTagFilter();
-			andTagFilter->addChild(new osmpbf::KeyOnlyTagFilter("area"));
-			andTagFilter->addChildren(areaExclusions.begin(), areaExclusions.end());
-			areaTagFilter = andTagFilter;
+		if (exclusions.size()) {
+			exclusions.insert(exclusions.begin(), rule(RT_KEY, "area"));
+			areas.push_back(rule(RT_AND, std::move(exclusions)));
 		}
 		else {
-			areaTagFilter = new osmpbf::KeyOnlyTagFilter("area");
+			areas.push_back(rule(RT_KEY, "area"));
 		}
-		areaFilter->addChild(areaTagFilter);
 	}
+	ExtractionRule areaRule = rule(RT_OR, std::move(areas));
 	
-	{//set the way filter
-		wayFilter->addChild(areaFilter.get());
+	std::vector<ExtractionRule> primitives;
+	if (et & Base::ET_PRIMITIVE_WAYS) {
+		primitives.push_back(rule(RT_AND, {rule(RT_WAY), areaRule}));
 	}
-	
-	{//set the relation filter
-		osmpbf::AbstractTagFilter * multiPolyFilter;
-		if (extractionTypes & ET_MULTIPOLYGONS) {
-			multiPolyFilter = new osmpbf::KeyMultiValueTagFilter("type", {"multipoly", "multipolygon"});
+	if (et & Base::ET_PRIMITIVE_RELATIONS) {
+		ExtractionRule multiPolyRule = rule(RT_KEY_VALUES, "type", {"multipoly", "multipolygon"});
+		if (!(et & Base::ET_MULTIPOLYGONS)) {
+			multiPolyRule = rule(RT_AND, {multiPolyRule, areaRule});
 		}
-		else {
-			multiPolyFilter = osmpbf::newAnd(new osmpbf::KeyMultiValueTagFilter("type", {"multipoly", "multipolygon"}), areaFilter.get());
+		if (et & Base::ET_BOUNDARIES) {
+			multiPolyRule = rule(RT_OR, {rule(RT_KEY_VALUES, "type", {"boundary"}), multiPolyRule});
 		}
-		if (extractionTypes & ET_BOUNDARIES) {
-			relationFilter->addChild( osmpbf::newOr(new osmpbf::KeyValueTagFilter("type", "boundary"), multiPolyFilter) );
+		primitives.push_back(rule(RT_AND, {rule(RT_RELATION), multiPolyRule}));
+	}
+	if (primitives.size() == 1) {
+		return primitives.front();
+	}
+	return rule(RT_OR, std::move(primitives));
+}
+
+//END: ExtractionRule
+
+//BEGIN: CompiledFilter::BlockState
+
+constexpr uint8_t CompiledFilter::BlockState::NoKey;
+
+CompiledFilter::BlockState::BlockState() {}
+
+CompiledFilter::BlockState::~BlockState() {}
+
+bool CompiledFilter::BlockState::reset(const CompiledFilter & filter, osmpbf::PrimitiveBlockInputAdaptor & pbi) {
+	int stringTableSize = pbi.stringTableSize();
+	m_keys.assign(stringTableSize, NoKey);
+	m_valueSets.assign(stringTableSize, 0);
+	bool anyKey = false;
+	for(int i(0); i < stringTableSize; ++i) {
+		std::unordered_map<std::string, StringInfo>::const_iterator it = filter.m_strings.find(pbi.queryStringTable(i));
+		if (it != filter.m_strings.cend()) {
+			m_keys[i] = it->second.key;
+			m_valueSets[i] = it->second.valueSets;
+			anyKey = anyKey || it->second.key != NoKey;
 		}
-		else {
-			relationFilter->addChild(multiPolyFilter);
+	}
+	return anyKey || filter.m_matchesUntagged;
+}
+
+//END: CompiledFilter::BlockState
+
+//BEGIN: CompiledFilter
+
+constexpr uint32_t CompiledFilter::MaxAtoms;
+constexpr uint32_t CompiledFilter::MaxValueSets;
+constexpr uint32_t CompiledFilter::MaxStackSize;
+
+CompiledFilter::CompiledFilter(Base::ExtractionTypes et) :
+m_valueSetsSize(0),
+m_matchesUntagged(false)
+{
+	ExtractionRule r = ExtractionRule::create(et);
+	if (stackSize(r) > MaxStackSize) {
+		throw std::out_of_range("CompiledFilter: extraction rules are nested too deeply");
+	}
+	compile(r);
+	m_matchesUntagged = eval(0, osmpbf::WayPrimitive) || eval(0, osmpbf::RelationPrimitive);
+}
+
+CompiledFilter::~CompiledFilter() {}
+
+void CompiledFilter::compile(const ExtractionRule & r) {
+	//the values of BoolTagFilter(key, false)
+	static const std::vector<std::string> falseValues = {"false", "False", "no", "No", "0"};
+	switch (r.type) {
+	case ExtractionRule::RT_WAY:
+		op(OP_WAY);
+		break;
+	case ExtractionRule::RT_RELATION:
+		op(OP_RELATION);
+		break;
+	case ExtractionRule::RT_KEY:
+		atom(r.key);
+		break;
+	case ExtractionRule::RT_KEY_VALUES:
+		atom(r.key, r.values);
+		break;
+	case ExtractionRule::RT_KEY_FALSE:
+		atom(r.key, falseValues);
+		break;
+	case ExtractionRule::RT_AND:
+	case ExtractionRule::RT_OR:
+		//the operands are bounded by the stack size
+		for(const ExtractionRule & child : r.children) {
+			compile(child);
 		}
+		op(r.type == ExtractionRule::RT_AND ? OP_AND : OP_OR, (uint8_t) r.children.size());
+		break;
+	default:
+		break;
 	}
-	if ((extractionTypes & ET_PRIMITIVE_WAYS) && extractionTypes & ET_PRIMITIVE_RELATIONS) {
-		mainFilter.reset( osmpbf::newOr(wayFilter.get(), relationFilter.get()) );
+}
+
+uint32_t CompiledFilter::stackSize(const ExtractionRule & r) {
+	uint32_t result = 1;
+	for(uint32_t i(0), s((uint32_t) r.children.size()); i < s; ++i) {
+		result = std::max(result, i + stackSize(r.children[i]));
 	}
-	else if(extractionTypes & ET_PRIMITIVE_WAYS) {
-		mainFilter.reset(wayFilter.get());
+	return result;
+}
+
+uint8_t CompiledFilter::addKey(const std::string & key) {
+	StringInfo & si = m_strings[key];
+	if (si.key == BlockState::NoKey) {
+		si.key = (uint8_t) m_keyAtoms.size();
+		m_keyAtoms.emplace_back();
 	}
-	else if (extractionTypes & ET_PRIMITIVE_RELATIONS) {
-		mainFilter.reset(relationFilter.get());
+	return si.key;
+}
+
+void CompiledFilter::atom(const std::string & key) {
+	if (m_atoms.size() >= MaxAtoms) {
+		throw std::out_of_range("CompiledFilter: too many atoms");
 	}
-	return mainFilter;
+	uint8_t keyIndex = addKey(key);
+	m_keyAtoms[keyIndex].push_back((uint8_t) m_atoms.size());
+	op(OP_ATOM, (uint8_t) m_atoms.size());
+	m_atoms.push_back(Atom{keyIndex, 0});
+}
+
+void CompiledFilter::atom(const std::string & key, const std::vector<std::string> & values) {
+	if (m_atoms.size() >= MaxAtoms) {
+		throw std::out_of_range("CompiledFilter: too many atoms");
+	}
+	if (m_valueSetsSize >= MaxValueSets) {
+		throw std::out_of_range("CompiledFilter: too many value sets");
+	}
+	uint8_t keyIndex = addKey(key);
+	uint32_t valueSet = uint32_t(1) << m_valueSetsSize;
+	++m_valueSetsSize;
+	for(const std::string & value : values) {
+		m_strings[value].valueSets |= valueSet;
+	}
+	m_keyAtoms[keyIndex].push_back((uint8_t) m_atoms.size());
+	op(OP_ATOM, (uint8_t) m_atoms.size());
+	m_atoms.push_back(Atom{keyIndex, valueSet});
+}
+
+void CompiledFilter::op(OpCode code, uint8_t arg) {
+	m_program.push_back(Op{(uint8_t) code, arg});
+}
+
+bool CompiledFilter::eval(uint32_t atoms, osmpbf::PrimitiveType type) const {
+	if (m_program.empty()) {
+		return false;
+	}
+	bool stack[MaxStackSize];
+	uint32_t top = 0;
+	for(const Op & o : m_program) {
+		switch (o.code) {
+		case OP_WAY:
+			stack[top++] = (type == osmpbf::WayPrimitive);
+			break;
+		case OP_RELATION:
+			stack[top++] = (type == osmpbf::RelationPrimitive);
+			break;
+		case OP_ATOM:
+			stack[top++] = (atoms >> o.arg) & 0x1;
+			break;
+		case OP_AND:
+		{
+			bool result = true;
+			for(uint32_t i(top-o.arg); i < top; ++i) {
+				result = result && stack[i];
+			}
+			top -= o.arg;
+			stack[top++] = result;
+			break;
+		}
+		case OP_OR:
+		{
+			bool result = false;
+			for(uint32_t i(top-o.arg); i < top; ++i) {
+				result = result || stack[i];
+			}
+			top -= o.arg;
+			stack[top++] = result;
+			break;
+		}
+		default:
+			break;
+		}
+	}
+	SSERIALIZE_CHEAP_ASSERT_EQUAL(top, uint32_t(1));
+	return stack[0];
+}
+
+bool CompiledFilter::matches(const BlockState & state, const osmpbf::IPrimitive & primitive) const {
+	uint32_t atoms = 0;
+	for(int i(0), s(primitive.tagsSize()); i < s; ++i) {
+		uint32_t keyId = primitive.keyId(i);
+		if (keyId >= state.m_keys.size() || state.m_keys[keyId] == BlockState::NoKey) {
+			continue;
+		}
+		uint32_t valueId = primitive.valueId(i);
+		uint32_t valueSets = (valueId < state.m_valueSets.size() ? state.m_valueSets[valueId] : 0);
+		for(uint8_t a : m_keyAtoms[state.m_keys[keyId]]) {
+			const Atom & at = m_atoms[a];
+			if (!at.valueSet || (at.valueSet & valueSets)) {
+				atoms |= uint32_t(1) << a;
+			}
+		}
+	}
+	return eval(atoms, primitive.type());
+}
+
+//END: CompiledFilter
+
+//BEGIN: CompiledFilterSet::BlockState
+
+CompiledFilterSet::BlockState::BlockState() {}
+
+CompiledFilterSet::BlockState::~BlockState() {}
+
+uint32_t CompiledFilterSet::BlockState::reset(const CompiledFilterSet & filters, osmpbf::PrimitiveBlockInputAdaptor & pbi) {
+	int stringTableSize = pbi.stringTableSize();
+	m_states.resize(filters.size());
+	for(CompiledFilter::BlockState & state : m_states) {
+		state.m_keys.assign(stringTableSize, CompiledFilter::BlockState::NoKey);
+		state.m_valueSets.assign(stringTableSize, 0);
+	}
+	uint32_t anyKey = 0;
+	for(int i(0); i < stringTableSize; ++i) {
+		std::unordered_map<std::string, std::vector<Entry> >::const_iterator it = filters.m_strings.find(pbi.queryStringTable(i));
+		if (it == filters.m_strings.cend()) {
+			continue;
+		}
+		for(const Entry & e : it->second) {
+			CompiledFilter::BlockState & state = m_states[e.configuration];
+			state.m_keys[i] = e.key;
+			state.m_valueSets[i] = e.valueSets;
+			if (e.key != CompiledFilter::BlockState::NoKey) {
+				anyKey |= uint32_t(1) << e.configuration;
+			}
+		}
+	}
+	uint32_t result = 0;
+	for(uint32_t i(0), s(filters.size()); i < s; ++i) {
+		if (((anyKey >> i) & 0x1) || filters.at(i).m_matchesUntagged) {
+			result |= uint32_t(1) << i;
+		}
+	}
+	return result;
+}
+
+//END: CompiledFilterSet::BlockState
+
+//BEGIN: CompiledFilterSet
+
+constexpr uint32_t CompiledFilterSet::MaxConfigurations;
+
+CompiledFilterSet::CompiledFilterSet() {}
+
+CompiledFilterSet::~CompiledFilterSet() {}
+
+void CompiledFilterSet::push_back(const CompiledFilter * filter) {
+	if (m_filters.size() >= MaxConfigurations) {
+		throw std::out_of_range("CompiledFilterSet: too many configurations");
+	}
+	uint32_t configuration = (uint32_t) m_filters.size();
+	m_filters.push_back(filter);
+	for(const auto & x : filter->m_strings) {
+		m_strings[x.first].push_back(Entry{configuration, x.second.key, x.second.valueSets});
+	}
+}
+
+void CompiledFilterSet::clear() {
+	m_filters.clear();
+	m_strings.clear();
 }
 
+uint32_t CompiledFilterSet::size() const {
+	return (uint32_t) m_filters.size();
+}
+
+//END: CompiledFilterSet
+
 }}}//end namespace osmtools
\ No newline at end of file
@@ -0,0 +1,194 @@
+#include <osmtools/ClipRegion.h>
+#include <osmtools/types.h>
+#include <sserialize/utility/exceptions.h>
+#include <cmath>
+#include <deque>
+
+namespace osmtools {
+namespace detail {
+namespace ClipRegion {
+
+template<typename TPolygon>
+std::vector<sserialize::spatial::GeoPoint> ringOf(const TPolygon & gp) {
+	std::vector<sserialize::spatial::GeoPoint> result;
+	result.reserve(gp.size());
+	for(typename TPolygon::const_iterator it(gp.cbegin()), end(gp.cend()); it != end; ++it) {
+		result.emplace_back(it->lat(), it->lon());
+	}
+	return result;
+}
+
+}}//end namespace detail::ClipRegion
+
+constexpr uint32_t ClipRegion::GridSize;
+
+ClipRegion::ClipRegion() :
+m_minLat(1),
+m_maxLat(-1),
+m_minLon(1),
+m_maxLon(-1),
+m_latScale(0),
+m_lonScale(0)
+{}
+
+ClipRegion::ClipRegion(const sserialize::spatial::GeoRect & rect, double margin) :
+m_minLat(std::max(rect.minLat() - margin, -90.0)),
+m_maxLat(std::min(rect.maxLat() + margin, 90.0)),
+m_minLon(std::max(rect.minLon() - margin, -180.0)),
+m_maxLon(std::min(rect.maxLon() + margin, 180.0)),
+m_latScale(0),
+m_lonScale(0)
+{}
+
+ClipRegion::ClipRegion(const sserialize::spatial::GeoRegion & region, double margin) :
+ClipRegion()
+{
+	std::vector<const Ring*> rings;
+	//rings of the polygons of OsmGridRegionTree use a different point type and are copied
+	std::deque<Ring> copies;
+	if (const sserialize::spatial::GeoPolygon * gp = dynamic_cast<const sserialize::spatial::GeoPolygon*>(&region)) {
+		rings.push_back(&gp->points());
+	}
+	else if (const sserialize::spatial::GeoMultiPolygon * gmp = dynamic_cast<const sserialize::spatial::GeoMultiPolygon*>(&region)) {
+		for(const sserialize::spatial::GeoPolygon & gp : gmp->outerPolygons()) {
+			rings.push_back(&gp.points());
+		}
+		for(const sserialize::spatial::GeoPolygon & gp : gmp->innerPolygons()) {
+			rings.push_back(&gp.points());
+		}
+	}
+	else if (const OsmGeoPolygon * gp = dynamic_cast<const OsmGeoPolygon*>(&region)) {
+		copies.push_back(detail::ClipRegion::ringOf(*gp));
+		rings.push_back(&copies.back());
+	}
+	else if (const OsmGeoMultiPolygon * gmp = dynamic_cast<const OsmGeoMultiPolygon*>(&region)) {
+		for(const OsmGeoPolygon & gp : gmp->outerPolygons()) {
+			copies.push_back(detail::ClipRegion::ringOf(gp));
+			rings.push_back(&copies.back());
+		}
+		for(const OsmGeoPolygon & gp : gmp->innerPolygons()) {
+			copies.push_back(detail::ClipRegion::ringOf(gp));
+			rings.push_back(&copies.back());
+		}
+	}
+	else {
+		throw sserialize::TypeMissMatchException("ClipRegion: unsupported region type");
+	}
+	rasterize(rings, margin);
+}
+
+ClipRegion::~ClipRegion() {}
+
+bool ClipRegion::empty() const {
+	return m_minLat > m_maxLat || m_minLon > m_maxLon;
+}
+
+sserialize::spatial::GeoRect ClipRegion::boundary() const {
+	return sserialize::spatial::GeoRect(m_minLat, m_maxLat, m_minLon, m_maxLon);
+}
+
+std::string ClipRegion::fingerprint() const {
+	if (empty()) {
+		return std::string();
+	}
+	double bounds[4] = {m_minLat, m_maxLat, m_minLon, m_maxLon};
+	//FNV-1a of the cells
+	uint64_t cellsHash = 14695981039346656037ULL;
+	for(uint8_t c : m_cells) {
+		cellsHash = (cellsHash ^ c) * 1099511628211ULL;
+	}
+	std::string result((const char*) bounds, sizeof(bounds));
+	result.append((const char*) &cellsHash, sizeof(cellsHash));
+	return result;
+}
+
+void ClipRegion::markRect(double minLat, double maxLat, double minLon, double maxLon) {
+	if (maxLat < m_minLat || minLat > m_maxLat || maxLon < m_minLon || minLon > m_maxLon) {
+		return;
+	}
+	uint32_t y0 = cellY(std::max(minLat, m_minLat));
+	uint32_t y1 = cellY(std::min(maxLat, m_maxLat));
+	uint32_t x0 = cellX(std::max(minLon, m_minLon));
+	uint32_t x1 = cellX(std::min(maxLon, m_maxLon));
+	for(uint32_t y(y0); y <= y1; ++y) {
+		std::fill(m_cells.begin()+(y*GridSize+x0), m_cells.begin()+(y*GridSize+x1+1), uint8_t(1));
+	}
+}
+
+void ClipRegion::rasterize(const std::vector<const Ring*> & rings, double margin) {
+	for(const Ring * ring : rings) {
+		for(const sserialize::spatial::GeoPoint & p : *ring) {
+			m_minLat = std::min(m_minLat, p.lat());
+			m_maxLat = std::max(m_maxLat, p.lat());
+			m_minLon = std::min(m_minLon, p.lon());
+			m_maxLon = std::max(m_maxLon, p.lon());
+		}
+	}
+	if (empty()) {
+		return;
+	}
+	m_minLat = std::max(m_minLat - margin, -90.0);
+	m_maxLat = std::min(m_maxLat + margin, 90.0);
+	m_minLon = std::max(m_minLon - margin, -180.0);
+	m_maxLon = std::min(m_maxLon + margin, 180.0);
+	m_latScale = GridSize/std::max(m_maxLat - m_minLat, 1e-9);
+	m_lonScale = GridSize/std::max(m_maxLon - m_minLon, 1e-9);
+	m_cells.assign(GridSize*GridSize, 0);
+
+	//interior: even-odd fill of the rows at the latitude of their cell centers
+	//every edge adds its crossings to the rows it spans, hence this is linear in the number of edges and crossings
+	std::vector< std::vector<double> > crossings(GridSize);
+	for(const Ring * ring : rings) {
+		for(std::size_t i(0), s(ring->size()); i < s; ++i) {
+			const sserialize::spatial::GeoPoint & a = (*ring)[i];
+			const sserialize::spatial::GeoPoint & b = (*ring)[(i+1) % s];
+			if (a.lat() == b.lat()) {
+				continue;
+			}
+			double lowLat = std::min(a.lat(), b.lat());
+			double highLat = std::max(a.lat(), b.lat());
+			//rows with lowLat <= center < highLat
+			double first = std::ceil((lowLat - m_minLat)*m_latScale - 0.5);
+			double last = std::ceil((highLat - m_minLat)*m_latScale - 0.5) - 1;
+			for(int64_t y(std::max<int64_t>(first, 0)), ye(std::min<int64_t>(last, GridSize-1)); y <= ye; ++y) {
+				double lat = m_minLat + (y+0.5)/m_latScale;
+				crossings[y].push_back(a.lon() + (lat - a.lat())*(b.lon() - a.lon())/(b.lat() - a.lat()));
+			}
+		}
+	}
+	for(uint32_t y(0); y < GridSize; ++y) {
+		std::vector<double> & c = crossings[y];
+		std::sort(c.begin(), c.end());
+		for(std::size_t i(0); i+1 < c.size(); i += 2) {
+			//cells with c[i] <= center <= c[i+1]
+			int64_t x0 = std::max<int64_t>(std::ceil((c[i] - m_minLon)*m_lonScale - 0.5), 0);
+			int64_t x1 = std::min<int64_t>(std::floor((c[i+1] - m_minLon)*m_lonScale - 0.5), GridSize-1);
+			if (x0 <= x1) {
+				std::fill(m_cells.begin()+(y*GridSize+x0), m_cells.begin()+(y*GridSize+x1+1), uint8_t(1));
+			}
+		}
+		c = std::vector<double>();
+	}
+
+	//boundary: split edges into pieces of at most one cell and mark the cells within the margin of every piece
+	double cellLat = 1/m_latScale;
+	double cellLon = 1/m_lonScale;
+	for(const Ring * ring : rings) {
+		for(std::size_t i(0), s(ring->size()); i < s; ++i) {
+			const sserialize::spatial::GeoPoint & a = (*ring)[i];
+			const sserialize::spatial::GeoPoint & b = (*ring)[(i+1) % s];
+			double dLat = b.lat() - a.lat();
+			double dLon = b.lon() - a.lon();
+			uint32_t pieces = (uint32_t) std::max<double>(std::ceil(std::max(std::abs(dLat)/cellLat, std::abs(dLon)/cellLon)), 1);
+			for(uint32_t j(0); j < pieces; ++j) {
+				double lat0 = a.lat() + dLat*j/pieces;
+				double lat1 = a.lat() + dLat*(j+1)/pieces;
+				double lon0 = a.lon() + dLon*j/pieces;
+				double lon1 = a.lon() + dLon*(j+1)/pieces;
+				markRect(std::min(lat0, lat1) - margin, std::max(lat0, lat1) + margin, std::min(lon0, lon1) - margin, std::max(lon0, lon1) + margin);
+			}
+		}
+	}
+}
+
+}//end namespace osmtools
@@ -0,0 +1,414 @@
+#include <osmtools/ExtractionCache.h>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+namespace osmtools {
+namespace detail {
+namespace ExtractionCache {
+
+static const char Magic[8] = {'O', 'S', 'M', 'T', 'X', 'C', 'H', 'E'};
+static const uint32_t Version = 3;
+
+static std::atomic<uint64_t> nextWriterId(1);
+
+inline uint64_t padded(uint64_t size) {
+	return (size + 7) & ~uint64_t(7);
+}
+
+bool fileIdentity(const std::string & fileName, uint64_t & size, int64_t & mtime) {
+	struct ::stat st;
+	if (::stat(fileName.c_str(), &st) != 0) {
+		return false;
+	}
+	size = st.st_size;
+	mtime = st.st_mtime;
+	return true;
+}
+
+}}//end namespace detail::ExtractionCache
+
+struct ExtractionCache::Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t tagKeysSize;
+	uint64_t inputSize;
+	int64_t inputMtime;
+	//size of the serialized key following the header
+	uint64_t keySize;
+	uint64_t regionsSize;
+	uint64_t ringsSize;
+	uint64_t pointsSize;
+	uint64_t stringsSize;
+	uint64_t stringDataSize;
+};
+
+std::string ExtractionCache::serializeKey(const Key & key) {
+	std::string result;
+	auto append = [&result](const std::string & str) {
+		uint32_t len = (uint32_t) str.size();
+		result.append((const char*) &len, sizeof(len));
+		result.append(str);
+	};
+	uint32_t flags[2] = {key.extractionTypes, key.snapGeometry};
+	result.append((const char*) flags, sizeof(flags));
+	append(key.filterKey);
+	append(key.clipKey);
+	for(const std::string & tagKey : key.tagKeys) {
+		append(tagKey);
+	}
+	return result;
+}
+
+//BEGIN: ExtractionCache::Writer
+
+ExtractionCache::Writer::Buffer::Buffer() :
+regions(sserialize::MM_FILEBASED),
+rings(sserialize::MM_FILEBASED),
+points(sserialize::MM_FILEBASED),
+values(sserialize::MM_FILEBASED)
+{
+	//string 0 is the empty string
+	stringId(std::string());
+}
+
+uint32_t ExtractionCache::Writer::Buffer::stringId(const std::string & str) {
+	std::unordered_map<std::string, uint32_t>::const_iterator it = stringIds.find(str);
+	if (it != stringIds.cend()) {
+		return it->second;
+	}
+	uint32_t id = (uint32_t) strings.size();
+	stringIds[str] = id;
+	strings.push_back(str);
+	return id;
+}
+
+ExtractionCache::Writer::Writer(const Key & key) :
+m_key(key),
+m_id(detail::ExtractionCache::nextWriterId.fetch_add(1))
+{
+	for(uint32_t i(0), s((uint32_t) key.tagKeys.size()); i < s; ++i) {
+		m_tagKeyIds[key.tagKeys[i]] = i;
+	}
+}
+
+ExtractionCache::Writer::~Writer() {}
+
+void ExtractionCache::Writer::project(osmpbf::IPrimitive & primitive, Primitive & p) const {
+	p.id = primitive.id();
+	p.type = primitive.type();
+	p.values.assign(m_key.tagKeys.size(), std::string());
+	for(int i(0), s(primitive.tagsSize()); i < s; ++i) {
+		std::unordered_map<std::string, uint32_t>::const_iterator it = m_tagKeyIds.find(primitive.key(i));
+		if (it != m_tagKeyIds.cend()) {
+			p.values[it->second] = primitive.value(i);
+		}
+	}
+}
+
+ExtractionCache::Writer::Buffer & ExtractionCache::Writer::localBuffer() {
+	//threads usually write to a single writer, hence its buffer is looked up only once per thread
+	static thread_local uint64_t tlWriter = 0;
+	static thread_local Buffer * tlBuffer = 0;
+	if (tlWriter != m_id) {
+		std::lock_guard<std::mutex> lck(m_lock);
+		Buffer* & b = m_threadBuffers[std::this_thread::get_id()];
+		if (!b) {
+			m_buffers.emplace_back();
+			b = &m_buffers.back();
+		}
+		tlWriter = m_id;
+		tlBuffer = b;
+	}
+	return *tlBuffer;
+}
+
+void ExtractionCache::Writer::push_back(const sserialize::spatial::GeoRegion & region, const Primitive & p) {
+	Buffer & b = localBuffer();
+	RegionEntry re;
+	re.id = p.id;
+	re.type = (uint16_t) p.type;
+	re.multi = 0;
+	re.ringsBegin = b.rings.size();
+	auto addRing = [&b](const sserialize::spatial::GeoPolygon & gp, bool inner) {
+		RingEntry ring;
+		ring.pointsBegin = b.points.size();
+		ring.pointsSize = gp.size();
+		ring.inner = inner;
+		for(sserialize::spatial::GeoPolygon::const_iterator it(gp.cbegin()), end(gp.cend()); it != end; ++it) {
+			b.points.push_back(PointEntry{it->lat(), it->lon()});
+		}
+		b.rings.push_back(ring);
+	};
+	if (const sserialize::spatial::GeoPolygon * gp = dynamic_cast<const sserialize::spatial::GeoPolygon*>(&region)) {
+		addRing(*gp, false);
+	}
+	else if (const sserialize::spatial::GeoMultiPolygon * gmp = dynamic_cast<const sserialize::spatial::GeoMultiPolygon*>(&region)) {
+		re.multi = 1;
+		for(const sserialize::spatial::GeoPolygon & gp : gmp->outerPolygons()) {
+			addRing(gp, false);
+		}
+		for(const sserialize::spatial::GeoPolygon & gp : gmp->innerPolygons()) {
+			addRing(gp, true);
+		}
+	}
+	else {
+		return;
+	}
+	re.ringsSize = (uint32_t) (b.rings.size() - re.ringsBegin);
+	b.regions.push_back(re);
+	for(const std::string & value : p.values) {
+		b.values.push_back(b.stringId(value));
+	}
+}
+
+bool ExtractionCache::Writer::store(const std::string & cacheFileName) const {
+	using namespace detail::ExtractionCache;
+	Header header;
+	::memset(&header, 0, sizeof(header));
+	if (!fileIdentity(m_key.inputFileName, header.inputSize, header.inputMtime)) {
+		return false;
+	}
+	
+	//merge the string tables of the buffers, string 0 is the empty string
+	std::unordered_map<std::string, uint32_t> stringIds;
+	std::vector<const std::string*> strings;
+	std::vector< std::vector<uint32_t> > bufferStringIds(m_buffers.size());
+	stringIds[std::string()] = 0;
+	strings.push_back(&(stringIds.begin()->first));
+	for(std::size_t i(0), s(m_buffers.size()); i < s; ++i) {
+		for(const std::string & str : m_buffers[i].strings) {
+			std::pair<std::unordered_map<std::string, uint32_t>::iterator, bool> r = stringIds.emplace(str, (uint32_t) strings.size());
+			if (r.second) {
+				strings.push_back(&(r.first->first));
+			}
+			bufferStringIds[i].push_back(r.first->second);
+		}
+	}
+	
+	std::string key = serializeKey(m_key);
+	::memcpy(header.magic, Magic, sizeof(Magic));
+	header.version = Version;
+	header.tagKeysSize = (uint32_t) m_key.tagKeys.size();
+	header.keySize = key.size();
+	for(const Buffer & b : m_buffers) {
+		header.regionsSize += b.regions.size();
+		header.ringsSize += b.rings.size();
+		header.pointsSize += b.points.size();
+	}
+	header.stringsSize = strings.size();
+	std::vector<uint64_t> stringOffsets(1, 0);
+	for(const std::string * str : strings) {
+		stringOffsets.push_back(stringOffsets.back() + str->size());
+	}
+	header.stringDataSize = stringOffsets.back();
+
+	std::string tmpFileName = cacheFileName + ".tmp";
+	std::ofstream out(tmpFileName, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		return false;
+	}
+	const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	auto pad = [&out, &zeros](uint64_t size) {
+		out.write(zeros, padded(size)-size);
+	};
+	auto write = [&out, &pad](const void * data, uint64_t size) {
+		out.write((const char*) data, size);
+		pad(size);
+	};
+	write(&header, sizeof(header));
+	write(key.data(), key.size());
+	//entries of the buffers are written one after another, rings and points are rebased to the merged arrays
+	{
+		uint64_t ringsOffset = 0;
+		for(const Buffer & b : m_buffers) {
+			for(std::size_t i(0), s(b.regions.size()); i < s; ++i) {
+				RegionEntry re = b.regions[i];
+				re.ringsBegin += ringsOffset;
+				out.write((const char*) &re, sizeof(re));
+			}
+			ringsOffset += b.rings.size();
+		}
+		pad(header.regionsSize*sizeof(RegionEntry));
+	}
+	{
+		uint64_t pointsOffset = 0;
+		for(const Buffer & b : m_buffers) {
+			for(std::size_t i(0), s(b.rings.size()); i < s; ++i) {
+				RingEntry ring = b.rings[i];
+				ring.pointsBegin += pointsOffset;
+				out.write((const char*) &ring, sizeof(ring));
+			}
+			pointsOffset += b.points.size();
+		}
+		pad(header.ringsSize*sizeof(RingEntry));
+	}
+	for(const Buffer & b : m_buffers) {
+		out.write((const char*) b.points.data(), b.points.size()*sizeof(PointEntry));
+	}
+	pad(header.pointsSize*sizeof(PointEntry));
+	for(std::size_t i(0), s(m_buffers.size()); i < s; ++i) {
+		const Buffer & b = m_buffers[i];
+		for(std::size_t j(0), js(b.values.size()); j < js; ++j) {
+			uint32_t valueId = bufferStringIds[i][b.values[j]];
+			out.write((const char*) &valueId, sizeof(valueId));
+		}
+	}
+	pad(header.regionsSize*header.tagKeysSize*sizeof(uint32_t));
+	write(stringOffsets.data(), stringOffsets.size()*sizeof(uint64_t));
+	for(const std::string * str : strings) {
+		out.write(str->data(), str->size());
+	}
+	out.close();
+	if (!out || ::rename(tmpFileName.c_str(), cacheFileName.c_str()) != 0) {
+		::unlink(tmpFileName.c_str());
+		return false;
+	}
+	return true;
+}
+
+//END: ExtractionCache::Writer
+
+//BEGIN: ExtractionCache
+
+ExtractionCache::ExtractionCache() :
+m_data(0),
+m_dataSize(0),
+m_header(0),
+m_regions(0),
+m_rings(0),
+m_points(0),
+m_values(0),
+m_stringOffsets(0),
+m_stringData(0)
+{}
+
+ExtractionCache::~ExtractionCache() {
+	close();
+}
+
+bool ExtractionCache::open(const std::string & cacheFileName, const Key & key) {
+	using namespace detail::ExtractionCache;
+	close();
+	uint64_t inputSize = 0;
+	int64_t inputMtime = 0;
+	if (!fileIdentity(key.inputFileName, inputSize, inputMtime)) {
+		return false;
+	}
+	int fd = ::open(cacheFileName.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct ::stat st;
+	if (::fstat(fd, &st) != 0 || (std::size_t) st.st_size < sizeof(Header)) {
+		::close(fd);
+		return false;
+	}
+	void * data = ::mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	m_data = (char*) data;
+	m_dataSize = st.st_size;
+	m_header = (const Header*) m_data;
+
+	std::string expectedKey = serializeKey(key);
+	const Header & h = *m_header;
+	if (::memcmp(h.magic, Magic, sizeof(Magic)) != 0 || h.version != Version ||
+		h.inputSize != inputSize || h.inputMtime != inputMtime ||
+		h.tagKeysSize != key.tagKeys.size() || h.keySize != expectedKey.size())
+	{
+		close();
+		return false;
+	}
+	uint64_t offset = padded(sizeof(Header));
+	uint64_t keyOffset = offset;
+	offset += padded(h.keySize);
+	uint64_t regionsOffset = offset;
+	offset += padded(h.regionsSize*sizeof(RegionEntry));
+	uint64_t ringsOffset = offset;
+	offset += padded(h.ringsSize*sizeof(RingEntry));
+	uint64_t pointsOffset = offset;
+	offset += padded(h.pointsSize*sizeof(PointEntry));
+	uint64_t valuesOffset = offset;
+	offset += padded(h.regionsSize*h.tagKeysSize*sizeof(uint32_t));
+	uint64_t stringOffsetsOffset = offset;
+	offset += padded((h.stringsSize+1)*sizeof(uint64_t));
+	uint64_t stringDataOffset = offset;
+	offset += h.stringDataSize;
+	if (offset != m_dataSize || ::memcmp(m_data+keyOffset, expectedKey.data(), expectedKey.size()) != 0) {
+		close();
+		return false;
+	}
+	m_regions = (const RegionEntry*) (m_data+regionsOffset);
+	m_rings = (const RingEntry*) (m_data+ringsOffset);
+	m_points = (const PointEntry*) (m_data+pointsOffset);
+	m_values = (const uint32_t*) (m_data+valuesOffset);
+	m_stringOffsets = (const uint64_t*) (m_data+stringOffsetsOffset);
+	m_stringData = m_data+stringDataOffset;
+	::madvise(m_data, m_dataSize, MADV_SEQUENTIAL);
+	return true;
+}
+
+void ExtractionCache::close() {
+	if (m_data) {
+		::munmap(m_data, m_dataSize);
+	}
+	m_data = 0;
+	m_dataSize = 0;
+	m_header = 0;
+	m_regions = 0;
+	m_rings = 0;
+	m_points = 0;
+	m_values = 0;
+	m_stringOffsets = 0;
+	m_stringData = 0;
+}
+
+std::size_t ExtractionCache::size() const {
+	return (m_header ? m_header->regionsSize : 0);
+}
+
+void ExtractionCache::primitive(std::size_t pos, Primitive & p) const {
+	const RegionEntry & re = m_regions[pos];
+	p.id = re.id;
+	p.type = (osmpbf::PrimitiveType) re.type;
+	p.values.resize(m_header->tagKeysSize);
+	const uint32_t * values = m_values + pos*m_header->tagKeysSize;
+	for(uint32_t i(0), s(m_header->tagKeysSize); i < s; ++i) {
+		p.values[i].assign(m_stringData+m_stringOffsets[values[i]], m_stringData+m_stringOffsets[values[i]+1]);
+	}
+}
+
+sserialize::spatial::GeoRegion * ExtractionCache::region(std::size_t pos) const {
+	const RegionEntry & re = m_regions[pos];
+	auto toPoints = [this](const RingEntry & ring, sserialize::spatial::GeoPolygon::PointsContainer & points) {
+		points.reserve(ring.pointsSize);
+		for(const PointEntry * it(m_points+ring.pointsBegin), * end(it+ring.pointsSize); it != end; ++it) {
+			points.emplace_back(it->lat, it->lon);
+		}
+	};
+	if (!re.multi) {
+		sserialize::spatial::GeoPolygon * gp = new sserialize::spatial::GeoPolygon();
+		toPoints(m_rings[re.ringsBegin], gp->points());
+		gp->recalculateBoundary();
+		return gp;
+	}
+	sserialize::spatial::GeoMultiPolygon * gmp = new sserialize::spatial::GeoMultiPolygon();
+	for(const RingEntry * ring(m_rings+re.ringsBegin), * end(ring+re.ringsSize); ring != end; ++ring) {
+		sserialize::spatial::GeoMultiPolygon::PolygonList & dest = (ring->inner ? gmp->innerPolygons() : gmp->outerPolygons());
+		dest.resize(dest.size()+1);
+		toPoints(*ring, dest.back().points());
+	}
+	gmp->recalculateBoundary();
+	return gmp;
+}
+
+//END: ExtractionCache
+
+}//end namespace osmtools
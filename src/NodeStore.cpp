@@ -0,0 +1,206 @@
+#include <osmtools/NodeStore.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace osmtools {
+
+constexpr uint32_t FixedPointCoord::Null;
+constexpr std::size_t SparseNodeStore::npos;
+constexpr std::size_t SparseNodeStore::NodeBytes;
+constexpr uint32_t DenseNodeStore::LatOffset;
+constexpr uint32_t NodeIdBitmap::PageBits;
+constexpr uint32_t NodeIdBitmap::PageWords;
+
+//BEGIN: SparseNodeStore
+
+SparseNodeStore::SparseNodeStore() {}
+
+SparseNodeStore::~SparseNodeStore() {}
+
+void SparseNodeStore::assign(std::vector<int64_t> && ids) {
+	m_ids = std::move(ids);
+	m_ids.shrink_to_fit();
+	m_lat.assign(m_ids.size(), FixedPointCoord::Null);
+	m_lon.assign(m_ids.size(), FixedPointCoord::Null);
+}
+
+void SparseNodeStore::clear() {
+	m_ids = std::vector<int64_t>();
+	m_lat = std::vector<uint32_t>();
+	m_lon = std::vector<uint32_t>();
+}
+
+void SparseNodeStore::compact() {
+	std::size_t n = 0;
+	for(std::size_t i(0), s(m_ids.size()); i < s; ++i) {
+		if (has(i)) {
+			m_ids[n] = m_ids[i];
+			m_lat[n] = m_lat[i];
+			m_lon[n] = m_lon[i];
+			++n;
+		}
+	}
+	m_ids.resize(n);
+	m_lat.resize(n);
+	m_lon.resize(n);
+	m_ids.shrink_to_fit();
+	m_lat.shrink_to_fit();
+	m_lon.shrink_to_fit();
+}
+
+std::size_t SparseNodeStore::size() const {
+	return m_ids.size();
+}
+
+bool SparseNodeStore::empty() const {
+	return m_ids.empty();
+}
+
+int64_t SparseNodeStore::minId() const {
+	return (m_ids.size() ? m_ids.front() : std::numeric_limits<int64_t>::max());
+}
+
+int64_t SparseNodeStore::maxId() const {
+	return (m_ids.size() ? m_ids.back() : std::numeric_limits<int64_t>::min());
+}
+
+const std::vector<int64_t> & SparseNodeStore::ids() const {
+	return m_ids;
+}
+
+//END: SparseNodeStore
+
+//BEGIN: NodeIdBitmap
+
+NodeIdBitmap::NodeIdBitmap() : m_base(0) {}
+
+NodeIdBitmap::~NodeIdBitmap() {}
+
+void NodeIdBitmap::assign(const std::vector<int64_t> & ids) {
+	clear();
+	if (!ids.size()) {
+		return;
+	}
+	m_base = ids.front();
+	m_pages.resize( (((uint64_t)ids.back() - (uint64_t)m_base) >> PageBits) + 1 );
+	for(int64_t id : ids) {
+		uint64_t off = (uint64_t)id - (uint64_t)m_base;
+		Page & page = m_pages[off >> PageBits];
+		if (!page) {
+			page.reset(new uint64_t[PageWords]);
+			std::fill(page.get(), page.get()+PageWords, uint64_t(0));
+		}
+		page[(off >> 6) & (PageWords-1)] |= uint64_t(1) << (off & 63);
+	}
+}
+
+void NodeIdBitmap::clear() {
+	m_base = 0;
+	m_pages = std::vector<Page>();
+}
+
+std::size_t NodeIdBitmap::storageSize() const {
+	std::size_t result = m_pages.size()*sizeof(Page);
+	for(const Page & page : m_pages) {
+		if (page) {
+			result += PageWords*sizeof(uint64_t);
+		}
+	}
+	return result;
+}
+
+bool NodeIdBitmap::any(int64_t first, int64_t last) const {
+	if (!m_pages.size() || last < m_base || first > last) {
+		return false;
+	}
+	uint64_t begin = (uint64_t)std::max(first, m_base) - (uint64_t)m_base;
+	uint64_t end = std::min<uint64_t>((uint64_t)last - (uint64_t)m_base, (m_pages.size() << PageBits) - 1);
+	for(uint64_t off(begin); off <= end;) {
+		const Page & page = m_pages[off >> PageBits];
+		if (!page) {
+			off = ((off >> PageBits) + 1) << PageBits;
+			continue;
+		}
+		uint64_t word = page[(off >> 6) & (PageWords-1)] >> (off & 63);
+		if (end - off < 63) {
+			word &= (uint64_t(1) << (end - off + 1)) - 1;
+		}
+		if (word) {
+			return true;
+		}
+		off = ((off >> 6) + 1) << 6;
+	}
+	return false;
+}
+
+//END: NodeIdBitmap
+
+//BEGIN: DenseNodeStore
+
+DenseNodeStore::DenseNodeStore() :
+m_data(0),
+m_size(0),
+m_fd(-1)
+{}
+
+DenseNodeStore::~DenseNodeStore() {
+	clear();
+}
+
+bool DenseNodeStore::init(int64_t maxId, const std::string & directory) {
+	clear();
+	if (maxId < 0) {
+		return true;
+	}
+	std::size_t size = (std::size_t) maxId + 1;
+	std::size_t byteSize = size*sizeof(Slot);
+	void * data = MAP_FAILED;
+	if (directory.size()) {
+		std::string fn = directory + "/osmtools_dense_nodes_XXXXXX";
+		std::vector<char> fnBuf(fn.begin(), fn.end());
+		fnBuf.push_back(0);
+		m_fd = ::mkstemp(fnBuf.data());
+		if (m_fd < 0) {
+			return false;
+		}
+		::unlink(fnBuf.data());
+		if (::ftruncate(m_fd, byteSize) != 0) {
+			clear();
+			return false;
+		}
+		data = ::mmap(0, byteSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	}
+	else {
+		data = ::mmap(0, byteSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	}
+	if (data == MAP_FAILED) {
+		clear();
+		return false;
+	}
+	m_data = (Slot*) data;
+	m_size = size;
+	return true;
+}
+
+void DenseNodeStore::clear() {
+	if (m_data) {
+		::munmap(m_data, m_size*sizeof(Slot));
+		m_data = 0;
+	}
+	m_size = 0;
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+std::size_t DenseNodeStore::size() const {
+	return m_size;
+}
+
+//END: DenseNodeStore
+
+}//end namespace osmtools
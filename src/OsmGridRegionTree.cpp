@@ -1,7 +1,15 @@
 #include <osmtools/OsmGridRegionTree.h>
+#include <sserialize/mt/ThreadPool.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cmath>
 
 namespace osmtools {
 
+constexpr uint32_t OsmGridRegionTreeBase::NoCell;
+constexpr double OsmGridRegionTreeBase::CellMargin;
+
 OsmGridRegionTreeBase::FixedSizeDiagRefiner::FixedSizeDiagRefiner(double minDiag, uint32_t latCount, uint32_t lonCount) :
 m_dc( std::shared_ptr<sserialize::spatial::detail::DistanceCalculator>(new sserialize::spatial::detail::GeodesicDistanceCalculator()) ),
 m_minDiag(minDiag),
@@ -29,6 +37,119 @@ bool OsmGridRegionTreeBase::FixedSizeDiagRefiner::operator()(
 	return false;
 }
 
+//BEGIN: OsmGridRegionTreeBase::RegionWriter
+
+OsmGridRegionTreeBase::StorageSegment::StorageSegment() :
+points(sserialize::MM_SHARED_MEMORY),
+polygons(sserialize::MM_SHARED_MEMORY)
+{}
+
+OsmGridRegionTreeBase::RegionWriter::RegionWriter(OsmGridRegionTreeBase * tree) :
+m_tree(tree),
+m_seg(0),
+m_ringBegin(0)
+{}
+
+OsmGridRegionTreeBase::RegionWriter::~RegionWriter() {}
+
+void OsmGridRegionTreeBase::RegionWriter::createSegment() {
+	std::lock_guard<std::mutex> lck(m_tree->m_segmentsLock);
+	m_tree->m_segments.emplace_back();
+	m_seg = &(m_tree->m_segments.back());
+}
+
+void OsmGridRegionTreeBase::RegionWriter::endRing(bool inner) {
+	if (!m_seg) {
+		return;
+	}
+	sserialize::OffsetType ringEnd = m_seg->points.size();
+	if (ringEnd > m_ringBegin) {
+		m_rings.push_back(Ring{m_ringBegin, (uint32_t)(ringEnd - m_ringBegin), inner});
+	}
+	m_ringBegin = ringEnd;
+}
+
+void OsmGridRegionTreeBase::RegionWriter::dropRing() {
+	if (m_seg) {
+		m_seg->points.resize(m_ringBegin);
+	}
+}
+
+void OsmGridRegionTreeBase::RegionWriter::dropRegion() {
+	if (m_rings.size()) {
+		m_ringBegin = m_rings.front().begin;
+		m_rings.clear();
+	}
+	dropRing();
+}
+
+bool OsmGridRegionTreeBase::RegionWriter::endRegion() {
+	uint32_t outerSize = 0;
+	uint32_t pointsSize = 0;
+	for(const Ring & ring : m_rings) {
+		outerSize += (ring.inner ? 0 : 1);
+		pointsSize += ring.size;
+	}
+	if (!outerSize) {
+		dropRegion();
+		return false;
+	}
+	sserialize::spatial::GeoRegion * r = 0;
+	if (m_rings.size() == 1) {
+		m_seg->polygonRegions.emplace_back(PolygonPointsContainer(&(m_seg->points), m_rings.front().begin, m_rings.front().size));
+		r = &(m_seg->polygonRegions.back());
+	}
+	else {
+		//outer rings first
+		sserialize::OffsetType outerBegin = m_seg->polygons.size();
+		for(int inner(0); inner < 2; ++inner) {
+			for(const Ring & ring : m_rings) {
+				if (ring.inner == (inner == 1)) {
+					m_seg->polygons.emplace_back(PolygonPointsContainer(&(m_seg->points), ring.begin, ring.size));
+					m_seg->polygons.back().recalculateBoundary();
+				}
+			}
+		}
+		sserialize::OffsetType innerBegin = outerBegin + outerSize;
+		m_seg->multiPolygonRegions.emplace_back(pointsSize,
+			osmtools::OsmGeoMultiPolygon::PolygonList(&(m_seg->polygons), outerBegin, outerSize),
+			osmtools::OsmGeoMultiPolygon::PolygonList(&(m_seg->polygons), innerBegin, (uint32_t) m_rings.size()-outerSize),
+			sserialize::spatial::GeoRect(),
+			sserialize::spatial::GeoRect()
+		);
+		r = &(m_seg->multiPolygonRegions.back());
+	}
+	r->recalculateBoundary();
+	m_pending.push_back(r);
+	m_rings.clear();
+	return true;
+}
+
+void OsmGridRegionTreeBase::RegionWriter::flushRegions() {
+	m_tree->m_regions.insert(m_tree->m_regions.end(), m_pending.begin(), m_pending.end());
+	m_pending.clear();
+}
+
+std::size_t OsmGridRegionTreeBase::RegionWriter::pendingSize() const {
+	return m_pending.size();
+}
+
+//END: OsmGridRegionTreeBase::RegionWriter
+
+//BEGIN: OsmGridRegionTreeBase::BatchQuery
+
+OsmGridRegionTreeBase::BatchQuery::BatchQuery() :
+m_offsets(1, 0)
+{}
+
+OsmGridRegionTreeBase::BatchQuery::~BatchQuery() {}
+
+std::size_t OsmGridRegionTreeBase::BatchQuery::size() const {
+	return m_offsets.size()-1;
+}
+
+//END: OsmGridRegionTreeBase::BatchQuery
+
 //BEGIN: OsmGridRegionTreeBase
 
 void OsmGridRegionTreeBase::push_back(const sserialize::spatial::GeoRegion * p) {
@@ -64,39 +185,247 @@ void OsmGridRegionTreeBase::push_back(const sserialize::spatial::GeoRegion * p)
 	r->recalculateBoundary();
 	SSERIALIZE_CHEAP_ASSERT_EQUAL(r->size(), p->size());
 	m_regions.push_back(r);
+	m_allocatedRegions.push_back(r);
 }
 
+void OsmGridRegionTreeBase::push_back(const std::vector<const sserialize::spatial::GeoRegion*> & regions, uint32_t threadCount) {
+	RegionsContainer converted;
+	convertRegions(regions, threadCount, converted);
+	appendRegions(converted);
+}
+
+void OsmGridRegionTreeBase::convertRegions(const std::vector<const sserialize::spatial::GeoRegion*> & regions, uint32_t threadCount, RegionsContainer & dest) {
+	if (!threadCount) {
+		threadCount = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	dest.assign(regions.size(), 0);
+	if (!regions.size()) {
+		return;
+	}
+	
+	enum RegionKind : uint8_t { RK_INVALID, RK_GP, RK_OSM_GP, RK_GMP, RK_OSM_GMP };
+	
+	struct Slot {
+		RegionKind kind;
+		uint32_t pointsSize;
+		uint32_t polygonsSize;
+	};
+	
+	//ranges of a chunk of regions, reserved with a fetch-add on the totals
+	struct ChunkRanges {
+		sserialize::OffsetType pointsBegin;
+		sserialize::OffsetType polygonsBegin;
+		std::size_t polygonRegionsBegin;
+		std::size_t multiPolygonRegionsBegin;
+	};
+	
+	static constexpr std::size_t ChunkSize = 1024;
+	
+	struct WorkContext {
+		const std::vector<const sserialize::spatial::GeoRegion*> * regions;
+		RegionsContainer * dest;
+		StorageSegment * seg;
+		std::vector<Slot> slots;
+		std::vector<ChunkRanges> chunks;
+		std::atomic<std::size_t> nextChunk{0};
+		std::atomic<sserialize::OffsetType> pointsSize{0};
+		std::atomic<sserialize::OffsetType> polygonsSize{0};
+		std::atomic<std::size_t> polygonRegionsSize{0};
+		std::atomic<std::size_t> multiPolygonRegionsSize{0};
+		std::atomic<bool> invalid{false};
+	};
+	
+	//classify the regions and reserve the storage of every chunk (phase 0) or convert them into the reserved storage (phase 1)
+	struct Worker {
+		WorkContext * ctx;
+		int phase;
+		Worker(WorkContext * ctx, int phase) : ctx(ctx), phase(phase) {}
+		Worker(const Worker & other) : ctx(other.ctx), phase(other.phase) {}
+		void classify(const sserialize::spatial::GeoRegion * p, Slot & slot) {
+			slot.kind = RK_INVALID;
+			slot.pointsSize = 0;
+			slot.polygonsSize = 0;
+			switch (p->type()) {
+			case sserialize::spatial::GS_POLYGON:
+				if (dynamic_cast<const sserialize::spatial::GeoPolygon*>(p)) {
+					slot.kind = RK_GP;
+					slot.pointsSize = ConvertGP<sserialize::spatial::GeoPolygon>::pointsSize(p);
+				}
+				else if (dynamic_cast<const osmtools::OsmGeoPolygon*>(p)) {
+					slot.kind = RK_OSM_GP;
+					slot.pointsSize = ConvertGP<osmtools::OsmGeoPolygon>::pointsSize(p);
+				}
+				break;
+			case sserialize::spatial::GS_MULTI_POLYGON:
+				if (dynamic_cast<const sserialize::spatial::GeoMultiPolygon*>(p)) {
+					slot.kind = RK_GMP;
+					slot.pointsSize = ConvertGMP<sserialize::spatial::GeoMultiPolygon>::pointsSize(p);
+					slot.polygonsSize = ConvertGMP<sserialize::spatial::GeoMultiPolygon>::polygonsSize(p);
+				}
+				else if (dynamic_cast<const osmtools::OsmGeoMultiPolygon*>(p)) {
+					slot.kind = RK_OSM_GMP;
+					slot.pointsSize = ConvertGMP<osmtools::OsmGeoMultiPolygon>::pointsSize(p);
+					slot.polygonsSize = ConvertGMP<osmtools::OsmGeoMultiPolygon>::polygonsSize(p);
+				}
+				break;
+			default:
+				break;
+			}
+		}
+		void reserve(std::size_t begin, std::size_t end, ChunkRanges & ranges) {
+			sserialize::OffsetType pointsSize = 0;
+			sserialize::OffsetType polygonsSize = 0;
+			std::size_t polygonRegionsSize = 0;
+			std::size_t multiPolygonRegionsSize = 0;
+			for(std::size_t i(begin); i < end; ++i) {
+				Slot & slot = ctx->slots[i];
+				classify((*(ctx->regions))[i], slot);
+				pointsSize += slot.pointsSize;
+				polygonsSize += slot.polygonsSize;
+				if (slot.kind == RK_GP || slot.kind == RK_OSM_GP) {
+					++polygonRegionsSize;
+				}
+				else if (slot.kind == RK_GMP || slot.kind == RK_OSM_GMP) {
+					++multiPolygonRegionsSize;
+				}
+				else {
+					ctx->invalid = true;
+				}
+			}
+			ranges.pointsBegin = ctx->pointsSize.fetch_add(pointsSize, std::memory_order_relaxed);
+			ranges.polygonsBegin = ctx->polygonsSize.fetch_add(polygonsSize, std::memory_order_relaxed);
+			ranges.polygonRegionsBegin = ctx->polygonRegionsSize.fetch_add(polygonRegionsSize, std::memory_order_relaxed);
+			ranges.multiPolygonRegionsBegin = ctx->multiPolygonRegionsSize.fetch_add(multiPolygonRegionsSize, std::memory_order_relaxed);
+		}
+		void convert(std::size_t begin, std::size_t end, ChunkRanges ranges) {
+			StorageSegment & seg = *(ctx->seg);
+			for(std::size_t i(begin); i < end; ++i) {
+				const Slot & slot = ctx->slots[i];
+				const sserialize::spatial::GeoRegion * p = (*(ctx->regions))[i];
+				sserialize::spatial::GeoRegion * r = 0;
+				if (slot.kind == RK_GP || slot.kind == RK_OSM_GP) {
+					osmtools::OsmGeoPolygon & gp = seg.polygonRegions[ranges.polygonRegionsBegin];
+					if (slot.kind == RK_GP) {
+						ConvertGP<sserialize::spatial::GeoPolygon>::conv(seg.points, ranges.pointsBegin, p, gp);
+					}
+					else {
+						ConvertGP<osmtools::OsmGeoPolygon>::conv(seg.points, ranges.pointsBegin, p, gp);
+					}
+					r = &gp;
+					++ranges.polygonRegionsBegin;
+				}
+				else {
+					osmtools::OsmGeoMultiPolygon & gmp = seg.multiPolygonRegions[ranges.multiPolygonRegionsBegin];
+					if (slot.kind == RK_GMP) {
+						ConvertGMP<sserialize::spatial::GeoMultiPolygon>::conv(seg.points, ranges.pointsBegin, seg.polygons, ranges.polygonsBegin, p, gmp);
+					}
+					else {
+						ConvertGMP<osmtools::OsmGeoMultiPolygon>::conv(seg.points, ranges.pointsBegin, seg.polygons, ranges.polygonsBegin, p, gmp);
+					}
+					r = &gmp;
+					++ranges.multiPolygonRegionsBegin;
+				}
+				ranges.pointsBegin += slot.pointsSize;
+				ranges.polygonsBegin += slot.polygonsSize;
+				SSERIALIZE_CHEAP_ASSERT_EQUAL(r->size(), p->size());
+				r->recalculateBoundary();
+				(*(ctx->dest))[i] = r;
+			}
+		}
+		void operator()() {
+			const std::size_t regionsSize = ctx->regions->size();
+			while (true) {
+				std::size_t chunkId = ctx->nextChunk.fetch_add(1, std::memory_order_relaxed);
+				if (chunkId >= ctx->chunks.size()) {
+					return;
+				}
+				std::size_t begin = chunkId*ChunkSize;
+				std::size_t end = std::min(regionsSize, begin+ChunkSize);
+				if (phase == 0) {
+					reserve(begin, end, ctx->chunks[chunkId]);
+				}
+				else {
+					convert(begin, end, ctx->chunks[chunkId]);
+				}
+			}
+		}
+	};
+	
+	WorkContext wctx;
+	wctx.regions = &regions;
+	wctx.dest = &dest;
+	wctx.slots.resize(regions.size());
+	wctx.chunks.resize((regions.size() + ChunkSize - 1)/ChunkSize);
+	threadCount = std::min<uint32_t>(threadCount, wctx.chunks.size());
+	sserialize::ThreadPool::execute(Worker(&wctx, 0), threadCount, sserialize::ThreadPool::CopyTaskTag());
+	
+	if (wctx.invalid) {
+		dest.clear();
+		throw sserialize::TypeMissMatchException("OsmGridRegionTree");
+	}
+	
+	{
+		std::lock_guard<std::mutex> lck(m_segmentsLock);
+		m_segments.emplace_back();
+		wctx.seg = &(m_segments.back());
+	}
+	wctx.seg->points.resize(wctx.pointsSize);
+	wctx.seg->polygons.resize(wctx.polygonsSize);
+	wctx.seg->polygonRegions.resize(wctx.polygonRegionsSize);
+	wctx.seg->multiPolygonRegions.resize(wctx.multiPolygonRegionsSize);
+	
+	wctx.nextChunk = 0;
+	sserialize::ThreadPool::execute(Worker(&wctx, 1), threadCount, sserialize::ThreadPool::CopyTaskTag());
+}
+
+void OsmGridRegionTreeBase::appendRegions(const RegionsContainer & regions) {
+	m_regions.insert(m_regions.end(), regions.begin(), regions.end());
+}
 
-OsmGridRegionTreeBase::OsmGridRegionTreeBase() : m_polygonPoints(sserialize::MM_SHARED_MEMORY), m_polygonsContainer(sserialize::MM_SHARED_MEMORY), m_latRefineCount(2), m_lonRefineCount(2), m_refineMinDiag(250) {}
+
+OsmGridRegionTreeBase::OsmGridRegionTreeBase() : m_rasterLatCount(0), m_rasterLonCount(0), m_rasterLatStep(0), m_rasterLonStep(0), m_polygonPoints(sserialize::MM_SHARED_MEMORY), m_polygonsContainer(sserialize::MM_SHARED_MEMORY), m_latRefineCount(2), m_lonRefineCount(2), m_refineMinDiag(250) {}
 
 OsmGridRegionTreeBase::~OsmGridRegionTreeBase() {
-	for(std::vector<sserialize::spatial::GeoRegion*>::iterator it(m_regions.begin()), end(m_regions.end()); it != end; ++it) {
+	for(std::vector<sserialize::spatial::GeoRegion*>::iterator it(m_allocatedRegions.begin()), end(m_allocatedRegions.end()); it != end; ++it) {
 		delete *it;
 	}
 }
 
-const sserialize::spatial::GridRegionTree & OsmGridRegionTreeBase::grt() const {
-	return m_grt;
-}
-
 void OsmGridRegionTreeBase::clearGRT() {
+	m_rasterBounds = sserialize::spatial::GeoRect();
+	m_rasterLatCount = 0;
+	m_rasterLonCount = 0;
+	m_rasterLatStep = 0;
+	m_rasterLonStep = 0;
 	m_grt = sserialize::spatial::GridRegionTree();
+	m_cellTrees = std::vector<sserialize::spatial::GridRegionTree>();
+	m_cellRegionsOffsets = std::vector<uint32_t>();
+	m_cellRegions = std::vector<uint32_t>();
+	m_cellRegionPtrs = RegionsContainer();
+	m_rasterStats = RasterStats();
 }
 
 void OsmGridRegionTreeBase::clear() {
 	clearGRT();
 	m_polygonPoints = PointDataContainer();
 	m_polygonsContainer = PolygonsContainer();
-	for(std::vector<sserialize::spatial::GeoRegion*>::iterator it(m_regions.begin()), end(m_regions.end()); it != end; ++it) {
+	for(std::vector<sserialize::spatial::GeoRegion*>::iterator it(m_allocatedRegions.begin()), end(m_allocatedRegions.end()); it != end; ++it) {
 		delete *it;
 	}
+	m_allocatedRegions = RegionsContainer();
 	m_regions = RegionsContainer();
+	m_segments.clear();
 }
 
 void OsmGridRegionTreeBase::snapPoints() {
-	for(Point & p : m_polygonPoints) {
+	for(auto & p : m_polygonPoints) {
 		p.snap();
 	}
+	for(StorageSegment & seg : m_segments) {
+		for(auto & p : seg.points) {
+			p.snap();
+		}
+	}
 	for(auto & r : regions()) {
 		r->recalculateBoundary();
 	}
@@ -104,12 +433,43 @@ void OsmGridRegionTreeBase::snapPoints() {
 
 void OsmGridRegionTreeBase::printStats(std::ostream & out) {
 	out << "OsmGridRegionTree::printStats--BEGIN\n";
-	m_grt.printStats(out);
-	std::cout << "#points: " << m_polygonPoints.size() << "=" << sserialize::prettyFormatSize(m_polygonPoints.size()*sizeof(PolygonPointsContainer::value_type)) << "\n";
-	std::cout << "#GeoMultiPolygons: " << m_polygonsContainer.size() << "=" << sserialize::prettyFormatSize(m_polygonsContainer.size()*sizeof(PolygonsContainer::value_type)) << "\n";
+	std::size_t nonEmptyCells = 0;
+	for(std::size_t i(1), s(m_cellRegionsOffsets.size()); i < s; ++i) {
+		nonEmptyCells += (m_cellRegionsOffsets[i] > m_cellRegionsOffsets[i-1] ? 1 : 0);
+	}
+	out << "#raster cells: " << m_cellTrees.size() << " (" << nonEmptyCells << " non-empty)\n";
+	out << "#cell regions: " << m_cellRegions.size() << "\n";
+	if (!m_cellTrees.size()) {
+		m_grt.printStats(out);
+	}
+	if (m_rasterStats.latCount) {
+		out << "Root grid " << m_rasterStats.latCount << "x" << m_rasterStats.lonCount << " (" << m_rasterStats.threadCount << " threads)\n";
+		out << "Level 0 took " << m_rasterStats.level0Time/1000 << " ms\n";
+		out << "Levels 1+ took " << m_rasterStats.levelsTime/1000 << " ms";
+		if (m_cellTrees.size()) {
+			out << " for " << m_rasterStats.cellTrees << " cell trees, cpu time " << m_rasterStats.cellsTime/1000 << " ms, slowest cell " << m_rasterStats.maxCellTime/1000 << " ms";
+		}
+		out << "\n";
+	}
+	std::size_t pointsSize = m_polygonPoints.size();
+	std::size_t polygonsSize = m_polygonsContainer.size();
+	for(const StorageSegment & seg : m_segments) {
+		pointsSize += seg.points.size();
+		polygonsSize += seg.polygons.size();
+	}
+	out << "#points: " << pointsSize << "=" << sserialize::prettyFormatSize(pointsSize*sizeof(PolygonPointsContainer::value_type)) << "\n";
+	out << "#GeoMultiPolygons: " << polygonsSize << "=" << sserialize::prettyFormatSize(polygonsSize*sizeof(PolygonsContainer::value_type)) << "\n";
 	out << "OsmGridRegionTree::printStats--END\n";
 }
 
+const sserialize::spatial::GridRegionTree & OsmGridRegionTreeBase::grt() const {
+	return m_grt;
+}
+
+const OsmGridRegionTreeBase::RasterStats & OsmGridRegionTreeBase::rasterStats() const {
+	return m_rasterStats;
+}
+
 std::size_t OsmGridRegionTreeBase::size() const {
 	return regions().size();
 }
@@ -128,15 +488,346 @@ void OsmGridRegionTreeBase::setRefinerOptions(uint32_t latRefineCount, uint32_t
 	m_lonRefineCount = lonRefineCount;
 	m_refineMinDiag = minDiag;
 }
+uint32_t OsmGridRegionTreeBase::rasterCell(const Point & p) const {
+	if (!m_cellTrees.size()) {
+		return NoCell;
+	}
+	double latPos = (p.lat() - m_rasterBounds.minLat())/m_rasterLatStep;
+	double lonPos = (p.lon() - m_rasterBounds.minLon())/m_rasterLonStep;
+	if (!(latPos >= 0 && lonPos >= 0 && latPos <= m_rasterLatCount && lonPos <= m_rasterLonCount)) {
+		return NoCell;
+	}
+	uint32_t latCell = std::min<uint32_t>(latPos, m_rasterLatCount-1);
+	uint32_t lonCell = std::min<uint32_t>(lonPos, m_rasterLonCount-1);
+	uint32_t cell = latCell*m_rasterLonCount + lonCell;
+	//cells without regions have no tree
+	return (m_cellRegionsOffsets[cell+1] > m_cellRegionsOffsets[cell] ? cell : NoCell);
+}
+
 ///you can still add more regions after calling this but they will not be part of the tree
 ///if you want them in the tree aswell then you should call this again (which will rebuild the tree)
-void OsmGridRegionTreeBase::addPolygonsToRaster(unsigned int gridLatCount, unsigned int gridLonCount) {
-	FixedSizeDiagRefiner refiner(m_refineMinDiag, m_latRefineCount, m_lonRefineCount);
-	sserialize::spatial::GeoRect initRect( sserialize::spatial::GeoShape::bounds(m_regions.cbegin(), m_regions.cend()) );
-	sserialize::spatial::GeoGrid initGrid(initRect, gridLatCount, gridLonCount);
+void OsmGridRegionTreeBase::addPolygonsToRaster(unsigned int gridLatCount, unsigned int gridLonCount, uint32_t threadCount) {
+	typedef std::chrono::steady_clock Clock;
 	typedef sserialize::spatial::GridRegionTree::TypeTraits<FixedSizeDiagRefiner, osmtools::OsmGeoPolygon, osmtools::OsmGeoMultiPolygon> MyTypeTraits;
-	m_grt = sserialize::spatial::GridRegionTree(initGrid, m_regions.begin(), m_regions.end(), MyTypeTraits(), refiner);
-	m_grt.shrink_to_fit();
+	
+	if (!threadCount) {
+		threadCount = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	clearGRT();
+	if (!m_regions.size() || !gridLatCount || !gridLonCount) {
+		return;
+	}
+	m_rasterStats.latCount = gridLatCount;
+	m_rasterStats.lonCount = gridLonCount;
+	m_rasterStats.threadCount = threadCount;
+	
+	if (threadCount == 1) {
+		Clock::time_point start = Clock::now();
+		FixedSizeDiagRefiner refiner(m_refineMinDiag, m_latRefineCount, m_lonRefineCount);
+		sserialize::spatial::GeoRect initRect( sserialize::spatial::GeoShape::bounds(m_regions.cbegin(), m_regions.cend()) );
+		sserialize::spatial::GeoGrid initGrid(initRect, gridLatCount, gridLonCount);
+		m_grt = sserialize::spatial::GridRegionTree(initGrid, m_regions.begin(), m_regions.end(), MyTypeTraits(), refiner);
+		m_grt.shrink_to_fit();
+		m_rasterStats.levelsTime = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+		return;
+	}
+	
+	static constexpr std::size_t ChunkSize = 1024;
+	
+	struct WorkContext {
+		OsmGridRegionTreeBase * tree;
+		//level 0: (cell, region id) pairs of every task
+		std::deque< std::vector< std::pair<uint32_t, uint32_t> > > cellRegionBuffers;
+		std::mutex cellRegionBuffersLock;
+		std::atomic<std::size_t> nextChunk{0};
+		//level 1: cells ordered by descending number of regions
+		std::vector<uint32_t> cellOrder;
+		std::atomic<std::size_t> nextCell{0};
+		std::atomic<uint64_t> cellsTime{0};
+		std::atomic<uint64_t> maxCellTime{0};
+	};
+	
+	//assign regions to the raster cells overlapping their boundary (phase 0) or build the trees of the cells (phase 1)
+	struct Worker {
+		WorkContext * ctx;
+		int phase;
+		Worker(WorkContext * ctx, int phase) : ctx(ctx), phase(phase) {}
+		Worker(const Worker & other) : ctx(other.ctx), phase(other.phase) {}
+		uint32_t cellRange(double begin, double step, uint32_t count) {
+			return (uint32_t) std::min<double>(std::max<double>(std::floor(begin/step), 0), count-1);
+		}
+		void assignRegions() {
+			OsmGridRegionTreeBase & tree = *(ctx->tree);
+			const sserialize::spatial::GeoRect & bounds = tree.m_rasterBounds;
+			std::vector< std::pair<uint32_t, uint32_t> > * buffer;
+			{
+				std::lock_guard<std::mutex> lck(ctx->cellRegionBuffersLock);
+				ctx->cellRegionBuffers.emplace_back();
+				buffer = &(ctx->cellRegionBuffers.back());
+			}
+			while (true) {
+				std::size_t chunkId = ctx->nextChunk.fetch_add(1, std::memory_order_relaxed);
+				std::size_t begin = chunkId*ChunkSize;
+				if (begin >= tree.m_regions.size()) {
+					return;
+				}
+				std::size_t end = std::min(tree.m_regions.size(), begin+ChunkSize);
+				for(std::size_t regionId(begin); regionId < end; ++regionId) {
+					sserialize::spatial::GeoRect rb(tree.m_regions[regionId]->boundary());
+					uint32_t latBegin = cellRange(rb.minLat() - CellMargin - bounds.minLat(), tree.m_rasterLatStep, tree.m_rasterLatCount);
+					uint32_t latEnd = cellRange(rb.maxLat() + CellMargin - bounds.minLat(), tree.m_rasterLatStep, tree.m_rasterLatCount);
+					uint32_t lonBegin = cellRange(rb.minLon() - CellMargin - bounds.minLon(), tree.m_rasterLonStep, tree.m_rasterLonCount);
+					uint32_t lonEnd = cellRange(rb.maxLon() + CellMargin - bounds.minLon(), tree.m_rasterLonStep, tree.m_rasterLonCount);
+					for(uint32_t latCell(latBegin); latCell <= latEnd; ++latCell) {
+						for(uint32_t lonCell(lonBegin); lonCell <= lonEnd; ++lonCell) {
+							buffer->emplace_back(latCell*tree.m_rasterLonCount + lonCell, (uint32_t) regionId);
+						}
+					}
+				}
+			}
+		}
+		void buildTrees() {
+			OsmGridRegionTreeBase & tree = *(ctx->tree);
+			FixedSizeDiagRefiner refiner(tree.m_refineMinDiag, tree.m_latRefineCount, tree.m_lonRefineCount);
+			while (true) {
+				std::size_t i = ctx->nextCell.fetch_add(1, std::memory_order_relaxed);
+				if (i >= ctx->cellOrder.size()) {
+					return;
+				}
+				Clock::time_point start = Clock::now();
+				uint32_t cell = ctx->cellOrder[i];
+				uint32_t latCell = cell / tree.m_rasterLonCount;
+				uint32_t lonCell = cell % tree.m_rasterLonCount;
+				uint32_t * idsBegin = tree.m_cellRegions.data() + tree.m_cellRegionsOffsets[cell];
+				uint32_t * idsEnd = tree.m_cellRegions.data() + tree.m_cellRegionsOffsets[cell+1];
+				//regions of a cell keep the order of their ids
+				std::sort(idsBegin, idsEnd);
+				RegionsContainer::iterator ptrsBegin = tree.m_cellRegionPtrs.begin() + tree.m_cellRegionsOffsets[cell];
+				for(uint32_t * it(idsBegin); it != idsEnd; ++it) {
+					ptrsBegin[it-idsBegin] = tree.m_regions[*it];
+				}
+				double minLat = tree.m_rasterBounds.minLat() + latCell*tree.m_rasterLatStep;
+				double minLon = tree.m_rasterBounds.minLon() + lonCell*tree.m_rasterLonStep;
+				sserialize::spatial::GeoRect cellRect(minLat - CellMargin, minLat + tree.m_rasterLatStep + CellMargin, minLon - CellMargin, minLon + tree.m_rasterLonStep + CellMargin);
+				tree.m_cellTrees[cell] = sserialize::spatial::GridRegionTree(sserialize::spatial::GeoGrid(cellRect, 1, 1), ptrsBegin, ptrsBegin+(idsEnd-idsBegin), MyTypeTraits(), refiner);
+				tree.m_cellTrees[cell].shrink_to_fit();
+				uint64_t t = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+				ctx->cellsTime += t;
+				uint64_t maxT = ctx->maxCellTime;
+				while (maxT < t && !ctx->maxCellTime.compare_exchange_weak(maxT, t)) {}
+			}
+		}
+		void operator()() {
+			if (phase == 0) {
+				assignRegions();
+			}
+			else {
+				buildTrees();
+			}
+		}
+	};
+	
+	Clock::time_point start = Clock::now();
+	m_rasterBounds = sserialize::spatial::GeoShape::bounds(m_regions.cbegin(), m_regions.cend());
+	m_rasterLatCount = gridLatCount;
+	m_rasterLonCount = gridLonCount;
+	//degenerate bounds still need a valid cell size
+	m_rasterLatStep = std::max(m_rasterBounds.lengthLat()/gridLatCount, CellMargin);
+	m_rasterLonStep = std::max(m_rasterBounds.lengthLon()/gridLonCount, CellMargin);
+	const uint32_t cellCount = gridLatCount*gridLonCount;
+	
+	WorkContext wctx;
+	wctx.tree = this;
+	sserialize::ThreadPool::execute(Worker(&wctx, 0), std::min<uint32_t>(threadCount, (m_regions.size() + ChunkSize - 1)/ChunkSize), sserialize::ThreadPool::CopyTaskTag());
+	
+	//concatenate the buffers of the tasks
+	m_cellRegionsOffsets.assign(cellCount+1, 0);
+	for(const std::vector< std::pair<uint32_t, uint32_t> > & buffer : wctx.cellRegionBuffers) {
+		for(const std::pair<uint32_t, uint32_t> & x : buffer) {
+			++m_cellRegionsOffsets[x.first+1];
+		}
+	}
+	for(uint32_t i(1); i <= cellCount; ++i) {
+		m_cellRegionsOffsets[i] += m_cellRegionsOffsets[i-1];
+	}
+	m_cellRegions.resize(m_cellRegionsOffsets.back());
+	{
+		std::vector<uint32_t> cellEnd(m_cellRegionsOffsets.begin(), m_cellRegionsOffsets.end()-1);
+		for(std::vector< std::pair<uint32_t, uint32_t> > & buffer : wctx.cellRegionBuffers) {
+			for(const std::pair<uint32_t, uint32_t> & x : buffer) {
+				m_cellRegions[cellEnd[x.first]] = x.second;
+				++cellEnd[x.first];
+			}
+			buffer = std::vector< std::pair<uint32_t, uint32_t> >();
+		}
+	}
+	m_cellRegionPtrs.resize(m_cellRegions.size());
+	m_cellTrees.resize(cellCount);
+	uint64_t assignTime = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+	
+	start = Clock::now();
+	for(uint32_t cell(0); cell < cellCount; ++cell) {
+		if (m_cellRegionsOffsets[cell+1] > m_cellRegionsOffsets[cell]) {
+			wctx.cellOrder.push_back(cell);
+		}
+	}
+	std::sort(wctx.cellOrder.begin(), wctx.cellOrder.end(), [this](uint32_t a, uint32_t b) {
+		return m_cellRegionsOffsets[a+1] - m_cellRegionsOffsets[a] > m_cellRegionsOffsets[b+1] - m_cellRegionsOffsets[b];
+	});
+	sserialize::ThreadPool::execute(Worker(&wctx, 1), std::max<uint32_t>(std::min<uint32_t>(threadCount, wctx.cellOrder.size()), 1), sserialize::ThreadPool::CopyTaskTag());
+	uint64_t buildTime = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+	
+	m_rasterStats.cellRegions = m_cellRegions.size();
+	m_rasterStats.cellTrees = (uint32_t) wctx.cellOrder.size();
+	m_rasterStats.level0Time = assignTime;
+	m_rasterStats.levelsTime = buildTime;
+	m_rasterStats.cellsTime = wctx.cellsTime;
+	m_rasterStats.maxCellTime = wctx.maxCellTime;
+}
+
+void OsmGridRegionTreeBase::find(const Point * points, std::size_t pointsSize, BatchQuery & query, uint32_t threadCount) const {
+	if (!threadCount) {
+		threadCount = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	
+	static constexpr std::size_t ChunkSize = 4096;
+	
+	struct WorkContext {
+		const OsmGridRegionTreeBase * tree;
+		const Point * points;
+		std::size_t pointsSize;
+		BatchQuery * query;
+		std::atomic<std::size_t> nextChunk{0};
+		std::atomic<std::size_t> nextScratch{0};
+	};
+	
+	//compute the cells of the points (phase 0), find the regions of the points in cell order (phase 1)
+	//or copy the regions from the scratch buffers to the result (phase 2)
+	struct Worker {
+		WorkContext * ctx;
+		int phase;
+		Worker(WorkContext * ctx, int phase) : ctx(ctx), phase(phase) {}
+		Worker(const Worker & other) : ctx(other.ctx), phase(other.phase) {}
+		void cells() {
+			BatchQuery & q = *(ctx->query);
+			while (true) {
+				std::size_t begin = ctx->nextChunk.fetch_add(1, std::memory_order_relaxed)*ChunkSize;
+				if (begin >= ctx->pointsSize) {
+					return;
+				}
+				std::size_t end = std::min(ctx->pointsSize, begin+ChunkSize);
+				//a single tree is one cell
+				if (!ctx->tree->m_cellTrees.size()) {
+					std::fill(q.m_cells.begin()+begin, q.m_cells.begin()+end, 0);
+					continue;
+				}
+				for(std::size_t i(begin); i < end; ++i) {
+					q.m_cells[i] = ctx->tree->rasterCell(ctx->points[i]);
+				}
+			}
+		}
+		void regions(BatchQuery::Scratch & scratch) {
+			BatchQuery & q = *(ctx->query);
+			//points without cell are at the end of the order
+			const std::size_t orderSize = q.m_cellOffsets.back();
+			scratch.points.clear();
+			scratch.regionIds.clear();
+			std::back_insert_iterator< std::vector<uint32_t> > inserter(scratch.regionIds);
+			while (true) {
+				std::size_t begin = ctx->nextChunk.fetch_add(1, std::memory_order_relaxed)*ChunkSize;
+				if (begin >= orderSize) {
+					return;
+				}
+				std::size_t end = std::min(orderSize, begin+ChunkSize);
+				for(std::size_t i(begin); i < end; ++i) {
+					std::size_t pointId = q.m_order[i];
+					std::size_t regionsBegin = scratch.regionIds.size();
+					ctx->tree->find(ctx->points[pointId], inserter);
+					std::sort(scratch.regionIds.begin()+regionsBegin, scratch.regionIds.end());
+					scratch.points.push_back(pointId);
+					q.m_offsets[pointId+1] = scratch.regionIds.size() - regionsBegin;
+				}
+			}
+		}
+		void copy(const BatchQuery::Scratch & scratch) {
+			BatchQuery & q = *(ctx->query);
+			std::vector<uint32_t>::const_iterator it(scratch.regionIds.cbegin());
+			for(std::size_t pointId : scratch.points) {
+				std::size_t size = q.m_offsets[pointId+1] - q.m_offsets[pointId];
+				std::copy(it, it+size, q.m_regionIds.begin()+q.m_offsets[pointId]);
+				it += size;
+			}
+		}
+		void operator()() {
+			if (phase == 0) {
+				cells();
+				return;
+			}
+			BatchQuery::Scratch & scratch = ctx->query->m_scratch[ctx->nextScratch.fetch_add(1, std::memory_order_relaxed)];
+			if (phase == 1) {
+				regions(scratch);
+			}
+			else {
+				copy(scratch);
+			}
+		}
+	};
+	
+	query.m_offsets.assign(pointsSize+1, 0);
+	query.m_regionIds.clear();
+	if (!pointsSize) {
+		return;
+	}
+	
+	WorkContext wctx;
+	wctx.tree = this;
+	wctx.points = points;
+	wctx.pointsSize = pointsSize;
+	wctx.query = &query;
+	threadCount = std::min<uint32_t>(threadCount, (pointsSize + ChunkSize - 1)/ChunkSize);
+	
+	query.m_cells.resize(pointsSize);
+	sserialize::ThreadPool::execute(Worker(&wctx, 0), threadCount, sserialize::ThreadPool::CopyTaskTag());
+	
+	//counting sort of the points by their cell, points without cell are not part of the order
+	const std::size_t cellCount = std::max<std::size_t>(m_cellTrees.size(), 1);
+	query.m_cellOffsets.assign(cellCount+1, 0);
+	for(uint32_t cell : query.m_cells) {
+		if (cell != NoCell) {
+			++query.m_cellOffsets[cell+1];
+		}
+	}
+	for(std::size_t i(1); i <= cellCount; ++i) {
+		query.m_cellOffsets[i] += query.m_cellOffsets[i-1];
+	}
+	query.m_order.resize(query.m_cellOffsets.back());
+	for(std::size_t i(0); i < pointsSize; ++i) {
+		uint32_t cell = query.m_cells[i];
+		if (cell != NoCell) {
+			query.m_order[query.m_cellOffsets[cell]] = i;
+			++query.m_cellOffsets[cell];
+		}
+	}
+	//m_cellOffsets[i] is now the end of cell i, shift it back
+	for(std::size_t i(cellCount); i > 0; --i) {
+		query.m_cellOffsets[i] = query.m_cellOffsets[i-1];
+	}
+	query.m_cellOffsets[0] = 0;
+	
+	if (query.m_scratch.size() < threadCount) {
+		query.m_scratch.resize(threadCount);
+	}
+	wctx.nextChunk = 0;
+	wctx.nextScratch = 0;
+	sserialize::ThreadPool::execute(Worker(&wctx, 1), threadCount, sserialize::ThreadPool::CopyTaskTag());
+	
+	for(std::size_t i(1); i <= pointsSize; ++i) {
+		query.m_offsets[i] += query.m_offsets[i-1];
+	}
+	query.m_regionIds.resize(query.m_offsets.back());
+	
+	wctx.nextScratch = 0;
+	sserialize::ThreadPool::execute(Worker(&wctx, 2), threadCount, sserialize::ThreadPool::CopyTaskTag());
 }
 
 
@@ -787,7 +787,7 @@ OsmTriangulationRegionStore::init(std::shared_ptr<OsmGridRegionTreeBase> grt, ui
 		auto handlePolygonPoints = [&gpToId](const GeoPolygon * gp) {
 			typename GeoPolygon::const_iterator it(gp->cbegin()), end(gp->cend());
 			for(; it != end; ++it) {
-				RawGeoPoint itGp = *it;
+				RawGeoPoint itGp(it->lat(), it->lon());
 				if (!gpToId.count(itGp)) {
 					uint32_t gpId = (uint32_t) gpToId.size();
 					gpToId[itGp] = gpId;
@@ -816,8 +816,8 @@ OsmTriangulationRegionStore::init(std::shared_ptr<OsmGridRegionTreeBase> grt, ui
 		auto handlePolygonSegments = [&gpToId, &segments](const GeoPolygon * gp) {
 			typename GeoPolygon::const_iterator it(gp->cbegin()), prev(gp->cbegin()), end(gp->cend());
 			for(++it; it != end; ++it, ++prev) {
-				RawGeoPoint itGp = *it;
-				RawGeoPoint prevGp = *prev;
+				RawGeoPoint itGp(it->lat(), it->lon());
+				RawGeoPoint prevGp(prev->lat(), prev->lon());
 				if ((itGp.second < -179.0 && prevGp.second > 179.0) || (itGp.second > 179.0 && prevGp.second < -179)) {
 					std::cout << "Skipped edge crossing longitude boundary(-180->180)\n";
 					continue;
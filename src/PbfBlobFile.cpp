@@ -0,0 +1,604 @@
+#include <osmtools/PbfBlobFile.h>
+#include <osmpbf/inode.h>
+#include <osmpbf/iway.h>
+#include <osmpbf/irelation.h>
+#include <fstream>
+#include <limits>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+namespace osmtools {
+namespace detail {
+namespace PbfBlobFile {
+
+//Minimal protobuf wire-format reader, enough for BlobHeader and Blob messages
+class ProtoReader {
+public:
+	ProtoReader(const char * begin, const char * end) : m_it(begin), m_end(end) {}
+	bool atEnd() const { return m_it >= m_end; }
+	bool varint(uint64_t & v) {
+		v = 0;
+		for(uint32_t shift(0); shift < 64 && m_it < m_end; shift += 7) {
+			uint8_t c = (uint8_t) *m_it;
+			++m_it;
+			v |= uint64_t(c & 0x7F) << shift;
+			if (!(c & 0x80)) {
+				return true;
+			}
+		}
+		return false;
+	}
+	bool key(uint32_t & field, uint32_t & wireType) {
+		uint64_t v;
+		if (!varint(v)) {
+			return false;
+		}
+		field = (uint32_t) (v >> 3);
+		wireType = (uint32_t) (v & 0x7);
+		return true;
+	}
+	bool bytes(const char* & begin, std::size_t & size) {
+		uint64_t len;
+		if (!varint(len) || len > (uint64_t)(m_end-m_it)) {
+			return false;
+		}
+		begin = m_it;
+		size = len;
+		m_it += len;
+		return true;
+	}
+	bool skip(uint32_t wireType) {
+		uint64_t v;
+		const char * b;
+		std::size_t s;
+		switch (wireType) {
+		case 0:
+			return varint(v);
+		case 1:
+			m_it += 8;
+			return m_it <= m_end;
+		case 2:
+			return bytes(b, s);
+		case 5:
+			m_it += 4;
+			return m_it <= m_end;
+		default:
+			return false;
+		}
+	}
+private:
+	const char * m_it;
+	const char * m_end;
+};
+
+bool inflate(const char * src, std::size_t srcSize, char * dest, std::size_t destSize) {
+	z_stream zs;
+	::memset(&zs, 0, sizeof(zs));
+	zs.next_in = (Bytef*) src;
+	zs.avail_in = (uInt) srcSize;
+	zs.next_out = (Bytef*) dest;
+	zs.avail_out = (uInt) destSize;
+	if (::inflateInit(&zs) != Z_OK) {
+		return false;
+	}
+	int ret = ::inflate(&zs, Z_FINISH);
+	::inflateEnd(&zs);
+	return ret == Z_STREAM_END && zs.total_out == destSize;
+}
+
+static const char IndexMagic[8] = {'O', 'S', 'M', 'T', 'B', 'I', 'D', 'X'};
+static const uint32_t IndexVersion = 3;
+
+//Fields of the sidecar-file are stored one by one in little-endian byte order, independent of the layout of PbfBlobInfo
+class IndexWriter {
+public:
+	IndexWriter(std::ostream & out) : m_out(out) {}
+	void put(uint64_t v, uint32_t size) {
+		char buf[8];
+		for(uint32_t i(0); i < size; ++i) {
+			buf[i] = (char) ((v >> (8*i)) & 0xFF);
+		}
+		m_out.write(buf, size);
+	}
+	void u32(uint32_t v) { put(v, 4); }
+	void u64(uint64_t v) { put(v, 8); }
+	void i64(int64_t v) { put((uint64_t) v, 8); }
+	void blob(const PbfBlobInfo & info) {
+		u64(info.offset);
+		u32(info.headerSize);
+		u32(info.dataSize);
+		u32(info.kinds);
+		i64(info.minNodeId);
+		i64(info.maxNodeId);
+		i64(info.minWayId);
+		i64(info.maxWayId);
+		i64(info.minRelationId);
+		i64(info.maxRelationId);
+	}
+private:
+	std::ostream & m_out;
+};
+
+class IndexReader {
+public:
+	IndexReader(std::istream & in) : m_in(in) {}
+	uint64_t get(uint32_t size) {
+		unsigned char buf[8] = {0};
+		m_in.read((char*) buf, size);
+		uint64_t v = 0;
+		for(uint32_t i(0); i < size; ++i) {
+			v |= uint64_t(buf[i]) << (8*i);
+		}
+		return v;
+	}
+	uint32_t u32() { return (uint32_t) get(4); }
+	uint64_t u64() { return get(8); }
+	int64_t i64() { return (int64_t) get(8); }
+	void blob(PbfBlobInfo & info) {
+		info.offset = u64();
+		info.headerSize = u32();
+		info.dataSize = u32();
+		info.kinds = u32();
+		info.minNodeId = i64();
+		info.maxNodeId = i64();
+		info.minWayId = i64();
+		info.maxWayId = i64();
+		info.minRelationId = i64();
+		info.maxRelationId = i64();
+	}
+private:
+	std::istream & m_in;
+};
+
+}}//end namespace detail::PbfBlobFile
+
+//BEGIN: PbfBlobIndex
+
+PbfBlobIndex::PbfBlobIndex() : m_complete(false) {}
+
+PbfBlobIndex::~PbfBlobIndex() {}
+
+bool PbfBlobIndex::complete() const {
+	return m_complete;
+}
+
+std::size_t PbfBlobIndex::size() const {
+	return m_blobs.size();
+}
+
+const PbfBlobInfo & PbfBlobIndex::at(std::size_t pos) const {
+	return m_blobs.at(pos);
+}
+
+const PbfBlobIndex::BlobsContainer & PbfBlobIndex::blobs() const {
+	return m_blobs;
+}
+
+void PbfBlobIndex::clear() {
+	m_blobs = BlobsContainer();
+	m_complete = false;
+}
+
+std::string PbfBlobIndex::sidecarFileName(const std::string & fileName, const std::string & directory) {
+	if (directory.empty()) {
+		return fileName + ".blobidx";
+	}
+	std::string::size_type sep = fileName.rfind('/');
+	return directory + "/" + (sep == std::string::npos ? fileName : fileName.substr(sep+1)) + ".blobidx";
+}
+
+bool PbfBlobIndex::load(const std::string & fileName, const std::string & directory) {
+	struct ::stat st;
+	if (::stat(fileName.c_str(), &st) != 0) {
+		return false;
+	}
+	std::ifstream in(sidecarFileName(fileName, directory), std::ios::in | std::ios::binary);
+	if (!in.is_open()) {
+		return false;
+	}
+	detail::PbfBlobFile::IndexReader reader(in);
+	char magic[8];
+	in.read(magic, sizeof(magic));
+	uint32_t version = reader.u32();
+	uint64_t fileSize = reader.u64();
+	int64_t mtime = reader.i64();
+	uint64_t count = reader.u64();
+	if (!in || ::memcmp(magic, detail::PbfBlobFile::IndexMagic, sizeof(magic)) != 0 || version != detail::PbfBlobFile::IndexVersion) {
+		return false;
+	}
+	if (fileSize != (uint64_t) st.st_size || mtime != (int64_t) st.st_mtime) {
+		return false;
+	}
+	//every blob takes at least a few bytes of the file, hence a larger count is a corrupt index
+	if (count > fileSize) {
+		return false;
+	}
+	BlobsContainer tmp(count);
+	for(PbfBlobInfo & info : tmp) {
+		reader.blob(info);
+	}
+	if (!in) {
+		return false;
+	}
+	m_blobs.swap(tmp);
+	m_complete = true;
+	return true;
+}
+
+bool PbfBlobIndex::store(const std::string & fileName, const std::string & directory) const {
+	struct ::stat st;
+	if (!m_complete || ::stat(fileName.c_str(), &st) != 0) {
+		return false;
+	}
+	std::ofstream out(sidecarFileName(fileName, directory), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		return false;
+	}
+	detail::PbfBlobFile::IndexWriter writer(out);
+	out.write(detail::PbfBlobFile::IndexMagic, sizeof(detail::PbfBlobFile::IndexMagic));
+	writer.u32(detail::PbfBlobFile::IndexVersion);
+	writer.u64(st.st_size);
+	writer.i64(st.st_mtime);
+	writer.u64(m_blobs.size());
+	for(const PbfBlobInfo & info : m_blobs) {
+		writer.blob(info);
+	}
+	return (bool) out;
+}
+
+void PbfBlobIndex::fill(PbfBlobInfo & info, osmpbf::PrimitiveBlockInputAdaptor & pbi) {
+	info.kinds &= PbfBlobInfo::BK_HEADER;
+	if (pbi.nodesSize()) {
+		info.kinds |= PbfBlobInfo::BK_NODES;
+		info.minNodeId = std::numeric_limits<int64_t>::max();
+		info.maxNodeId = std::numeric_limits<int64_t>::min();
+		for(osmpbf::INodeStream node(pbi.getNodeStream()); !node.isNull(); node.next()) {
+			info.minNodeId = std::min<int64_t>(info.minNodeId, node.id());
+			info.maxNodeId = std::max<int64_t>(info.maxNodeId, node.id());
+		}
+	}
+	if (pbi.waysSize()) {
+		info.kinds |= PbfBlobInfo::BK_WAYS;
+		info.minWayId = std::numeric_limits<int64_t>::max();
+		info.maxWayId = std::numeric_limits<int64_t>::min();
+		for(osmpbf::IWayStream way(pbi.getWayStream()); !way.isNull(); way.next()) {
+			info.minWayId = std::min<int64_t>(info.minWayId, way.id());
+			info.maxWayId = std::max<int64_t>(info.maxWayId, way.id());
+		}
+	}
+	if (pbi.relationsSize()) {
+		info.kinds |= PbfBlobInfo::BK_RELATIONS;
+		info.minRelationId = std::numeric_limits<int64_t>::max();
+		info.maxRelationId = std::numeric_limits<int64_t>::min();
+		for(osmpbf::IRelationStream rel(pbi.getRelationStream()); !rel.isNull(); rel.next()) {
+			info.minRelationId = std::min<int64_t>(info.minRelationId, rel.id());
+			info.maxRelationId = std::max<int64_t>(info.maxRelationId, rel.id());
+		}
+	}
+}
+
+//END: PbfBlobIndex
+
+//BEGIN: PbfBlobFile
+
+PbfBlobFile::PbfBlobFile(const std::string & fileName) :
+m_fileName(fileName),
+m_fd(-1),
+m_data(0),
+m_size(0),
+m_mtime(0),
+m_scanOffset(0),
+m_unresolvedBlobs(0),
+m_scanError(false),
+m_dataPosition(0)
+{}
+
+PbfBlobFile::~PbfBlobFile() {
+	close();
+}
+
+bool PbfBlobFile::open() {
+	close();
+	m_fd = ::open(m_fileName.c_str(), O_RDONLY);
+	if (m_fd < 0) {
+		return false;
+	}
+	struct ::stat st;
+	if (::fstat(m_fd, &st) != 0) {
+		close();
+		return false;
+	}
+	m_size = st.st_size;
+	m_mtime = st.st_mtime;
+	//blobs are read from the page cache without copies, reading falls back to pread if the file can not be mapped
+	if (m_size) {
+		void * data = ::mmap(0, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+		if (data != MAP_FAILED) {
+			m_data = (const char*) data;
+		}
+	}
+	m_index.clear();
+	reset();
+	return true;
+}
+
+void PbfBlobFile::close() {
+	if (m_data) {
+		::munmap((void*) m_data, m_size);
+		m_data = 0;
+	}
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+const std::string & PbfBlobFile::fileName() const {
+	return m_fileName;
+}
+
+uint64_t PbfBlobFile::dataSize() const {
+	return m_size;
+}
+
+uint64_t PbfBlobFile::dataPosition() const {
+	return m_dataPosition.load(std::memory_order_relaxed);
+}
+
+void PbfBlobFile::reset() {
+	std::lock_guard<std::mutex> lck(m_scanLock);
+	m_scanOffset = 0;
+	m_unresolvedBlobs = 0;
+	m_scanError = false;
+	m_dataPosition = 0;
+	if (!m_index.complete()) {
+		m_index.m_blobs.clear();
+	}
+	//every scan reads blobs in ascending order, hence aggressive read-ahead pays off
+	if (m_data) {
+		::madvise((void*) m_data, m_size, MADV_SEQUENTIAL);
+	}
+}
+
+bool PbfBlobFile::mapped() const {
+	return m_data != 0;
+}
+
+const PbfBlobIndex & PbfBlobFile::index() const {
+	return m_index;
+}
+
+bool PbfBlobFile::loadIndex(const std::string & directory) {
+	return m_index.load(m_fileName, directory);
+}
+
+bool PbfBlobFile::storeIndex(const std::string & directory) const {
+	return m_index.store(m_fileName, directory);
+}
+
+bool PbfBlobFile::readAt(uint64_t offset, char * dest, std::size_t size) const {
+	while (size) {
+		ssize_t ret = ::pread(m_fd, dest, size, offset);
+		if (ret <= 0) {
+			return false;
+		}
+		dest += ret;
+		offset += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+const char * PbfBlobFile::dataAt(uint64_t offset, std::size_t size, BlobBuffer & buffer) const {
+	if (offset + size > m_size) {
+		return 0;
+	}
+	if (m_data) {
+		return m_data + offset;
+	}
+	buffer.resize(size);
+	return (readAt(offset, buffer.data(), size) ? buffer.data() : 0);
+}
+
+bool PbfBlobFile::readBlobHeader(uint64_t offset, PbfBlobInfo & info) const {
+	BlobBuffer buffer;
+	const unsigned char * lenBytes = (const unsigned char *) dataAt(offset, 4, buffer);
+	if (!lenBytes) {
+		return false;
+	}
+	uint32_t headerSize = (uint32_t(lenBytes[0]) << 24) | (uint32_t(lenBytes[1]) << 16) | (uint32_t(lenBytes[2]) << 8) | uint32_t(lenBytes[3]);
+	const char * header = dataAt(offset+4, headerSize, buffer);
+	if (!header) {
+		return false;
+	}
+	info = PbfBlobInfo();
+	info.offset = offset;
+	info.headerSize = headerSize;
+	detail::PbfBlobFile::ProtoReader pr(header, header+headerSize);
+	bool haveDataSize = false;
+	while (!pr.atEnd()) {
+		uint32_t field, wireType;
+		if (!pr.key(field, wireType)) {
+			return false;
+		}
+		if (field == 1 && wireType == 2) { //type
+			const char * type;
+			std::size_t typeSize;
+			if (!pr.bytes(type, typeSize)) {
+				return false;
+			}
+			if (std::string(type, typeSize) == "OSMHeader") {
+				info.kinds = PbfBlobInfo::BK_HEADER;
+			}
+		}
+		else if (field == 3 && wireType == 0) { //datasize
+			uint64_t v;
+			if (!pr.varint(v)) {
+				return false;
+			}
+			info.dataSize = (uint32_t) v;
+			haveDataSize = true;
+		}
+		else if (!pr.skip(wireType)) {
+			return false;
+		}
+	}
+	return haveDataSize && info.endOffset() <= m_size;
+}
+
+bool PbfBlobFile::readBlob(const PbfBlobInfo & info, BlobBuffer & compressed, BlobBuffer & dest) const {
+	const char * blob = dataAt(info.dataOffset(), info.dataSize, compressed);
+	if (!blob) {
+		return false;
+	}
+	detail::PbfBlobFile::ProtoReader pr(blob, blob+info.dataSize);
+	const char * raw = 0;
+	std::size_t rawSize = 0;
+	const char * zlibData = 0;
+	std::size_t zlibDataSize = 0;
+	uint64_t uncompressedSize = 0;
+	while (!pr.atEnd()) {
+		uint32_t field, wireType;
+		if (!pr.key(field, wireType)) {
+			return false;
+		}
+		if (field == 1 && wireType == 2) {
+			if (!pr.bytes(raw, rawSize)) {
+				return false;
+			}
+		}
+		else if (field == 2 && wireType == 0) {
+			if (!pr.varint(uncompressedSize)) {
+				return false;
+			}
+		}
+		else if (field == 3 && wireType == 2) {
+			if (!pr.bytes(zlibData, zlibDataSize)) {
+				return false;
+			}
+		}
+		else if (!pr.skip(wireType)) {
+			return false;
+		}
+	}
+	if (raw) {
+		dest.assign(raw, raw+rawSize);
+		return true;
+	}
+	if (zlibData) {
+		dest.resize(uncompressedSize);
+		return detail::PbfBlobFile::inflate(zlibData, zlibDataSize, dest.data(), dest.size());
+	}
+	//lzma, lz4 and zstd blobs are not supported
+	return false;
+}
+
+bool PbfBlobFile::nextBlob(PbfBlobInfo & info, uint32_t & blobId) {
+	std::lock_guard<std::mutex> lck(m_scanLock);
+	if (m_scanError || m_scanOffset >= m_size) {
+		return false;
+	}
+	if (!readBlobHeader(m_scanOffset, info)) {
+		std::cerr << "PbfBlobFile: invalid blob header at offset " << m_scanOffset << " in " << m_fileName << std::endl;
+		m_scanError = true;
+		return false;
+	}
+	m_scanOffset = info.endOffset();
+	m_dataPosition = m_scanOffset;
+	blobId = (uint32_t) m_index.m_blobs.size();
+	m_index.m_blobs.push_back(info);
+	if (!(info.kinds & PbfBlobInfo::BK_HEADER)) {
+		++m_unresolvedBlobs;
+	}
+	return true;
+}
+
+void PbfBlobFile::updateBlob(uint32_t blobId, const PbfBlobInfo & info) {
+	std::lock_guard<std::mutex> lck(m_scanLock);
+	m_index.m_blobs.at(blobId) = info;
+	--m_unresolvedBlobs;
+}
+
+void PbfBlobFile::advance(const PbfBlobInfo & info) {
+	m_dataPosition.store(info.endOffset(), std::memory_order_relaxed);
+}
+
+void PbfBlobFile::failScan() {
+	m_scanError = true;
+}
+
+bool PbfBlobFile::scanFailed() const {
+	return m_scanError.load();
+}
+
+void PbfBlobFile::finishScan() {
+	std::lock_guard<std::mutex> lck(m_scanLock);
+	//blobs that were not read have no kinds and id ranges, an index with such blobs would skip them in every later scan
+	if (!m_scanError && !m_unresolvedBlobs && m_scanOffset == m_size) {
+		m_index.m_complete = true;
+	}
+}
+
+//END: PbfBlobFile
+
+//BEGIN: BlobSequencer
+
+thread_local uint32_t BlobSequencer::s_currentBlob = 0;
+
+BlobSequencer::BlobSequencer() :
+m_next(0),
+m_waiting(0),
+m_highWaterMark(0)
+{}
+
+BlobSequencer::~BlobSequencer() {}
+
+void BlobSequencer::reset() {
+	std::lock_guard<std::mutex> lck(m_lock);
+	m_next = 0;
+	m_finished.clear();
+	m_waiting = 0;
+}
+
+void BlobSequencer::begin(uint32_t blobId) {
+	s_currentBlob = blobId;
+}
+
+void BlobSequencer::wait() {
+	uint32_t blobId = s_currentBlob;
+	std::unique_lock<std::mutex> lck(m_lock);
+	if (m_next >= blobId) {
+		return;
+	}
+	++m_waiting;
+	m_highWaterMark = std::max<uint32_t>(m_highWaterMark, m_waiting + (uint32_t) m_finished.size());
+	m_cv.wait(lck, [this, blobId]() { return m_next >= blobId; });
+	--m_waiting;
+}
+
+void BlobSequencer::finish(uint32_t blobId) {
+	std::lock_guard<std::mutex> lck(m_lock);
+	if (blobId != m_next) {
+		m_finished.insert(blobId);
+		m_highWaterMark = std::max<uint32_t>(m_highWaterMark, m_waiting + (uint32_t) m_finished.size());
+		return;
+	}
+	++m_next;
+	for(std::unordered_set<uint32_t>::iterator it(m_finished.find(m_next)); it != m_finished.end(); it = m_finished.find(m_next)) {
+		m_finished.erase(it);
+		++m_next;
+	}
+	m_cv.notify_all();
+}
+
+uint32_t BlobSequencer::highWaterMark() const {
+	return m_highWaterMark;
+}
+
+//END: BlobSequencer
+
+}//end namespace osmtools
@@ -0,0 +1,160 @@
+#include <osmtools/TagStore.h>
+#include <algorithm>
+#include <stdexcept>
+
+namespace osmtools {
+
+constexpr TagStore::RowId TagStore::NoRow;
+constexpr TagStore::ValueId TagStore::NoValue;
+constexpr uint32_t TagStore::NoKey;
+constexpr TagStore::RowId TagStore::ChunkRows;
+constexpr std::size_t TagStore::MaxChunks;
+constexpr uint32_t TagStore::BlockProjector::Unresolved;
+
+//BEGIN: TagStore::BlockProjector
+
+TagStore::BlockProjector::BlockProjector(TagStore * store) :
+m_store(store),
+m_pbi(0),
+m_row(store->keys().size(), NoValue)
+{}
+
+TagStore::BlockProjector::~BlockProjector() {}
+
+void TagStore::BlockProjector::reset(osmpbf::PrimitiveBlockInputAdaptor & pbi) {
+	m_pbi = &pbi;
+	m_keyIndex.assign(pbi.stringTableSize(), Unresolved);
+	m_valueIds.assign(pbi.stringTableSize(), Unresolved);
+}
+
+TagStore::RowId TagStore::BlockProjector::push_back(const osmpbf::IPrimitive & primitive) {
+	std::fill(m_row.begin(), m_row.end(), NoValue);
+	for(int i(0), s(primitive.tagsSize()); i < s; ++i) {
+		uint32_t keyId = primitive.keyId(i);
+		if (keyId >= m_keyIndex.size()) {
+			continue;
+		}
+		uint32_t & keyIndex = m_keyIndex[keyId];
+		if (keyIndex == Unresolved) {
+			keyIndex = m_store->keyIndex(m_pbi->queryStringTable(keyId));
+		}
+		if (keyIndex == NoKey) {
+			continue;
+		}
+		uint32_t valueId = primitive.valueId(i);
+		if (valueId >= m_valueIds.size()) {
+			continue;
+		}
+		ValueId & v = m_valueIds[valueId];
+		if (v == Unresolved) {
+			v = m_store->insert(m_pbi->queryStringTable(valueId));
+		}
+		m_row[keyIndex] = v;
+	}
+	return m_store->push_back(m_row.data());
+}
+
+//END: TagStore::BlockProjector
+
+//BEGIN: TagStore
+
+TagStore::TagStore(const std::vector<std::string> & keys) :
+m_keys(keys),
+m_chunks(new std::atomic<ValueId*>[MaxChunks]),
+m_rows(0)
+{
+	for(std::size_t i(0); i < MaxChunks; ++i) {
+		m_chunks[i].store(0, std::memory_order_relaxed);
+	}
+	for(uint32_t i(0), s((uint32_t) keys.size()); i < s; ++i) {
+		m_keyIndex[keys[i]] = i;
+	}
+	//NoValue
+	insert(std::string());
+}
+
+TagStore::~TagStore() {
+	for(std::size_t i(0); i < MaxChunks; ++i) {
+		delete[] m_chunks[i].load(std::memory_order_relaxed);
+	}
+}
+
+const std::vector<std::string> & TagStore::keys() const {
+	return m_keys;
+}
+
+uint32_t TagStore::keyIndex(const std::string & key) const {
+	std::unordered_map<std::string, uint32_t>::const_iterator it = m_keyIndex.find(key);
+	return (it != m_keyIndex.cend() ? it->second : NoKey);
+}
+
+std::size_t TagStore::size() const {
+	return m_rows.load(std::memory_order_acquire);
+}
+
+std::size_t TagStore::valuesSize() const {
+	return m_values.size();
+}
+
+std::size_t TagStore::storageSize() const {
+	std::size_t result = MaxChunks*sizeof(std::atomic<ValueId*>);
+	for(std::size_t i(0); i < MaxChunks; ++i) {
+		if (m_chunks[i].load(std::memory_order_relaxed)) {
+			result += std::max<std::size_t>(m_keys.size(), 1)*ChunkRows*sizeof(ValueId);
+		}
+	}
+	for(const std::string & value : m_values) {
+		result += sizeof(std::string) + value.capacity();
+	}
+	return result;
+}
+
+TagStore::ValueId TagStore::find(const std::string & value) const {
+	std::unordered_map<std::string, ValueId>::const_iterator it = m_valueIds.find(value);
+	return (it != m_valueIds.cend() ? it->second : NoValue);
+}
+
+TagStore::ValueId TagStore::insert(const std::string & value) {
+	std::lock_guard<std::mutex> lck(m_lock);
+	std::unordered_map<std::string, ValueId>::const_iterator it = m_valueIds.find(value);
+	if (it != m_valueIds.cend()) {
+		return it->second;
+	}
+	ValueId id = (ValueId) m_values.size();
+	m_values.push_back(value);
+	m_valueIds[value] = id;
+	return id;
+}
+
+TagStore::RowId TagStore::push_back(const ValueId * values) {
+	RowId row = m_rows.fetch_add(1, std::memory_order_relaxed);
+	if (row == NoRow) {
+		throw std::out_of_range("TagStore: too many rows");
+	}
+	ValueId * dest = chunk(row/ChunkRows) + row%ChunkRows;
+	for(std::size_t i(0), s(m_keys.size()); i < s; ++i) {
+		dest[i*ChunkRows] = values[i];
+	}
+	return row;
+}
+
+TagStore::ValueId * TagStore::chunk(std::size_t chunkId) {
+	ValueId * result = m_chunks[chunkId].load(std::memory_order_acquire);
+	if (!result) {
+		//rows of the chunk not yet added by any projector have no values
+		ValueId * tmp = new ValueId[std::max<std::size_t>(m_keys.size(), 1)*ChunkRows];
+		std::fill(tmp, tmp+std::max<std::size_t>(m_keys.size(), 1)*ChunkRows, NoValue);
+		if (m_chunks[chunkId].compare_exchange_strong(result, tmp, std::memory_order_acq_rel)) {
+			result = tmp;
+		}
+		else {
+			//another thread allocated the chunk first
+			delete[] tmp;
+		}
+	}
+	return result;
+}
+
+//END: TagStore
+
+}//end namespace osmtools
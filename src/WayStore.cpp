@@ -0,0 +1,159 @@
+#include <osmtools/WayStore.h>
+#include <sserialize/mt/ThreadPool.h>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+namespace osmtools {
+
+constexpr std::size_t RawWayStore::npos;
+constexpr std::size_t RawWayStore::FlushRefs;
+constexpr std::size_t RawWayStore::MapChunkRefs;
+constexpr std::size_t RawWayStore::WayIndexBytes;
+
+RawWayStore::RawWayStore() :
+m_refs(sserialize::MM_PROGRAM_MEMORY),
+m_refsStorage(sserialize::MM_PROGRAM_MEMORY),
+m_locations(sserialize::MM_PROGRAM_MEMORY)
+{}
+
+RawWayStore::~RawWayStore() {}
+
+void RawWayStore::setRefsStorage(sserialize::MmappedMemoryType mmt) {
+	m_refsStorage = mmt;
+	if (!m_refs.size()) {
+		m_refs = sserialize::MMVector<int64_t>(m_refsStorage);
+	}
+}
+
+void RawWayStore::setFlushCallback(const FlushCallback & cb) {
+	m_flushCallback = cb;
+}
+
+void RawWayStore::assign(std::vector<int64_t> && ids) {
+	m_ids = std::move(ids);
+	m_ids.shrink_to_fit();
+	m_offsets.assign(m_ids.size(), 0);
+	m_sizes.assign(m_ids.size(), 0);
+}
+
+void RawWayStore::clear() {
+	m_ids = std::vector<int64_t>();
+	m_offsets = std::vector<uint64_t>();
+	m_sizes = std::vector<uint32_t>();
+	m_refs = sserialize::MMVector<int64_t>(m_refsStorage);
+	m_locations = sserialize::MMVector<int64_t>(sserialize::MM_PROGRAM_MEMORY);
+	m_buffers.clear();
+	m_flushCallback = FlushCallback();
+}
+
+std::size_t RawWayStore::size() const {
+	return m_ids.size();
+}
+
+bool RawWayStore::empty() const {
+	return m_ids.empty();
+}
+
+int64_t RawWayStore::minId() const {
+	return (m_ids.size() ? m_ids.front() : std::numeric_limits<int64_t>::max());
+}
+
+int64_t RawWayStore::maxId() const {
+	return (m_ids.size() ? m_ids.back() : std::numeric_limits<int64_t>::min());
+}
+
+RawWayStore::Buffer * RawWayStore::buffer() {
+	std::lock_guard<std::mutex> lck(m_lock);
+	m_buffers.emplace_back(this);
+	return &m_buffers.back();
+}
+
+void RawWayStore::flush(Buffer & buffer) {
+	uint64_t offset;
+	{
+		std::lock_guard<std::mutex> lck(m_lock);
+		offset = m_refs.size();
+		m_refs.push_back(buffer.m_pending.begin(), buffer.m_pending.end());
+	}
+	if (m_flushCallback && buffer.m_pending.size()) {
+		m_flushCallback(buffer.m_pending.data(), buffer.m_pending.size(), offset);
+	}
+	for(std::size_t i(buffer.m_offsets.size()), s(buffer.m_ids.size()); i < s; ++i) {
+		buffer.m_offsets.push_back(offset);
+		offset += buffer.m_sizes[i];
+	}
+	buffer.m_pending.clear();
+}
+
+uint64_t RawWayStore::refsSize() const {
+	return m_refs.size();
+}
+
+std::vector<int64_t> RawWayStore::bufferedIds() const {
+	std::vector<int64_t> result;
+	for(const Buffer & b : m_buffers) {
+		result.insert(result.end(), b.m_ids.cbegin(), b.m_ids.cend());
+	}
+	std::sort(result.begin(), result.end());
+	result.resize(std::unique(result.begin(), result.end()) - result.begin());
+	return result;
+}
+
+void RawWayStore::beginLocations(sserialize::MmappedMemoryType mmt, int64_t init) {
+	m_locations = sserialize::MMVector<int64_t>(mmt);
+	m_locations.resize(m_refs.size());
+	std::fill(m_locations.begin(), m_locations.end(), init);
+}
+
+void RawWayStore::finalize(uint32_t threadCount) {
+	if (!threadCount) {
+		threadCount = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+	}
+	
+	for(Buffer & b : m_buffers) {
+		if (b.m_offsets.size() < b.m_ids.size()) {
+			flush(b);
+		}
+	}
+	
+	struct WorkContext {
+		std::atomic<std::size_t> nextBuffer{0};
+		RawWayStore * store;
+	};
+	
+	//set offset and size of the ways of every buffer, the refs stay where the buffer flushed them
+	//every way is part of exactly one buffer, hence threads write to different positions
+	struct Worker {
+		WorkContext * ctx;
+		Worker(WorkContext * ctx) : ctx(ctx) {}
+		Worker(const Worker & other) : ctx(other.ctx) {}
+		void operator()() {
+			RawWayStore & store = *(ctx->store);
+			while (true) {
+				std::size_t bufferId = ctx->nextBuffer.fetch_add(1, std::memory_order_relaxed);
+				if (bufferId >= store.m_buffers.size()) {
+					return;
+				}
+				Buffer & b = store.m_buffers[bufferId];
+				for(std::size_t i(0), s(b.m_ids.size()); i < s; ++i) {
+					std::size_t pos = store.find(b.m_ids[i]);
+					if (pos != npos) {
+						store.m_offsets[pos] = b.m_offsets[i];
+						store.m_sizes[pos] = b.m_sizes[i];
+					}
+				}
+				b = Buffer(&store);
+			}
+		}
+	};
+	
+	WorkContext wctx;
+	wctx.store = this;
+	m_offsets.assign(m_ids.size(), 0);
+	m_sizes.assign(m_ids.size(), 0);
+	sserialize::ThreadPool::execute(Worker(&wctx), threadCount, sserialize::ThreadPool::CopyTaskTag());
+	m_buffers.clear();
+}
+
+}//end namespace osmtools